@@ -15,7 +15,6 @@ apt-get install -y --no-install-recommends \
   moreutils \
   gawk \
   cc1541 \
-  cpmtools \
   libfmt-dev \
   ninja-build \
   fp-compiler 
@@ -130,6 +130,11 @@ static SymbolRecord* exprVariable[EXPR_STACK_SIZE];
 static uint8_t* top;
 
 static int8_t relocationBuffer;
+static uint16_t lastRelocation;
+static bool relocationsV2 = false;
+static uint8_t relocationPage; /* of the last group written */
+static uint8_t groupPage;      /* of the group being collected */
+static uint8_t groupCount;
 
 enum
 {
@@ -1300,6 +1305,12 @@ static void consumeDotExpand()
     defaultBranchSize = tokenValue ? 5 : 2;
 }
 
+static void consumeDotRelocations()
+{
+    consumeConstExpression();
+    relocationsV2 = (tokenValue == 2);
+}
+
 static void consumeDotLabel()
 {
     consumeExpression();
@@ -1474,6 +1485,7 @@ static void parse()
         {"word", consumeDotWord},
         {"fill", consumeDotFill},
         {"expand", consumeDotExpand},
+        {"relocations", consumeDotRelocations},
         {"label", consumeDotLabel},
         {"include", consumeInclude},
         {}
@@ -1814,7 +1826,16 @@ exit:;
 
 static void writeHeader()
 {
-    writeByte(zpUsage);
+    /* The top bit of the zero page usage marks version 2 relocations. */
+
+    if (relocationsV2)
+    {
+        if (zpUsage & 0x80)
+            fatal("too much zero page for version 2 relocations");
+        writeByte(zpUsage | 0x80);
+    }
+    else
+        writeByte(zpUsage);
     writeByte((textUsage + 255) >> 8);
     writeByte(textUsage & 0xff);
     writeByte(textUsage >> 8);
@@ -1826,6 +1847,9 @@ static void writeHeader()
 static void resetRelocationWriter()
 {
     relocationBuffer = -1;
+    lastRelocation = 0;
+    relocationPage = 0;
+    groupCount = 0;
 }
 
 static void writeRelocation(uint8_t nibble)
@@ -1849,19 +1873,60 @@ static void writeRelocationFor(uint16_t delta)
     writeRelocation(delta);
 }
 
+/* Version 2 relocations are written a page at a time, so each page's offsets
+ * are collected past the end of the records until the next page is reached. */
+
+static void writeRelocationGroup()
+{
+    if (groupCount)
+    {
+        writeByte(groupPage - relocationPage);
+        writeByte(groupCount);
+        for (uint8_t i = 0; i < groupCount; i++)
+            writeByte(top[i]);
+        relocationPage = groupPage;
+        groupCount = 0;
+    }
+}
+
+static void writeRelocationAt(uint16_t address)
+{
+    if (relocationsV2)
+    {
+        uint8_t page = address >> 8;
+        if ((page != groupPage) || (groupCount == 0xff))
+            writeRelocationGroup();
+        groupPage = page;
+        top[groupCount++] = address;
+    }
+    else
+    {
+        writeRelocationFor(address - lastRelocation);
+        lastRelocation = address;
+    }
+}
+
 static void flushRelocations()
 {
-    if (relocationBuffer != -1)
-        writeRelocation(0);
+    if (relocationsV2)
+    {
+        writeRelocationGroup();
+        writeByte(0xff);
+    }
+    else
+    {
+        writeRelocation(0xf);
+        if (relocationBuffer != -1)
+            writeRelocation(0);
+    }
 }
 
 static void writeTextRelocations()
 {
     uint8_t* r = cpm_ram;
     uint16_t pc = START_ADDRESS;
-    uint16_t lastRelocation = 3;
     resetRelocationWriter();
-    writeRelocationFor(3);
+    writeRelocationAt(3);
 
     for (;;)
     {
@@ -1899,8 +1964,7 @@ static void writeTextRelocations()
                                 address--;
                         }
 
-                        writeRelocationFor(address - lastRelocation);
-                        lastRelocation = address;
+                        writeRelocationAt(address);
                     }
                 }
                 pc += len;
@@ -1915,7 +1979,6 @@ static void writeTextRelocations()
     }
 
 exit:
-    writeRelocation(0xf);
     flushRelocations();
 }
 
@@ -1923,7 +1986,6 @@ static void writeZPRelocations()
 {
     uint8_t* r = cpm_ram;
     uint16_t pc = START_ADDRESS;
-    uint16_t lastRelocation = 0;
     resetRelocationWriter();
 
     for (;;)
@@ -1958,8 +2020,7 @@ static void writeZPRelocations()
 
                     if (s->postprocessing != PP_MSB)
                     {
-                        writeRelocationFor(address - lastRelocation);
-                        lastRelocation = address;
+                        writeRelocationAt(address);
                     }
                 }
                 pc += length;
@@ -1974,7 +2035,6 @@ static void writeZPRelocations()
     }
 
 exit:
-    writeRelocation(0xf);
     flushRelocations();
 }
 
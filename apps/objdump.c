@@ -16,8 +16,10 @@
 
 static char outbuffer[64];
 static char* outptr;
-static uint8_t* zprelos;
-static uint8_t* tparelos;
+static uint16_t* zprelos;
+static uint16_t* tparelos;
+static uint16_t* reloptr;
+static uint16_t reloaddress;
 
 struct insn
 {
@@ -210,19 +212,47 @@ static int disassemble(uint16_t ip)
     return insn->cb(ip, b);
 }
 
-static uint16_t getrelo(uint8_t** ptr)
+static bool addrelo(uint8_t nibble)
 {
-	uint16_t delta = 0;
-	for (;;)
+	if (nibble == 0xf)
+		return true;
+	reloaddress += nibble;
+	if (nibble != 0xe)
+		*reloptr++ = reloaddress;
+	return false;
+}
+
+/* Decodes a relocation table into a list of addresses at reloptr, ending with
+ * 0xffff. Returns the byte after the table. */
+
+static uint8_t* getrelos(uint8_t* r, bool v2)
+{
+	reloaddress = 0;
+	if (v2)
+	{
+		for (;;)
+		{
+			uint8_t skip = *r++;
+			if (skip == 0xff)
+				break;
+			reloaddress += skip << 8;
+
+			uint8_t count = *r++;
+			while (count--)
+				*reloptr++ = reloaddress | *r++;
+		}
+	}
+	else
 	{
-		uint8_t b = *(*ptr)++;
-		delta += b;
-		if (b == 0xf)
-			return 0xffff;
-		if (b != 0xe)
-			break;
+		for (;;)
+		{
+			uint8_t b = *r++;
+			if (addrelo(b >> 4) || addrelo(b & 0x0f))
+				break;
+		}
 	}
-	return delta;
+	*reloptr++ = 0xffff;
+	return r;
 }
 
 int main(int argc, char* argv[])
@@ -249,45 +279,33 @@ int main(int argc, char* argv[])
 
     outptr = outbuffer;
     os("ZP: ");
-    oh2(cpm_ram[0]);
+    oh2(cpm_ram[0] & 0x7f);
     os(" TPA: ");
     oh2(cpm_ram[1]);
     uint16_t relo = *(uint16_t*)&cpm_ram[2];
 
-	{
-		uint8_t* r = cpm_ram + relo;
+	/* The top bit of the zero page usage marks version 2 relocation data. */
 
-		zprelos = ptr;
-		for (;;)
-		{
-			uint8_t b = *r++;
-			*ptr++ = b >> 4;
-			*ptr++ = b & 0xf;
-			if (((b & 0xf0) == 0xf0) || ((b & 0x0f) == 0x0f))
-				break;
-		}
+	uint8_t* r = cpm_ram + relo;
+	bool v2 = cpm_ram[0] & 0x80;
 
-		tparelos = ptr;
-		for (;;)
-		{
-			uint8_t b = *r++;
-			*ptr++ = b >> 4;
-			*ptr++ = b & 0xf;
-			if (((b & 0xf0) == 0xf0) || ((b & 0x0f) == 0x0f))
-				break;
-		}
-	}
+	reloptr = (uint16_t*)ptr;
+	zprelos = reloptr;
+	r = getrelos(r, v2);
+	uint16_t tparelo = r - cpm_ram;
+	tparelos = reloptr;
+	getrelos(r, v2);
 
 	os(" ZPRELO: ");
 	oh4(relo);
 	os(" TPARELO: ");
-	oh4(tparelos - zprelos + relo);
+	oh4(tparelo);
+	if (v2)
+		os(" V2");
 	*outptr = 0;
 	printx(outbuffer);
 
     uint16_t ip = 0;
-	uint16_t nextzprelo = getrelo(&zprelos);
-	uint16_t nexttparelo = getrelo(&tparelos);
     while (ip < relo)
     {
         outptr = outbuffer;
@@ -316,23 +334,23 @@ int main(int argc, char* argv[])
 
 		do
 		{
-			if (ip == nextzprelo)
+			if (ip == *zprelos)
 			{
 				outptr = outbuffer;
 				os("  ZPRELO ");
 				oh4(ip);
 				*outptr = 0;
 				printx(outbuffer);
-				nextzprelo += getrelo(&zprelos);
+				zprelos++;
 			}
-			if (ip == nexttparelo)
+			if (ip == *tparelos)
 			{
 				outptr = outbuffer;
 				os("  TPARELO ");
 				oh4(ip);
 				*outptr = 0;
 				printx(outbuffer);
-				nexttparelo += getrelo(&tparelos);
+				tparelos++;
 			}
 			ip++;
 		} while (--len);
@@ -0,0 +1,159 @@
+#!/usr/bin/python3
+
+# Runs a manifest of benchmark cases under cpmemu, checks their output, and
+# records the instructions and cycles each one takes. Given a baseline (the
+# results file from an earlier run) it fails if any case has got slower by
+# more than a threshold.
+#
+# Each non-blank, non-comment line of the manifest is:
+#
+#   name  script  expected  cpmemu-arguments...
+#
+# script is a cpmemu input script (see tools/cpmemu/replay.c) and expected
+# is a file holding the expected console output; either may be - for none.
+# Input is always replayed, so that runs are reproducible. Paths are relative
+# to the manifest. For example:
+#
+#   mbrot  -           mbrot.good  mbrot.com
+#   life   life.in     -           life.com
+#   asm    -           asm.good    -p A=cpmfs asm.com asm.txt
+#   pint   pint.in     pint.good   -p A=cpmfs pint.com hello.obb
+
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+
+
+def read_manifest(filename):
+    cases = []
+    with open(filename) as f:
+        for lineno, line in enumerate(f, 1):
+            words = shlex.split(line, comments=True)
+            if not words:
+                continue
+            if len(words) < 4:
+                sys.exit(f"{filename}:{lineno}: expected name, script, "
+                         "expected output and command")
+            cases.append(
+                {
+                    "name": words[0],
+                    "script": words[1],
+                    "expected": words[2],
+                    "args": words[3:],
+                }
+            )
+    return cases
+
+
+def run_case(cpmemu, case, directory, script):
+    with tempfile.TemporaryDirectory() as tmp:
+        statsfile = os.path.join(tmp, "stats.json")
+        # An empty script still stops cpmemu reading the host's console.
+        if script == "-":
+            script = os.path.join(tmp, "empty")
+            open(script, "w").close()
+        command = [cpmemu, "-R", script, "--stats", statsfile] + case["args"]
+        p = subprocess.run(
+            command,
+            cwd=directory,
+            stdin=subprocess.DEVNULL,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        try:
+            with open(statsfile) as f:
+                stats = json.load(f)
+        except (OSError, ValueError):
+            stats = {}
+
+    result = {
+        "instructions": stats.get("instructions", 0),
+        "cycles": stats.get("cycles", 0),
+        "host_seconds": stats.get("host_seconds", 0),
+        "mips": stats.get("mips", 0),
+        "exitcode": p.returncode,
+        "errors": [],
+    }
+    if p.returncode != 0:
+        result["errors"].append(
+            f"exit code {p.returncode}: {p.stderr.decode(errors='replace')}"
+        )
+    if not stats:
+        result["errors"].append("no statistics written")
+    if case["expected"] != "-":
+        with open(os.path.join(directory, case["expected"]), "rb") as f:
+            if f.read() != p.stdout:
+                result["errors"].append("output differs from expected")
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="cpmemu benchmark driver")
+    parser.add_argument("manifest")
+    parser.add_argument("-e", "--cpmemu", default="bin/cpmemu")
+    parser.add_argument("-b", "--baseline", help="results from an earlier run")
+    parser.add_argument("-o", "--output", help="write results to this file")
+    parser.add_argument(
+        "-t",
+        "--threshold",
+        type=float,
+        default=2.0,
+        help="allowed slowdown against the baseline, in percent",
+    )
+    args = parser.parse_args()
+
+    cpmemu = os.path.abspath(args.cpmemu)
+    directory = os.path.dirname(os.path.abspath(args.manifest))
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    results = {}
+    failures = 0
+    print(f"{'case':<16} {'instructions':>14} {'cycles':>14} {'change':>8}")
+    for case in read_manifest(args.manifest):
+        script = case["script"]
+        if script != "-":
+            script = os.path.join(directory, script)
+        r = run_case(cpmemu, case, directory, script)
+        results[case["name"]] = r
+
+        change = ""
+        old = baseline.get(case["name"])
+        if old and old.get("cycles") and r["cycles"]:
+            for key in ("instructions", "cycles"):
+                delta = (r[key] - old[key]) * 100.0 / old[key]
+                if delta > args.threshold:
+                    r["errors"].append(
+                        f"{key} up {delta:.2f}% on the baseline "
+                        f"({old[key]} to {r[key]})"
+                    )
+            change = "%+.2f%%" % (
+                (r["cycles"] - old["cycles"]) * 100.0 / old["cycles"]
+            )
+
+        print(
+            f"{case['name']:<16} {r['instructions']:>14} {r['cycles']:>14} "
+            f"{change:>8}"
+        )
+        for e in r["errors"]:
+            print(f"  FAILED: {e.strip()}")
+        if r["errors"]:
+            failures += 1
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+
+    if failures:
+        print(f"{failures} case(s) failed")
+    sys.exit(1 if failures else 0)
+
+
+main()
@@ -1,5 +1,16 @@
 from build.ab import export, simplerule
-from build.llvm import llvmprogram
+from build.llvm import llvmprogram, llvmrawprogram
+from tools.build import elftocom
+from config import (
+    MINIMAL_APPS,
+    BIG_APPS,
+    SCREEN_APPS,
+    BIG_SCREEN_APPS,
+    PASCAL_APPS,
+    FORTH_APPS,
+    SERIAL_APPS,
+    SERIAL_SCREEN_APPS,
+)
 
 llvmprogram(
     name="parsefcb_test",
@@ -18,4 +29,122 @@ simplerule(
     label="TEST",
 )
 
-export(name="tests", deps=[".+run_parsefcb_test"])
+llvmprogram(
+    name="consoleio_test",
+    srcs=["./consoleio_test.S"],
+    deps=["include"],
+)
+
+simplerule(
+    name="run_consoleio_test",
+    ins=[
+        "tools/cpmemu",
+        ".+consoleio_test",
+        "./consoleio_test.keys",
+        "./consoleio_test.good",
+    ],
+    outs=["=consoleio_test.out"],
+    commands=[
+        "$[ins[0]] -R $[ins[2]] -k $[outs[0]].snap $[ins[1]] > /dev/null",
+        "$[ins[0]] -R $[ins[2]] -K $[outs[0]].snap > $[outs[0]]",
+        "diff -u $[outs[0]] $[ins[3]]",
+    ],
+    label="TEST",
+)
+
+llvmrawprogram(
+    name="cycles_test",
+    srcs=["./cycles_test.S"],
+    deps=["include"],
+    cflags=["-mcpu=mosw65c02"],
+    linkscript="./cycles_test.ld",
+)
+
+simplerule(
+    name="run_cycles_test",
+    ins=["tools/cpmemu", ".+cycles_test", "./cycles_test.good"],
+    outs=["=cycles_test.out"],
+    commands=[
+        "$[ins[0]] -c 1 $[ins[1]] 2> $[outs[0]]",
+        "diff -u $[outs[0]] $[ins[2]]",
+    ],
+    label="TEST",
+)
+
+# elftocom should make the same .com from a program's ELF file as the
+# toolchain's linker does. llvm-mos's linker writes the ELF file next to the
+# raw program; it's copied out so that it's a declared output.
+
+llvmprogram(
+    name="elftocom_prog",
+    srcs=["./parsefcb_test.S"],
+    deps=["include", "src/bdos+bdoslib", "lib+cpm65"],
+    ldflags=["-Wl,--emit-relocs"],
+)
+
+simplerule(
+    name="elftocom_prog_elf",
+    ins=[".+elftocom_prog"],
+    outs=["=elftocom_prog.elf"],
+    commands=["cp $[ins[0]].elf $[outs[0]]"],
+    label="CP",
+)
+
+elftocom(name="elftocom_com", src=".+elftocom_prog_elf")
+
+simplerule(
+    name="run_elftocom_test",
+    ins=[".+elftocom_prog", ".+elftocom_com"],
+    outs=["=elftocom_test.out"],
+    commands=["cmp $[ins[0]] $[ins[1]] > $[outs[0]]"],
+    label="TEST",
+)
+
+# Load-time relocation cost of the shipped programs, in both relocation
+# formats. Not run by default; build tests+relobench to see the report.
+
+llvmrawprogram(
+    name="relocator",
+    srcs=["./relobench.S"],
+    deps=["include", "src/lib+bioslib"],
+    linkscript="./relobench.ld",
+)
+
+SHIPPED_PROGRAMS = sorted(
+    {
+        target
+        for apps in [
+            MINIMAL_APPS,
+            BIG_APPS,
+            SCREEN_APPS,
+            BIG_SCREEN_APPS,
+            PASCAL_APPS,
+            FORTH_APPS,
+            SERIAL_APPS,
+            SERIAL_SCREEN_APPS,
+        ]
+        for name, target in apps.items()
+        if name.endswith(".com")
+    }
+)
+
+simplerule(
+    name="relobench",
+    ins=["tools+relobench", ".+relocator"] + SHIPPED_PROGRAMS,
+    outs=["=relobench.txt"],
+    commands=[
+        "$[ins[0]] $[ins[1]] $[ins[2:]] > $[outs[0]]",
+        "cat $[outs[0]]",
+    ],
+    label="RELOBENCH",
+)
+
+export(
+    name="tests",
+    deps=[
+        ".+run_parsefcb_test",
+        ".+run_consoleio_test",
+        ".+run_cycles_test",
+        ".+run_elftocom_test",
+    ],
+)
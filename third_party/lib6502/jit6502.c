@@ -0,0 +1,1182 @@
+/* jit6502.c -- compiles lib6502 blocks to x86-64 code (experimental) */
+
+/* The block cache (see lib6502.c) hands over blocks which have been run often
+ * enough to be worth compiling. Each instruction becomes a short sequence of
+ * host instructions with A, X, Y and P kept in r8-r11 and S in rbx. Host
+ * flags are used for the arithmetic and folded back into P, except where a
+ * later instruction in the block overwrites them first; P is always exact
+ * when the block is left. Cycles are counted as the interpreter does,
+ * including page-crossing penalties.
+ *
+ * Only a subset of instructions is compiled; a block containing anything
+ * else (SED, PLP and RTI, which might set D; BRK; indirect jumps; the
+ * bit-twiddling 65C02 extensions) stays with the interpreter. Compiled code
+ * assumes D is clear, and the caller must not run it otherwise. Every store
+ * checks the bitmap of bytes holding cached code, and if it hits one the
+ * block returns immediately after that instruction so that the caller can
+ * invalidate the page.
+ *
+ * Code lives in one executable buffer; when it fills up, it's thrown away
+ * and the generation number is bumped so that callers know their pointers
+ * are stale. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lib6502.h"
+#include "jit6502.h"
+#include "6502data.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+
+#define CODE_SIZE (4 << 20)
+#define LINK_SIZE (1 << 20) /* follows the code, on pages of its own */
+#define MAX_BLOCK_CODE 8192 /* much more than the largest possible block */
+#define MAX_EXITS 32
+
+enum
+{
+    flagN = (1 << 7),
+    flagV = (1 << 6),
+    flagD = (1 << 3),
+    flagI = (1 << 2),
+    flagZ = (1 << 1),
+    flagC = (1 << 0)
+};
+
+/* Instructions, grouped by how they're compiled. */
+
+enum
+{
+    opNone,
+    opLoad,    /* LDA, LDX, LDY */
+    opStore,   /* STA, STX, STY, STZ */
+    opAdc,
+    opSbc,
+    opLogic,   /* AND, ORA, EOR */
+    opCompare, /* CMP, CPX, CPY */
+    opBit,
+    opBitImmediate,
+    opIncDec,  /* INC, DEC on memory */
+    opShift,   /* ASL, LSR, ROL, ROR on memory */
+    opShiftA,  /* the same on A */
+    opIncDecR, /* INX, INY, INA, DEX, DEY, DEA */
+    opTransfer,
+    opTxs,
+    opFlag,    /* CLC, SEC, CLV, CLI, SEI, CLD */
+    opNop,
+    opPush,
+    opPull,
+    opBranch,
+    opBra,
+    opJmp,
+    opJsr,
+    opRts
+};
+
+/* Addressing modes. */
+
+enum
+{
+    modeOther,
+    modeImplied,
+    modeImmediate,
+    modeZp,
+    modeZpx,
+    modeZpy,
+    modeAbs,
+    modeAbsx,
+    modeAbsy,
+    modeIndx,
+    modeIndy,
+    modeIndzp,
+    modeRelative
+};
+
+/* Host registers. */
+
+enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    AH = 4, /* as byte registers, without a REX prefix */
+    DH = 6,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11
+};
+
+#define REG_A R8
+#define REG_X R9
+#define REG_Y R10
+#define REG_P R11
+#define REG_S RBX
+
+/* For ops, the register or constant they work on; for flags and branches,
+ * the P bit; for shifts, the x86 /digit. */
+
+static const struct
+{
+    const char* name;
+    byte op;
+    byte arg;
+    byte arg2;
+} instructions[] = {
+    {"lda",  opLoad,         REG_A, 0  },
+    {"ldx",  opLoad,         REG_X, 0  },
+    {"ldy",  opLoad,         REG_Y, 0  },
+    {"sta",  opStore,        REG_A, 0  },
+    {"stx",  opStore,        REG_X, 0  },
+    {"sty",  opStore,        REG_Y, 0  },
+    {"stz",  opStore,        0xff,  0  },
+    {"adc",  opAdc,          0,     0  },
+    {"sbc",  opSbc,          0,     0  },
+    {"and",  opLogic,        0x22,  0  },
+    {"ora",  opLogic,        0x0a,  0  },
+    {"eor",  opLogic,        0x32,  0  },
+    {"cmp",  opCompare,      REG_A, 0  },
+    {"cpx",  opCompare,      REG_X, 0  },
+    {"cpy",  opCompare,      REG_Y, 0  },
+    {"bit",  opBit,          0,     0  },
+    {"bim",  opBitImmediate, 0,     0  },
+    {"inc",  opIncDec,       0,     0  },
+    {"dec",  opIncDec,       1,     0  },
+    {"asl",  opShift,        4,     0  },
+    {"lsr",  opShift,        5,     0  },
+    {"rol",  opShift,        2,     1  },
+    {"ror",  opShift,        3,     1  },
+    {"asla", opShiftA,       4,     0  },
+    {"lsra", opShiftA,       5,     0  },
+    {"rola", opShiftA,       2,     1  },
+    {"rora", opShiftA,       3,     1  },
+    {"ina",  opIncDecR,      REG_A, 0  },
+    {"inx",  opIncDecR,      REG_X, 0  },
+    {"iny",  opIncDecR,      REG_Y, 0  },
+    {"dea",  opIncDecR,      REG_A, 1  },
+    {"dex",  opIncDecR,      REG_X, 1  },
+    {"dey",  opIncDecR,      REG_Y, 1  },
+    {"tax",  opTransfer,     REG_A, REG_X},
+    {"tay",  opTransfer,     REG_A, REG_Y},
+    {"txa",  opTransfer,     REG_X, REG_A},
+    {"tya",  opTransfer,     REG_Y, REG_A},
+    {"tsx",  opTransfer,     REG_S, REG_X},
+    {"txs",  opTxs,          0,     0  },
+    {"clc",  opFlag,         flagC, 0  },
+    {"sec",  opFlag,         flagC, 1  },
+    {"clv",  opFlag,         flagV, 0  },
+    {"cli",  opFlag,         flagI, 0  },
+    {"sei",  opFlag,         flagI, 1  },
+    {"cld",  opFlag,         flagD, 0  },
+    {"nop",  opNop,          0,     0  },
+    {"pha",  opPush,         REG_A, 0  },
+    {"phx",  opPush,         REG_X, 0  },
+    {"phy",  opPush,         REG_Y, 0  },
+    {"php",  opPush,         REG_P, 0  },
+    {"pla",  opPull,         REG_A, 0  },
+    {"plx",  opPull,         REG_X, 0  },
+    {"ply",  opPull,         REG_Y, 0  },
+    {"bpl",  opBranch,       flagN, 0  },
+    {"bmi",  opBranch,       flagN, 1  },
+    {"bvc",  opBranch,       flagV, 0  },
+    {"bvs",  opBranch,       flagV, 1  },
+    {"bcc",  opBranch,       flagC, 0  },
+    {"bcs",  opBranch,       flagC, 1  },
+    {"bne",  opBranch,       flagZ, 0  },
+    {"beq",  opBranch,       flagZ, 1  },
+    {"bra",  opBra,          0,     0  },
+    {"jmp",  opJmp,          0,     0  },
+    {"jsr",  opJsr,          0,     0  },
+    {"rts",  opRts,          0,     0  },
+};
+
+static const char* const modeNames[] = {
+    [modeImplied] = "implied",
+    [modeImmediate] = "immediate",
+    [modeZp] = "zp",
+    [modeZpx] = "zpx",
+    [modeZpy] = "zpy",
+    [modeAbs] = "abs",
+    [modeAbsx] = "absx",
+    [modeAbsy] = "absy",
+    [modeIndx] = "indx",
+    [modeIndy] = "indy",
+    [modeIndzp] = "indzp",
+    [modeRelative] = "relative",
+};
+
+#define opcodeName(num, name, mode, cycles) [0x##num] = #name,
+#define opcodeMode(num, name, mode, cycles) [0x##num] = #mode,
+#define opcodeCycles(num, name, mode, cycles) [0x##num] = cycles,
+
+static const char* const opcodeNames[0x100] = {do_insns(opcodeName)};
+static const char* const opcodeModes[0x100] = {do_insns(opcodeMode)};
+static const byte opcodeCycles[0x100] = {do_insns(opcodeCycles)};
+
+#undef opcodeName
+#undef opcodeMode
+#undef opcodeCycles
+
+/* Exits to a fixed address can jump straight into the code for the block
+ * there, once the caller has linked them to it. Each block has two links:
+ * one for falling through and one for branches being taken. They're kept
+ * apart from the code, as writing near code being run is slow. */
+
+struct _M6502_JitLink
+{
+    uint64_t epoch; /* the caller's epoch when linked */
+    const byte* code;
+    uint64_t count; /* instructions in the block linked to */
+};
+
+#define LINKS 2
+#define MAX_LINKS (LINK_SIZE / sizeof(M6502_JitLink))
+#define PROLOGUE_SIZE 25 /* bytes to skip when chaining */
+
+struct _M6502_Jit
+{
+    byte* code;
+    size_t used;
+    M6502_JitLink* links;
+    size_t linksUsed;
+    uint32_t generation;
+    byte ops[0x100];
+    byte args[0x100];
+    byte args2[0x100];
+    byte modes[0x100];
+};
+
+/* Code generation. Memory operands are only ever one of a few forms, which
+ * covers everything the compiler needs. */
+
+typedef struct
+{
+    byte* p;
+    int fold; /* whether the instruction's flags are needed */
+    M6502_JitLink* links; /* for the block's fixed exits */
+} Asm;
+
+enum
+{
+    RM_REG,   /* a register */
+    RM_MEM,   /* [rsi+rcx], the 6502 address in ecx */
+    RM_IND,   /* [rsi+rax], the 6502 address in eax */
+    RM_ABS,   /* [rsi+disp32], a constant 6502 address */
+    RM_STACK, /* [rsi+rbx+0x100] */
+    RM_STATE  /* [rdi+disp8], a field of M6502_JitState */
+};
+
+#define STATE(FIELD) offsetof(M6502_JitState, FIELD)
+
+static void emit1(Asm* a, int b)
+{
+    *a->p++ = b;
+}
+
+static void emit2(Asm* a, int w)
+{
+    emit1(a, w);
+    emit1(a, w >> 8);
+}
+
+static void emit4(Asm* a, uint32_t d)
+{
+    emit2(a, d);
+    emit2(a, d >> 16);
+}
+
+/* Emits an instruction with a ModRM operand. op may be two bytes (0x0fxx).
+ * reg is a register or an opcode extension; rm is a register for RM_REG,
+ * otherwise disp is the displacement. wide selects a 64-bit operation. */
+
+static void emitOp(Asm* a, int wide, int op, int reg, int kind, int rm, int32_t disp)
+{
+    int rex = (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+              (((kind == RM_REG) && (rm & 8)) ? 1 : 0);
+    if (rex)
+        emit1(a, 0x40 | rex);
+    if (op > 0xff)
+        emit1(a, op >> 8);
+    emit1(a, op);
+
+    reg = (reg & 7) << 3;
+    switch (kind)
+    {
+        case RM_REG:
+            emit1(a, 0xc0 | reg | (rm & 7));
+            break;
+
+        case RM_MEM:
+            emit1(a, 0x04 | reg);
+            emit1(a, 0x0e); /* rsi + rcx */
+            break;
+
+        case RM_IND:
+            emit1(a, 0x04 | reg);
+            emit1(a, 0x06); /* rsi + rax */
+            break;
+
+        case RM_ABS:
+            emit1(a, 0x86 | reg);
+            emit4(a, disp);
+            break;
+
+        case RM_STACK:
+            emit1(a, 0x84 | reg);
+            emit1(a, 0x1e); /* rsi + rbx */
+            emit4(a, 0x100);
+            break;
+
+        case RM_STATE:
+            emit1(a, 0x47 | reg);
+            emit1(a, disp);
+            break;
+    }
+}
+
+/* A few helpers for the commonest forms. */
+
+#define movRR8(A, DST, SRC) emitOp(A, 0, 0x88, SRC, RM_REG, DST, 0)
+#define testRR8(A, R1, R2) emitOp(A, 0, 0x84, R2, RM_REG, R1, 0)
+#define setcc(A, CC, R) emitOp(A, 0, 0x0f90 | (CC), 0, RM_REG, R, 0)
+#define aluRI8(A, DIGIT, R, IMM) \
+    (emitOp(A, 0, 0x80, DIGIT, RM_REG, R, 0), emit1(A, IMM))
+#define aluRI32(A, DIGIT, R, IMM) \
+    (emitOp(A, 0, 0x81, DIGIT, RM_REG, R, 0), emit4(A, IMM))
+#define shiftRI32(A, DIGIT, R, IMM) \
+    (emitOp(A, 0, 0xc1, DIGIT, RM_REG, R, 0), emit1(A, IMM))
+#define shiftRI8(A, DIGIT, R, IMM) \
+    (emitOp(A, 0, 0xc0, DIGIT, RM_REG, R, 0), emit1(A, IMM))
+#define movzxRR8(A, DST, SRC) emitOp(A, 0, 0x0fb6, DST, RM_REG, SRC, 0)
+#define movzxCX(A) emitOp(A, 0, 0x0fb7, RCX, RM_REG, RCX, 0)
+#define movRI32(A, R, IMM) (emit1(A, 0xb8 | (R)), emit4(A, IMM))
+#define btCarry(A) (emitOp(A, 0, 0x0fba, 4, RM_REG, REG_P, 0), emit1(A, 0))
+
+enum
+{
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_ADC = 2,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_CMP = 7
+};
+
+enum
+{
+    CC_O = 0,
+    CC_C = 2,
+    CC_NC = 3,
+    CC_Z = 4,
+    CC_NZ = 5,
+    CC_S = 8
+};
+
+/* Adds CF to the cycle count. */
+
+static void emitCarryTick(Asm* a)
+{
+    emitOp(a, 1, 0x83, ALU_ADC, RM_STATE, 0, STATE(cycles));
+    emit1(a, 0);
+}
+
+/* Computes the effective address of a memory operand into ecx. */
+
+static void emitAddress(Asm* a, int mode, const byte* p, int ticks)
+{
+    word operand = p[1] | (p[2] << 8);
+    switch (mode)
+    {
+        case modeZp:
+            movRI32(a, RCX, p[1]);
+            break;
+
+        case modeAbs:
+            movRI32(a, RCX, operand);
+            break;
+
+        case modeZpx:
+        case modeZpy:
+            movzxRR8(a, RCX, (mode == modeZpx) ? REG_X : REG_Y);
+            aluRI32(a, ALU_ADD, RCX, p[1]);
+            movzxRR8(a, RCX, RCX);
+            break;
+
+        case modeAbsx:
+        case modeAbsy:
+        {
+            int index = (mode == modeAbsx) ? REG_X : REG_Y;
+            int penalty = (mode == modeAbsx) ? ((ticks == 4) || (ticks == 6))
+                                             : (ticks == 4);
+            movRI32(a, RCX, operand);
+            if (penalty && (operand & 0xff))
+            {
+                /* The page is crossed if the index is at least this. */
+                aluRI8(a, ALU_CMP, index, 0x100 - (operand & 0xff));
+                emit1(a, 0xf5); /* cmc */
+                emitCarryTick(a);
+            }
+            movzxRR8(a, RAX, index);
+            emitOp(a, 0, 0x03, RCX, RM_REG, RAX, 0); /* add ecx, eax */
+            movzxCX(a);
+            break;
+        }
+
+        case modeIndx:
+            movzxRR8(a, RAX, REG_X);
+            aluRI32(a, ALU_ADD, RAX, p[1]);
+            movzxRR8(a, RAX, RAX);
+            emitOp(a, 0, 0x0fb6, RCX, RM_IND, 0, 0);
+            emitOp(a, 0, 0xfe, 0, RM_REG, RAX, 0); /* inc al */
+            emitOp(a, 0, 0x0fb6, RAX, RM_IND, 0, 0);
+            shiftRI32(a, 4, RAX, 8);
+            emitOp(a, 0, 0x09, RAX, RM_REG, RCX, 0); /* or ecx, eax */
+            break;
+
+        case modeIndy:
+        case modeIndzp:
+            emitOp(a, 0, 0x0fb6, RCX, RM_ABS, 0, p[1]);
+            emitOp(a, 0, 0x0fb6, RAX, RM_ABS, 0, (byte)(p[1] + 1));
+            shiftRI32(a, 4, RAX, 8);
+            emitOp(a, 0, 0x09, RAX, RM_REG, RCX, 0); /* or ecx, eax */
+            if (mode == modeIndy)
+            {
+                if (ticks == 5)
+                {
+                    movRR8(a, RAX, RCX);
+                    emitOp(a, 0, 0x02, RAX, RM_REG, REG_Y, 0); /* add al, y */
+                    emitCarryTick(a);
+                }
+                movzxRR8(a, RAX, REG_Y);
+                emitOp(a, 0, 0x03, RCX, RM_REG, RAX, 0); /* add ecx, eax */
+                movzxCX(a);
+            }
+            break;
+    }
+}
+
+/* Fetches a read operand into dl. */
+
+static void emitOperand(Asm* a, int mode, const byte* p, int ticks)
+{
+    if (mode == modeImmediate)
+    {
+        emit1(a, 0xb2); /* mov dl, imm8 */
+        emit1(a, p[1]);
+    }
+    else
+    {
+        emitAddress(a, mode, p, ticks);
+        emitOp(a, 0, 0x8a, RDX, RM_MEM, 0, 0);
+    }
+}
+
+/* Folds flags previously captured with setcc (Z in al, N in dh, and if
+ * asked for, C in dl and V in ah) into P. This leaves ecx alone, so a
+ * store's address survives for the write check. */
+
+static void emitFlags(Asm* a, int mask)
+{
+    if (!a->fold)
+        return;
+    emitOp(a, 0, 0x00, RAX, RM_REG, RAX, 0); /* add al, al */
+    shiftRI8(a, 4, DH, 7);
+    emitOp(a, 0, 0x08, DH, RM_REG, RAX, 0); /* or al, dh */
+    if (mask & flagC)
+        emitOp(a, 0, 0x08, RDX, RM_REG, RAX, 0); /* or al, dl */
+    if (mask & flagV)
+    {
+        shiftRI8(a, 4, AH, 6);
+        emitOp(a, 0, 0x08, AH, RM_REG, RAX, 0); /* or al, ah */
+    }
+    aluRI8(a, ALU_AND, REG_P, (byte)~(mask | flagN | flagZ));
+    emitOp(a, 0, 0x08, RAX, RM_REG, REG_P, 0); /* or r11b, al */
+}
+
+/* Captures a host flag into a byte register. */
+
+static void captureFlag(Asm* a, int cc, int reg)
+{
+    if (a->fold)
+        setcc(a, cc, reg);
+}
+
+/* N and Z from the host flags. */
+
+static void captureNZ(Asm* a)
+{
+    captureFlag(a, CC_Z, RAX);
+    captureFlag(a, CC_S, DH);
+}
+
+/* Sets the host flags from a register, for captureNZ(). */
+
+static void testResult(Asm* a, int reg)
+{
+    if (a->fold)
+        testRR8(a, reg, reg);
+}
+
+/* Checks whether the store to ecx hit cached code, jumping to a stub
+ * (returned for patching) if so. */
+
+static byte* emitWriteCheck(Asm* a)
+{
+    emitOp(a, 0, 0x89, RCX, RM_REG, RAX, 0); /* mov eax, ecx */
+    shiftRI32(a, 5, RAX, 5);
+    emitOp(a, 1, 0x8b, RDX, RM_STATE, 0, STATE(code));
+    emit1(a, 0x8b); /* mov eax, [rdx + rax*4] */
+    emit1(a, 0x04);
+    emit1(a, 0x82);
+    emitOp(a, 0, 0x0fa3, RCX, RM_REG, RAX, 0); /* bt eax, ecx */
+    emit2(a, 0x820f);                          /* jc rel32 */
+    emit4(a, 0);
+    return a->p;
+}
+
+/* Emits an instruction with a rip-relative memory operand. */
+
+static void emitRip(Asm* a, int wide, int op, int reg, const void* target)
+{
+    if (wide)
+        emit1(a, 0x48);
+    emit1(a, op);
+    emit1(a, 0x05 | (reg << 3));
+    emit4(a, (const byte*)target - (a->p + 4));
+}
+
+static void patch(byte* after, byte* target)
+{
+    int32_t rel = target - after;
+    memcpy(after - 4, &rel, 4);
+}
+
+/* Leaves the block, having run executed instructions taking cycles. If
+ * link is not negative, jumps to the linked block if the link is current and
+ * there's enough budget left for it, and otherwise returns to the caller
+ * saying which link it would have taken. If pc is negative, the PC has
+ * already been stored. */
+
+static void emitExit(Asm* a, int pc, int executed, uint64_t cycles, int link)
+{
+    emitOp(a, 1, 0x83, ALU_SUB, RM_STATE, 0, STATE(remaining));
+    emit1(a, executed);
+    emitOp(a, 1, 0x81, ALU_ADD, RM_STATE, 0, STATE(cycles));
+    emit4(a, cycles);
+
+    if (link >= 0)
+    {
+        M6502_JitLink* l = &a->links[link];
+        byte* stale;
+        byte* short_;
+
+        emitRip(a, 1, 0x8b, RAX, &l->epoch);
+        emitOp(a, 1, 0x3b, RAX, RM_STATE, 0, STATE(epoch));
+        emit2(a, 0x850f); /* jne rel32 */
+        emit4(a, 0);
+        stale = a->p;
+        emitRip(a, 1, 0x8b, RAX, &l->count);
+        emitOp(a, 1, 0x39, RAX, RM_STATE, 0, STATE(remaining));
+        emit2(a, 0x820f); /* jb rel32 */
+        emit4(a, 0);
+        short_ = a->p;
+        emitRip(a, 0, 0xff, 4, &l->code); /* jmp [rip+code] */
+        patch(stale, a->p);
+        patch(short_, a->p);
+
+        emitRip(a, 1, 0x8d, RAX, l); /* lea rax, [rip+link] */
+        emitOp(a, 1, 0x89, RAX, RM_STATE, 0, STATE(link));
+    }
+    else
+    {
+        emitOp(a, 1, 0xc7, 0, RM_STATE, 0, STATE(link));
+        emit4(a, 0);
+    }
+
+    if (pc >= 0)
+    {
+        emit1(a, 0x66);
+        emitOp(a, 0, 0xc7, 0, RM_STATE, 0, STATE(pc));
+        emit2(a, pc);
+    }
+
+    emitOp(a, 0, 0x88, REG_A, RM_STATE, 0, STATE(a));
+    emitOp(a, 0, 0x88, REG_X, RM_STATE, 0, STATE(x));
+    emitOp(a, 0, 0x88, REG_Y, RM_STATE, 0, STATE(y));
+    emitOp(a, 0, 0x88, REG_P, RM_STATE, 0, STATE(p));
+    emitOp(a, 0, 0x88, REG_S, RM_STATE, 0, STATE(s));
+    emit1(a, 0x5b); /* pop rbx */
+    emit1(a, 0xc3); /* ret */
+}
+
+/* Compiles one instruction which doesn't end the block. Returns false if it
+ * can't be compiled. */
+
+static int compileInsn(M6502_Jit* jit, Asm* a, const byte* p, byte** check)
+{
+    byte opcode = p[0];
+    int mode = jit->modes[opcode];
+    int arg = jit->args[opcode];
+    int arg2 = jit->args2[opcode];
+    int ticks = opcodeCycles[opcode];
+
+    *check = NULL;
+    switch (jit->ops[opcode])
+    {
+        case opLoad:
+            emitOperand(a, mode, p, ticks);
+            testResult(a, RDX);
+            captureNZ(a);
+            movRR8(a, arg, RDX);
+            emitFlags(a, 0);
+            return 1;
+
+        case opStore:
+            emitAddress(a, mode, p, ticks);
+            if (arg == 0xff)
+            {
+                emitOp(a, 0, 0xc6, 0, RM_MEM, 0, 0);
+                emit1(a, 0);
+            }
+            else
+                emitOp(a, 0, 0x88, arg, RM_MEM, 0, 0);
+            *check = emitWriteCheck(a);
+            return 1;
+
+        case opAdc:
+        case opSbc:
+            emitOperand(a, mode, p, ticks);
+            btCarry(a);
+            if (jit->ops[opcode] == opSbc)
+            {
+                emit1(a, 0xf5);                            /* cmc */
+                emitOp(a, 0, 0x1a, REG_A, RM_REG, RDX, 0); /* sbb a, dl */
+                captureFlag(a, CC_NC, RDX);
+            }
+            else
+            {
+                emitOp(a, 0, 0x12, REG_A, RM_REG, RDX, 0); /* adc a, dl */
+                captureFlag(a, CC_C, RDX);
+            }
+            captureFlag(a, CC_O, AH);
+            captureNZ(a);
+            emitFlags(a, flagC | flagV);
+            return 1;
+
+        case opLogic:
+            emitOperand(a, mode, p, ticks);
+            emitOp(a, 0, arg, REG_A, RM_REG, RDX, 0);
+            captureNZ(a);
+            emitFlags(a, 0);
+            return 1;
+
+        case opCompare:
+            emitOperand(a, mode, p, ticks);
+            emitOp(a, 0, 0x3a, arg, RM_REG, RDX, 0); /* cmp r, dl */
+            captureFlag(a, CC_NC, RDX);
+            captureNZ(a);
+            emitFlags(a, flagC);
+            return 1;
+
+        case opBit:
+            emitOperand(a, mode, p, ticks);
+            if (!a->fold)
+                return 1;
+            testRR8(a, REG_A, RDX);
+            captureFlag(a, CC_Z, RAX);
+            movRR8(a, RCX, RDX);
+            aluRI8(a, ALU_AND, RCX, flagN | flagV);
+            emitOp(a, 0, 0x00, RAX, RM_REG, RAX, 0); /* add al, al */
+            emitOp(a, 0, 0x08, RCX, RM_REG, RAX, 0); /* or al, cl */
+            aluRI8(a, ALU_AND, REG_P, (byte)~(flagN | flagV | flagZ));
+            emitOp(a, 0, 0x08, RAX, RM_REG, REG_P, 0);
+            return 1;
+
+        case opBitImmediate:
+            if (!a->fold)
+                return 1;
+            emitOperand(a, mode, p, ticks);
+            testRR8(a, REG_A, RDX);
+            captureFlag(a, CC_Z, RAX);
+            emitOp(a, 0, 0x00, RAX, RM_REG, RAX, 0); /* add al, al */
+            aluRI8(a, ALU_AND, REG_P, (byte)~flagZ);
+            emitOp(a, 0, 0x08, RAX, RM_REG, REG_P, 0);
+            return 1;
+
+        case opIncDec:
+            emitAddress(a, mode, p, ticks);
+            emitOp(a, 0, 0x8a, RDX, RM_MEM, 0, 0);
+            emitOp(a, 0, 0xfe, arg, RM_REG, RDX, 0); /* inc/dec dl */
+            emitOp(a, 0, 0x88, RDX, RM_MEM, 0, 0);
+            captureNZ(a);
+            emitFlags(a, 0);
+            *check = emitWriteCheck(a);
+            return 1;
+
+        case opShift:
+            emitAddress(a, mode, p, ticks);
+            emitOp(a, 0, 0x8a, RAX, RM_MEM, 0, 0);
+            if (arg2)
+                btCarry(a);
+            emitOp(a, 0, 0xd0, arg, RM_REG, RAX, 0);
+            emitOp(a, 0, 0x88, RAX, RM_MEM, 0, 0);
+            captureFlag(a, CC_C, RDX);
+            testResult(a, RAX);
+            captureNZ(a);
+            emitFlags(a, flagC);
+            *check = emitWriteCheck(a);
+            return 1;
+
+        case opShiftA:
+            if (arg2)
+                btCarry(a);
+            emitOp(a, 0, 0xd0, arg, RM_REG, REG_A, 0);
+            captureFlag(a, CC_C, RDX);
+            testResult(a, REG_A);
+            captureNZ(a);
+            emitFlags(a, flagC);
+            return 1;
+
+        case opIncDecR:
+            emitOp(a, 0, 0xfe, arg2, RM_REG, arg, 0);
+            captureNZ(a);
+            emitFlags(a, 0);
+            return 1;
+
+        case opTransfer:
+            movRR8(a, arg2, arg);
+            testResult(a, arg2);
+            captureNZ(a);
+            emitFlags(a, 0);
+            return 1;
+
+        case opTxs:
+            movRR8(a, REG_S, REG_X);
+            return 1;
+
+        case opFlag:
+            if (arg2)
+                aluRI8(a, ALU_OR, REG_P, arg);
+            else
+                aluRI8(a, ALU_AND, REG_P, (byte)~arg);
+            return 1;
+
+        case opNop:
+            return (mode == modeImplied) || (mode == modeImmediate) ||
+                   (mode == modeZp) || (mode == modeZpx) || (mode == modeAbs);
+
+        case opPush:
+            if (arg == REG_P)
+            {
+                movRR8(a, RAX, REG_P);
+                aluRI8(a, ALU_OR, RAX, 0x30);
+                arg = RAX;
+            }
+            emitOp(a, 0, 0x88, arg, RM_STACK, 0, 0);
+            emitOp(a, 0, 0xfe, 1, RM_REG, REG_S, 0); /* dec bl */
+            return 1;
+
+        case opPull:
+            emitOp(a, 0, 0xfe, 0, RM_REG, REG_S, 0); /* inc bl */
+            emitOp(a, 0, 0x8a, arg, RM_STACK, 0, 0);
+            testResult(a, arg);
+            captureNZ(a);
+            emitFlags(a, 0);
+            return 1;
+    }
+    return 0;
+}
+
+/* Compiles the instruction which ends the block. Returns false if it can't
+ * be compiled. */
+
+static int compileEnd(
+    M6502_Jit* jit, Asm* a, word pc, const byte* p, int count, uint64_t cycles)
+{
+    byte opcode = p[0];
+    int ticks = opcodeCycles[opcode];
+    word next = pc + 2;
+    word target = next + (int8_t)p[1];
+    int crossing = (target >> 8) != (next >> 8);
+
+    switch (jit->ops[opcode])
+    {
+        case opBranch:
+        {
+            byte* taken;
+            emitOp(a, 0, 0xf6, 0, RM_REG, REG_P, 0); /* test r11b, mask */
+            emit1(a, jit->args[opcode]);
+            emit2(a, jit->args2[opcode] ? 0x850f : 0x840f);
+            emit4(a, 0);
+            taken = a->p;
+            emitExit(a, next, count, cycles + ticks, 0);
+            patch(taken, a->p);
+            emitExit(a, target, count, cycles + ticks + 1 + crossing, 1);
+            return 1;
+        }
+
+        case opBra:
+            emitExit(a, target, count, cycles + ticks + 1 + crossing, 0);
+            return 1;
+
+        case opJmp:
+            if (jit->modes[opcode] != modeAbs)
+                return 0;
+            emitExit(a, p[1] | (p[2] << 8), count, cycles + ticks, 0);
+            return 1;
+
+        case opJsr:
+            next = pc + 2;
+            emitOp(a, 0, 0xc6, 0, RM_STACK, 0, 0);
+            emit1(a, next >> 8);
+            emitOp(a, 0, 0xfe, 1, RM_REG, REG_S, 0); /* dec bl */
+            emitOp(a, 0, 0xc6, 0, RM_STACK, 0, 0);
+            emit1(a, next & 0xff);
+            emitOp(a, 0, 0xfe, 1, RM_REG, REG_S, 0); /* dec bl */
+            emitExit(a, p[1] | (p[2] << 8), count, cycles + ticks, 0);
+            return 1;
+
+        case opRts:
+            emitOp(a, 0, 0xfe, 0, RM_REG, REG_S, 0); /* inc bl */
+            emitOp(a, 0, 0x0fb6, RAX, RM_STACK, 0, 0);
+            emitOp(a, 0, 0xfe, 0, RM_REG, REG_S, 0); /* inc bl */
+            emitOp(a, 0, 0x0fb6, RCX, RM_STACK, 0, 0);
+            shiftRI32(a, 4, RCX, 8);
+            emitOp(a, 0, 0x09, RCX, RM_REG, RAX, 0); /* or eax, ecx */
+            emitOp(a, 0, 0xff, 0, RM_REG, RAX, 0);   /* inc eax */
+            emit1(a, 0x66);
+            emitOp(a, 0, 0x89, RAX, RM_STATE, 0, STATE(pc));
+            emitExit(a, -1, count, cycles + ticks, -1);
+            return 1;
+    }
+    return 0;
+}
+
+static int endsBlock(M6502_Jit* jit, byte opcode)
+{
+    switch (jit->ops[opcode])
+    {
+        case opBranch:
+        case opBra:
+        case opJmp:
+        case opJsr:
+        case opRts:
+            return 1;
+    }
+    return 0;
+}
+
+/* Flag usage, for working out which instructions' flags are needed. */
+
+#define FLAGS (flagN | flagV | flagZ | flagC)
+
+static int flagsRead(M6502_Jit* jit, byte opcode)
+{
+    switch (jit->ops[opcode])
+    {
+        case opAdc:
+        case opSbc:
+            return flagC;
+
+        case opShift:
+        case opShiftA:
+            return jit->args2[opcode] ? flagC : 0;
+
+        case opPush:
+            return (jit->args[opcode] == REG_P) ? FLAGS : 0;
+    }
+    return 0;
+}
+
+static int flagsWritten(M6502_Jit* jit, byte opcode)
+{
+    switch (jit->ops[opcode])
+    {
+        case opLoad:
+        case opLogic:
+        case opIncDec:
+        case opIncDecR:
+        case opTransfer:
+        case opPull:
+            return flagN | flagZ;
+
+        case opAdc:
+        case opSbc:
+            return FLAGS;
+
+        case opCompare:
+        case opShift:
+        case opShiftA:
+            return flagN | flagZ | flagC;
+
+        case opBit:
+            return flagN | flagV | flagZ;
+
+        case opBitImmediate:
+            return flagZ;
+
+        case opFlag:
+            return jit->args[opcode] & FLAGS;
+    }
+    return 0;
+}
+
+/* Instructions which write to memory may leave the block early, and P must
+ * be up to date when they do. */
+
+static int mayExit(M6502_Jit* jit, byte opcode)
+{
+    switch (jit->ops[opcode])
+    {
+        case opStore:
+        case opIncDec:
+        case opShift:
+            return 1;
+    }
+    return 0;
+}
+
+static int instructionLength(M6502_Jit* jit, byte opcode)
+{
+    switch (jit->modes[opcode])
+    {
+        case modeImplied:
+            return 1;
+
+        case modeAbs:
+        case modeAbsx:
+        case modeAbsy:
+            return 3;
+    }
+    return 2;
+}
+
+M6502_Jit* M6502_jitNew(void)
+{
+    M6502_Jit* jit = calloc(1, sizeof(M6502_Jit));
+    if (!jit)
+        return NULL;
+
+    jit->code = mmap(NULL,
+        CODE_SIZE + LINK_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0);
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    jit->links = (M6502_JitLink*)(jit->code + CODE_SIZE);
+    mprotect(jit->links, LINK_SIZE, PROT_READ | PROT_WRITE);
+
+    for (int i = 0; i < 0x100; i++)
+    {
+        for (int j = 0; j < sizeof(instructions) / sizeof(*instructions); j++)
+        {
+            if (!strcmp(opcodeNames[i], instructions[j].name))
+            {
+                jit->ops[i] = instructions[j].op;
+                jit->args[i] = instructions[j].arg;
+                jit->args2[i] = instructions[j].arg2;
+            }
+        }
+        for (int j = 0; j < sizeof(modeNames) / sizeof(*modeNames); j++)
+        {
+            if (modeNames[j] && !strcmp(opcodeModes[i], modeNames[j]))
+                jit->modes[i] = j;
+        }
+        if (!jit->modes[i])
+            jit->ops[i] = opNone;
+    }
+    return jit;
+}
+
+void M6502_jitDelete(M6502_Jit* jit)
+{
+    if (!jit)
+        return;
+    munmap(jit->code, CODE_SIZE + LINK_SIZE);
+    free(jit);
+}
+
+uint32_t M6502_jitGeneration(M6502_Jit* jit)
+{
+    return jit->generation;
+}
+
+/* Compiles the count instructions in bytes, which start at pc. Returns NULL
+ * if they can't be compiled. This may throw away all previously compiled
+ * code; see M6502_jitGeneration(). */
+
+M6502_JitCode M6502_jitCompile(
+    M6502_Jit* jit, uint16_t pc, const uint8_t* bytes, int count)
+{
+    struct
+    {
+        byte* patch;
+        word pc;
+        int executed;
+        uint64_t cycles;
+    } exits[MAX_EXITS];
+    int numExits = 0;
+    byte opcodes[MAX_EXITS];
+    byte fold[MAX_EXITS];
+
+    if (count > MAX_EXITS)
+        return NULL;
+
+    /* Check it can all be compiled before touching the buffer. */
+
+    const byte* p = bytes;
+    for (int i = 0; i < count; i++)
+    {
+        byte opcode = opcodes[i] = *p;
+        if (!jit->ops[opcode])
+            return NULL;
+        if (endsBlock(jit, opcode) && (i != (count - 1)))
+            return NULL;
+        p += instructionLength(jit, opcode);
+    }
+
+    /* Work backwards to find which instructions set flags which are used
+     * before being overwritten; the rest needn't update P. All flags are
+     * needed wherever the block can be left. */
+
+    int live = FLAGS;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        int after = mayExit(jit, opcodes[i]) ? FLAGS : live;
+        int written = flagsWritten(jit, opcodes[i]);
+        fold[i] = (written & after) != 0;
+        live = (after & ~written) | flagsRead(jit, opcodes[i]);
+    }
+
+    if (((jit->used + MAX_BLOCK_CODE) > CODE_SIZE) ||
+        ((jit->linksUsed + LINKS) > MAX_LINKS))
+    {
+        jit->used = 0;
+        jit->linksUsed = 0;
+        jit->generation++;
+    }
+
+    M6502_JitLink* links = &jit->links[jit->linksUsed];
+    for (int i = 0; i < LINKS; i++)
+        links[i].epoch = ~0ULL;
+    byte* start = jit->code + jit->used;
+    Asm a = {start, 1, links};
+
+    emit1(&a, 0x53); /* push rbx */
+    emitOp(&a, 0, 0x0fb6, REG_A, RM_STATE, 0, STATE(a));
+    emitOp(&a, 0, 0x0fb6, REG_X, RM_STATE, 0, STATE(x));
+    emitOp(&a, 0, 0x0fb6, REG_Y, RM_STATE, 0, STATE(y));
+    emitOp(&a, 0, 0x0fb6, REG_P, RM_STATE, 0, STATE(p));
+    emitOp(&a, 0, 0x0fb6, REG_S, RM_STATE, 0, STATE(s));
+
+    uint64_t cycles = 0;
+    word addr = pc;
+    int ended = 0;
+    p = bytes;
+    for (int i = 0; i < count; i++)
+    {
+        byte opcode = *p;
+        int length = instructionLength(jit, opcode);
+
+        if (endsBlock(jit, opcode))
+        {
+            if (!compileEnd(jit, &a, addr, p, count, cycles))
+                return NULL;
+            ended = 1;
+            break;
+        }
+
+        byte* check;
+        a.fold = fold[i];
+        if (!compileInsn(jit, &a, p, &check))
+            return NULL;
+        cycles += opcodeCycles[opcode];
+        addr += length;
+        p += length;
+
+        if (check)
+        {
+            exits[numExits].patch = check;
+            exits[numExits].pc = addr;
+            exits[numExits].executed = i + 1;
+            exits[numExits].cycles = cycles;
+            numExits++;
+        }
+    }
+
+    /* Fell off the end of the block. */
+
+    if (!ended)
+        emitExit(&a, addr, count, cycles, 0);
+
+    /* Early exits after writes to code. */
+
+    for (int i = 0; i < numExits; i++)
+    {
+        patch(exits[i].patch, a.p);
+        emit1(&a, 0x66);
+        emitOp(&a, 0, 0x89, RCX, RM_STATE, 0, STATE(address));
+        emitOp(&a, 0, 0xc6, 0, RM_STATE, 0, STATE(written));
+        emit1(&a, 1);
+        emitExit(&a, exits[i].pc, exits[i].executed, exits[i].cycles, -1);
+    }
+
+    jit->used = (a.p - jit->code + 15) & ~15;
+    jit->linksUsed += LINKS;
+    return (M6502_JitCode)start;
+}
+
+/* Makes a link taken by a block (see M6502_JitState) jump straight to
+ * target, which has count instructions, for as long as the caller's epoch
+ * stays the same. */
+
+void M6502_jitLink(
+    M6502_JitLink* link, M6502_JitCode target, int count, uint64_t epoch)
+{
+    link->code = (const byte*)target + PROLOGUE_SIZE;
+    link->count = count;
+    link->epoch = epoch;
+}
+
+#else
+
+M6502_Jit* M6502_jitNew(void)
+{
+    return NULL;
+}
+
+void M6502_jitDelete(M6502_Jit* jit) {}
+
+M6502_JitCode M6502_jitCompile(
+    M6502_Jit* jit, uint16_t pc, const uint8_t* bytes, int count)
+{
+    return NULL;
+}
+
+uint32_t M6502_jitGeneration(M6502_Jit* jit)
+{
+    return 0;
+}
+
+void M6502_jitLink(
+    M6502_JitLink* link, M6502_JitCode target, int count, uint64_t epoch)
+{
+}
+
+#endif
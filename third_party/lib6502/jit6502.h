@@ -0,0 +1,35 @@
+#ifndef __jit6502_h
+#define __jit6502_h
+
+/* Internal interface between lib6502.c's block cache and the x86-64 block
+ * compiler in jit6502.c. */
+
+#include <stdint.h>
+
+typedef struct _M6502_Jit     M6502_Jit;
+typedef struct _M6502_JitLink M6502_JitLink;
+
+/* The machine state handed to and from compiled code. */
+
+typedef struct
+{
+  uint8_t   a, x, y, p, s;
+  uint8_t   written;	/* set if the block wrote to cached code */
+  uint16_t  pc;
+  uint16_t  address;	/* where it wrote */
+  uint64_t  cycles;
+  uint64_t  remaining;	/* budget, in instructions */
+  uint64_t  epoch;	/* links made in any other epoch are stale */
+  M6502_JitLink *link;	/* the exit taken, if it has a fixed target */
+  const uint32_t *code;	/* bitmap of bytes holding cached code */
+} M6502_JitState;
+
+typedef void (*M6502_JitCode)(M6502_JitState *state, uint8_t *memory);
+
+extern M6502_Jit     *M6502_jitNew(void);
+extern void           M6502_jitDelete(M6502_Jit *jit);
+extern M6502_JitCode  M6502_jitCompile(M6502_Jit *jit, uint16_t pc, const uint8_t *bytes, int count);
+extern uint32_t       M6502_jitGeneration(M6502_Jit *jit);
+extern void           M6502_jitLink(M6502_JitLink *link, M6502_JitCode target, int count, uint64_t epoch);
+
+#endif /*__jit6502_h */
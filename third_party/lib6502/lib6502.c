@@ -31,8 +31,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib6502.h"
+#include "jit6502.h"
 
 typedef uint8_t byte;
 typedef uint16_t word;
@@ -68,18 +70,30 @@ enum
 
 #define NAND(P, Q) (!((P) & (Q)))
 
-#define tick(n)
-#define tickIf(p)
+/* cycle counting; page-crossing and branch-taken penalties use tickIf() */
+
+#define tick(n) (cycles += (n))
+#define tickIf(p) (cycles += ((p) ? 1 : 0))
+
+/* callback lookup in a page-granular callback map */
+
+#define findCallback(MAP, ADDR) \
+    ((MAP)[(ADDR) >> 8] ? (MAP)[(ADDR) >> 8][(ADDR) & 0xff] : NULL)
+
+#define callCallback(ADDR) findCallback(mpu->callbacks->call, ADDR)
 
 /* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED
  * MORE THAN ONCE! */
 
-#define putMemory(ADDR, BYTE)                                   \
-    (writeCallback[ADDR] ? writeCallback[ADDR](mpu, ADDR, BYTE) \
-                         : (memory[ADDR] = BYTE))
+#define putMemory(ADDR, BYTE)                                  \
+    (findCallback(writeCallback, ADDR)                         \
+            ? writeCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, BYTE) \
+            : (memory[ADDR] = BYTE))
 
-#define getMemory(ADDR) \
-    (readCallback[ADDR] ? readCallback[ADDR](mpu, ADDR, 0) : memory[ADDR])
+#define getMemory(ADDR)                                                \
+    (findCallback(readCallback, ADDR)                                  \
+            ? readCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, 0) \
+            : memory[ADDR])
 
 /* stack access (always direct) */
 
@@ -104,13 +118,13 @@ enum
     ea = memory[PC++];  \
     if (ea & 0x80)      \
         ea -= 0x100;    \
-    tickIf((ea >> 8) != (PC >> 8));
+    tickIf(((word)(PC + ea) >> 8) != (PC >> 8));
 
 #define zpr(ticks)              \
   tick(ticks);                  \
   ea= memory[PC++];             \
   if (ea & 0x80) ea -= 0x100;   \
-  tickIf((ea >> 8) != (PC >> 8));
+  tickIf(((word)(PC + ea) >> 8) != (PC >> 8));
 
 #define indirect(ticks)                            \
     tick(ticks);                                   \
@@ -125,14 +139,15 @@ enum
     tick(ticks);                                            \
     ea = memory[PC] + (memory[PC + 1] << 8);                \
     PC += 2;                                                \
-    tickIf((ticks == 4) && ((ea >> 8) != ((ea + X) >> 8))); \
+    tickIf(((ticks == 4) || (ticks == 6)) &&                \
+           ((ea >> 8) != ((word)(ea + X) >> 8)));           \
     ea += X;
 
 #define absy(ticks)                                         \
     tick(ticks);                                            \
     ea = memory[PC] + (memory[PC + 1] << 8);                \
     PC += 2;                                                \
-    tickIf((ticks == 4) && ((ea >> 8) != ((ea + Y) >> 8))); \
+    tickIf((ticks == 4) && ((ea >> 8) != ((word)(ea + Y) >> 8))); \
     ea += Y
 
 #define zp(ticks) \
@@ -161,7 +176,7 @@ enum
     {                                                           \
         byte tmp = memory[PC++];                                \
         ea = memory[tmp] + (memory[(tmp + 1) & 0xff] << 8);              \
-        tickIf((ticks == 5) && ((ea >> 8) != ((ea + Y) >> 8))); \
+        tickIf((ticks == 5) && ((ea >> 8) != ((word)(ea + Y) >> 8))); \
         ea += Y;                                                \
     }
 
@@ -602,11 +617,11 @@ enum
         adrmode(ticks);                                             \
         byte opcode = mpu->memory[PC - 3];                          \
         PC = ea;                                                    \
-        if (mpu->callbacks->call[ea])                               \
+        if (callCallback(ea))                                       \
         {                                                           \
             word addr;                                              \
             externalise();                                          \
-            if ((addr = mpu->callbacks->call[ea](mpu, ea, opcode))) \
+            if ((addr = callCallback(ea)(mpu, ea, opcode)))         \
             {                                                       \
                 internalise();                                      \
                 PC = addr;                                          \
@@ -622,11 +637,11 @@ enum
     push(PC & 0xff);                                          \
     PC--;                                                     \
     adrmode(ticks);                                           \
-    if (mpu->callbacks->call[ea])                             \
+    if (callCallback(ea))                                     \
     {                                                         \
         word addr;                                            \
         externalise();                                        \
-        if ((addr = mpu->callbacks->call[ea](mpu, ea, 0x20))) \
+        if ((addr = callCallback(ea)(mpu, ea, 0x20)))         \
         {                                                     \
             internalise();                                    \
             PC = addr;                                        \
@@ -658,12 +673,13 @@ enum
     P &= ~flagD;                                                     \
     P |= flagI;                                                      \
     {                                                                \
-        word hdlr = getMemory(0xfffe) + (getMemory(0xffff) << 8);    \
-        if (mpu->callbacks->call[hdlr])                              \
+        word hdlr = getMemory(0xfffe);                               \
+        hdlr |= getMemory(0xffff) << 8;                              \
+        if (callCallback(hdlr))                                      \
         {                                                            \
             word addr;                                               \
             externalise();                                           \
-            if ((addr = mpu->callbacks->call[hdlr](mpu, PC - 2, 0))) \
+            if ((addr = callCallback(hdlr)(mpu, PC - 2, 0)))         \
             {                                                        \
                 internalise();                                       \
                 hdlr = addr;                                         \
@@ -685,7 +701,6 @@ enum
 #define nop(ticks, adrmode) \
     adrmode(ticks);         \
     fetch();                \
-    tick(ticks);            \
     next();
 
 /* determine addr and instruction before calling fetch(), otherwise the GNU C
@@ -694,7 +709,6 @@ enum
     {                                                                     \
         word addr = PC - 1;                                               \
         byte instruction = memory[addr];                                  \
-        tick(ticks);                                                      \
         if (mpu->callbacks->illegal_instruction[instruction])             \
         {                                                                 \
             adrmode(ticks);                                               \
@@ -779,6 +793,7 @@ void M6502_irq(M6502* mpu)
         mpu->registers->p |= flagI;
         mpu->registers->p &= ~flagD;
         mpu->registers->pc = M6502_getVector(mpu, IRQ);
+        mpu->cycles += 7;
     }
 }
 
@@ -791,6 +806,7 @@ void M6502_nmi(M6502* mpu)
     mpu->registers->p |= flagI;
     mpu->registers->p &= ~flagD;
     mpu->registers->pc = M6502_getVector(mpu, NMI);
+    mpu->cycles += 7;
 }
 
 void M6502_reset(M6502* mpu)
@@ -807,8 +823,6 @@ static void oops(void)
     fprintf(stderr, "\noops -- instruction dispatch missing\n");
 }
 
-void M6502_run(M6502* mpu)
-{
 #define fetch()
 #define next() break
 
@@ -819,14 +833,8 @@ void M6502_run(M6502* mpu)
 
 #define end() }
 
-    register byte* memory = mpu->memory;
-    register word PC;
-    word ea;
-    byte A, X, Y, P, S;
-    M6502_Callback* readCallback = mpu->callbacks->read;
-    M6502_Callback* writeCallback = mpu->callbacks->write;
-
 #define internalise()      \
+    cycles = mpu->cycles;  \
     A = mpu->registers->a; \
     X = mpu->registers->x; \
     Y = mpu->registers->y; \
@@ -835,6 +843,7 @@ void M6502_run(M6502* mpu)
     PC = mpu->registers->pc
 
 #define externalise()      \
+    mpu->cycles = cycles;  \
     mpu->registers->a = A; \
     mpu->registers->x = X; \
     mpu->registers->y = Y; \
@@ -842,20 +851,748 @@ void M6502_run(M6502* mpu)
     mpu->registers->s = S; \
     mpu->registers->pc = PC
 
+void M6502_run(M6502* mpu)
+{
+    register byte* memory = mpu->memory;
+    register word PC;
+    word ea;
+    byte A, X, Y, P, S;
+    uint64_t cycles;
+    M6502_Callback** readCallback = mpu->callbacks->read;
+    M6502_Callback** writeCallback = mpu->callbacks->write;
+
     internalise();
 
+    if (mpu->opcodeCounts)
+        mpu->opcodeCounts[memory[PC]]++;
+
     switch (memory[PC++])
     {
         do_insns(dispatch);
     }
 
+    if (mpu->opcodeCounts && (S < mpu->lowestStack))
+        mpu->lowestStack = S;
+
+    externalise();
+}
+
+/* Runs instructions until either PC lands on an address whose entry in traps
+ * is non-zero (checked before every instruction, including the first), a
+ * read or write callback calls M6502_stop(), or *budget instructions have
+ * been executed. The registers are only copied in and out once per call
+ * rather than once per instruction. On return, *budget holds the number of
+ * instructions which were not executed.
+ *
+ * The loop is instantiated three times: once going through the callback
+ * maps, once accessing memory directly for when no callbacks are installed,
+ * and once (with callbacks) which also keeps mpu->opcodeCounts and
+ * mpu->lowestStack up to date. COUNT is a constant, so the other two pay
+ * nothing for the counting; MAPS declares the callback maps, for the
+ * instantiations which use them. */
+
+#define callbackMaps                                     \
+    M6502_Callback** readCallback = mpu->callbacks->read; \
+    M6502_Callback** writeCallback = mpu->callbacks->write;
+
+#define runUntil(NAME, COUNT, MAPS)                      \
+    static int NAME(                                     \
+        M6502* mpu, const M6502_TrapTable traps, unsigned long* budget) \
+    {                                                    \
+        register byte* memory = mpu->memory;             \
+        register word PC;                                \
+        word ea;                                         \
+        byte A, X, Y, P, S;                              \
+        uint64_t cycles;                                 \
+        MAPS                                             \
+        unsigned long remaining = *budget;               \
+        int reason = M6502_BudgetExhausted;              \
+        byte called = 0;                                 \
+        uint64_t* counts = mpu->opcodeCounts;            \
+        byte lowest = mpu->lowestStack;                  \
+                                                         \
+        internalise();                                   \
+        mpu->flags &= ~M6502_StopRequested;              \
+                                                         \
+        while (remaining)                                \
+        {                                                \
+            if (traps && traps[PC])                      \
+            {                                            \
+                reason = M6502_Trapped;                  \
+                break;                                   \
+            }                                            \
+            remaining--;                                 \
+                                                         \
+            if (COUNT)                                   \
+                counts[memory[PC]]++;                    \
+                                                         \
+            switch (memory[PC++])                        \
+            {                                            \
+                do_insns(dispatch);                      \
+            }                                            \
+                                                         \
+            if (COUNT && (S < lowest))                   \
+                lowest = S;                              \
+                                                         \
+            /* Only look at the stop flag if a callback could have set it. */ \
+                                                         \
+            if (called)                                  \
+            {                                            \
+                called = 0;                              \
+                if (mpu->flags & M6502_StopRequested)    \
+                {                                        \
+                    mpu->flags &= ~M6502_StopRequested;  \
+                    reason = M6502_Stopped;              \
+                    break;                               \
+                }                                        \
+            }                                            \
+        }                                                \
+                                                         \
+        externalise();                                   \
+        if (COUNT)                                       \
+            mpu->lowestStack = lowest;                   \
+        *budget = remaining;                             \
+        return reason;                                   \
+    }
+
+#undef putMemory
+#undef getMemory
+
+#define putMemory(ADDR, BYTE)                                  \
+    (findCallback(writeCallback, ADDR)                         \
+            ? (called = 1,                                     \
+                  writeCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, BYTE)) \
+            : (memory[ADDR] = BYTE))
+
+#define getMemory(ADDR)                                                \
+    (findCallback(readCallback, ADDR)                                  \
+            ? (called = 1,                                             \
+                  readCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, 0)) \
+            : memory[ADDR])
+
+runUntil(runUntilWithCallbacks, 0, callbackMaps)
+runUntil(runUntilCounting, 1, callbackMaps)
+
+#undef putMemory
+#undef getMemory
+#undef callCallback
+
+#define putMemory(ADDR, BYTE) (memory[ADDR] = BYTE)
+#define getMemory(ADDR) (memory[ADDR])
+#define callCallback(ADDR) ((M6502_Callback)NULL)
+
+runUntil(runUntilDirect, 0, )
+
+#undef putMemory
+#undef getMemory
+#undef callCallback
+#undef runUntil
+#undef callbackMaps
+
+/* The block cache. Straight-line runs of instructions are decoded once into
+ * blocks, keyed by their start address, holding for each instruction the
+ * address of its code in runBlocks() and its operand, already fetched. A
+ * block ends at any instruction which can change PC other than by falling
+ * through, except that conditional branches only leave it when taken, so
+ * runBlocks() can run a whole block by jumping from instruction to
+ * instruction without going through the trap, budget and decode checks in
+ * between. A branch taken back to the start of its own block, as most inner
+ * loops are, runs the block again straight away rather than looking it up,
+ * and each block remembers which block it last went on to by a taken branch
+ * and otherwise, so that it needn't be looked up either while the cache's
+ * epoch (see below) is unchanged. This needs GCC's computed gotos; other
+ * compilers use the normal interpreter.
+ *
+ * The interpreter notices its own writes to code: a bitmap of the bytes in
+ * decoded blocks is checked on every write outside the zero page, and a
+ * write to one of them bumps its page's version, invalidating the blocks
+ * there, and leaves the current block if it wrote into it. Writes to data
+ * sharing a page with code don't disturb anything. The host can write to
+ * memory between calls to M6502_runUntil() without telling us, so blocks are
+ * also stamped with the call they were last checked in, and the first time
+ * each block is used in a call its bytes are compared against the ones it
+ * was decoded from. Blocks which have gone stale but whose bytes haven't
+ * changed (say, because another block in their page was written to) are
+ * revalidated rather than decoded again.
+ *
+ * Writes to the zero page and the stack page are not checked, so code there
+ * is never cached. Blocks don't go beyond the end of the page they start in,
+ * except for an instruction which straddles it.
+ *
+ * If the JIT is on (see jit6502.c), blocks end at conditional branches too,
+ * as that's what it compiles, and blocks which have been run JIT_HEAT times
+ * are compiled to host code, which is used instead whenever D is clear.
+ * Compiled blocks are linked so that one can jump straight to the next. A
+ * link only holds while the cache's epoch is unchanged, and the epoch is
+ * bumped whenever any block might have gone stale: on each new call, each
+ * write to code, and each block decoded. */
+
+#if defined(__GNUC__)
+
+#define BLOCK_SLOTS 2048 /* direct-mapped by start address */
+#define BLOCK_INSNS 16
+#define BLOCK_BYTES (BLOCK_INSNS * 3)
+#define JIT_HEAT 32
+
+typedef struct
+{
+    const void* code; /* label of the opcode's code in runBlocks() */
+    word operand;     /* resolved operand, for modes which have one */
+} BlockInsn;
+
+typedef struct _Block
+{
+    uint64_t key; /* call << 16 | pc when last checked; 0 if empty */
+    word pc;
+    byte count; /* instructions */
+    byte length; /* bytes */
+    byte lastPage;
+    uint32_t version[2]; /* of the first and last pages */
+    byte bytes[BLOCK_BYTES];
+    BlockInsn insns[BLOCK_INSNS + 1]; /* plus one to leave the block */
+    struct _Block* next[2]; /* last left to, without and with a branch */
+    uint64_t linked[2];     /* the cache's epoch when next was set */
+    M6502_JitCode native; /* compiled code, if any */
+    uint32_t generation;  /* of the JIT's code buffer when compiled */
+    uint16_t heat;        /* runs since decoded, up to JIT_HEAT */
+} Block;
+
+struct _M6502_BlockCache
+{
+    uint64_t call; /* incremented on every call to runBlocks() */
+    uint32_t code[0x10000 / 32]; /* bitmap of bytes in decoded blocks */
+    uint32_t pageVersion[0x100];
+    M6502_Jit* jit; /* NULL if the JIT is off */
+    uint32_t jitGeneration; /* of the JIT's code buffer */
+    uint64_t epoch;
+    Block blocks[BLOCK_SLOTS];
+};
+
+#define blockLength_implied 1
+#define blockLength_immediate 2
+#define blockLength_relative 2
+#define blockLength_zp 2
+#define blockLength_zpx 2
+#define blockLength_zpy 2
+#define blockLength_indx 2
+#define blockLength_indy 2
+#define blockLength_indzp 2
+#define blockLength_zpr 3
+#define blockLength_abs 3
+#define blockLength_absx 3
+#define blockLength_absy 3
+#define blockLength_indirect 3
+#define blockLength_indabsx 3
+
+#define blockEnds_implied 0
+#define blockEnds_immediate 0
+#define blockEnds_relative 1
+#define blockEnds_zp 0
+#define blockEnds_zpx 0
+#define blockEnds_zpy 0
+#define blockEnds_indx 0
+#define blockEnds_indy 0
+#define blockEnds_indzp 0
+#define blockEnds_zpr 1
+#define blockEnds_abs 0
+#define blockEnds_absx 0
+#define blockEnds_absy 0
+#define blockEnds_indirect 1
+#define blockEnds_indabsx 1
+
+#define blockLength(num, name, mode, cycles) [0x##num] = blockLength_##mode,
+#define blockEnds(num, name, mode, cycles) [0x##num] = blockEnds_##mode,
+
+static const byte blockLengths[0x100] = {do_insns(blockLength)};
+static const byte blockEnders[0x100] = {do_insns(blockEnds)};
+
+#undef blockLength
+#undef blockEnds
+
+static int endsBlock(byte opcode, int jit)
+{
+    /* BPL, BMI, BVC, BVS, BCC, BCS, BNE and BEQ. */
+    if (((opcode & 0x1f) == 0x10) && !jit)
+        return 0;
+
+    switch (opcode)
+    {
+        case 0x00: /* BRK */
+        case 0x20: /* JSR */
+        case 0x40: /* RTI */
+        case 0x4c: /* JMP abs */
+        case 0x60: /* RTS */
+            return 1;
+    }
+    return blockEnders[opcode];
+}
+
+#define isCode(CACHE, ADDR) \
+    ((CACHE)->code[(ADDR) >> 5] & (1u << ((ADDR) & 31)))
+
+/* Checks a block whose pages have been written to, or which hasn't been used
+ * yet in this call, against memory and the trap table, and brings it up to
+ * date if it's still good. */
+
+static int revalidateBlock(
+    M6502_BlockCache* cache, Block* block, const byte* memory, const byte* traps)
+{
+    if (memcmp(block->bytes, &memory[block->pc], block->length))
+        return 0;
+
+    if (traps)
+    {
+        word addr = block->pc;
+        for (int i = 0; i < block->count; i++)
+        {
+            if (traps[addr])
+                return 0;
+            addr += blockLengths[memory[addr]];
+        }
+    }
+
+    block->key = (cache->call << 16) | block->pc;
+    block->version[0] = cache->pageVersion[block->pc >> 8];
+    block->version[1] = cache->pageVersion[block->lastPage];
+    return 1;
+}
+
+/* Decodes the block starting at pc into its slot, returning NULL if no
+ * instruction there can be cached. Blocks stop before trap addresses, so
+ * that runBlocks() only needs to look for traps when entering a block which
+ * hasn't been checked in this call. */
+
+static Block* decodeBlock(M6502_BlockCache* cache,
+    const byte* memory,
+    const byte* traps,
+    word pc,
+    const void* const codes[0x100],
+    const void* leave)
+{
+    Block* block = &cache->blocks[pc & (BLOCK_SLOTS - 1)];
+    unsigned addr = pc;
+    int count = 0;
+
+    while (count < BLOCK_INSNS)
+    {
+        byte opcode = memory[addr];
+        unsigned length = blockLengths[opcode];
+        unsigned last = addr + length - 1;
+        if ((last > 0xffff) || (addr < 0x200))
+            break;
+        if ((count && ((last >> 8) != (pc >> 8))) || (traps && traps[addr]))
+            break;
+
+        BlockInsn* insn = &block->insns[count++];
+        insn->code = codes[opcode];
+        if (length == 3)
+            insn->operand = memory[addr + 1] | (memory[addr + 2] << 8);
+        else if ((length == 2) && blockEnders[opcode]) /* relative */
+            insn->operand = (int8_t)memory[addr + 1];
+        else if (length == 2)
+            insn->operand = memory[addr + 1];
+
+        addr += length;
+        if (endsBlock(opcode, cache->jit != NULL))
+            break;
+    }
+
+    if (!count)
+    {
+        block->key = 0;
+        return NULL;
+    }
+
+    block->pc = pc;
+    block->count = count;
+    block->length = addr - pc;
+    block->lastPage = (addr - 1) >> 8;
+    block->insns[count].code = leave;
+    block->native = NULL;
+    block->heat = 0;
+    memcpy(block->bytes, &memory[pc], block->length);
+
+    for (unsigned a = pc; a < addr; a++)
+        cache->code[a >> 5] |= 1u << (a & 31);
+    block->key = (cache->call << 16) | pc;
+    cache->epoch++;
+    block->version[0] = cache->pageVersion[pc >> 8];
+    block->version[1] = cache->pageVersion[block->lastPage];
+    return block;
+}
+
+/* Called on a write to decoded code. Returns true if the write was into the
+ * block being run. */
+
+static inline int codeWritten(M6502_BlockCache* cache, Block* block, word addr)
+{
+    cache->pageVersion[addr >> 8]++;
+    cache->epoch++;
+    return (word)(addr - block->pc) < block->length;
+}
+
+/* A write into the running block abandons the rest of it, by pointing insn
+ * at a stub which leaves once the current instruction finishes. The zero
+ * page test is free for the zero page modes, whose ea is known to fit in a
+ * byte. */
+
+#define putMemory(ADDR, BYTE)                                              \
+    ((memory[ADDR] = BYTE),                                                \
+        (((ADDR) > 0xff) && isCode(cache, ADDR) &&                         \
+            codeWritten(cache, block, ADDR))                               \
+            ? (void)(executed = insn + 1 - block->insns, insn = abandon)    \
+            : (void)0)
+#define getMemory(ADDR) (memory[ADDR])
+#define callCallback(ADDR) ((M6502_Callback)NULL)
+
+/* Addressing modes using the predecoded operand. Modes not redefined here
+ * still read it from memory, which is fine as the block's bytes are known
+ * to be unchanged. */
+
+#undef immediate
+#undef abs
+#undef relative
+#undef absx
+#undef absy
+#undef zp
+#undef zpx
+#undef zpy
+#undef indx
+#undef indy
+#undef indzp
+
+#define immediate(ticks) \
+    tick(ticks);         \
+    ea = PC++;
+
+#define abs(ticks)        \
+    tick(ticks);          \
+    ea = insn->operand;   \
+    PC += 2;
+
+#define relative(ticks)   \
+    tick(ticks);          \
+    ea = insn->operand;   \
+    PC++;                 \
+    tickIf(((word)(PC + ea) >> 8) != (PC >> 8));
+
+#define absx(ticks)                                \
+    tick(ticks);                                   \
+    ea = insn->operand;                            \
+    PC += 2;                                       \
+    tickIf(((ticks == 4) || (ticks == 6)) &&       \
+           ((ea >> 8) != ((word)(ea + X) >> 8)));  \
+    ea += X;
+
+#define absy(ticks)                                                   \
+    tick(ticks);                                                      \
+    ea = insn->operand;                                               \
+    PC += 2;                                                          \
+    tickIf((ticks == 4) && ((ea >> 8) != ((word)(ea + Y) >> 8)));     \
+    ea += Y
+
+#define zp(ticks)               \
+    tick(ticks);                \
+    ea = (byte)insn->operand;   \
+    PC++;
+
+#define zpx(ticks)                \
+    tick(ticks);                  \
+    ea = (byte)(insn->operand + X); \
+    PC++;
+
+#define zpy(ticks)                \
+    tick(ticks);                  \
+    ea = (byte)(insn->operand + Y); \
+    PC++;
+
+#define indx(ticks)                                          \
+    tick(ticks);                                             \
+    {                                                        \
+        byte tmp = insn->operand + X;                        \
+        ea = memory[tmp] + (memory[(tmp + 1) & 0xff] << 8);  \
+        PC++;                                                \
+    }
+
+#define indy(ticks)                                                   \
+    tick(ticks);                                                      \
+    {                                                                 \
+        byte tmp = insn->operand;                                     \
+        ea = memory[tmp] + (memory[(tmp + 1) & 0xff] << 8);           \
+        PC++;                                                         \
+        tickIf((ticks == 5) && ((ea >> 8) != ((word)(ea + Y) >> 8))); \
+        ea += Y;                                                      \
+    }
+
+#define indzp(ticks)                                         \
+    tick(ticks);                                             \
+    {                                                        \
+        byte tmp = insn->operand;                            \
+        ea = memory[tmp] + (memory[(tmp + 1) & 0xff] << 8);  \
+        PC++;                                                \
+    }
+
+/* A taken branch leaves the block; one which isn't carries on with it. */
+
+#undef branch
+
+#define branch(ticks, adrmode, cond) \
+    if (cond)                        \
+    {                                \
+        adrmode(ticks);              \
+        PC += ea;                    \
+        tick(1);                     \
+        insn++;                      \
+        goto branchTaken;            \
+    }                                \
+    tick(ticks);                     \
+    PC++;                            \
+    next();
+
+#undef next
+#undef dispatch
+
+#define next() goto*(++insn)->code
+
+#define dispatch(num, name, mode, cycles) \
+    op##num : PC++;                       \
+    name(cycles, mode);                   \
+    next();
+
+#define blockCode(num, name, mode, cycles) [0x##num] = &&op##num,
+
+static int runBlocks(M6502* mpu, const M6502_TrapTable traps, unsigned long* budget)
+{
+    static const void* const codes[0x100] = {do_insns(blockCode)};
+    register byte* memory = mpu->memory;
+    register word PC;
+    word ea;
+    byte A, X, Y, P, S;
+    uint64_t cycles;
+    unsigned long remaining = *budget;
+    int reason = M6502_BudgetExhausted;
+    M6502_BlockCache* cache = mpu->blockCache;
+    M6502_Jit* jit = cache->jit;
+    uint64_t call;
+    Block* block;
+    Block* from = NULL; /* last block left, if not yet linked onwards */
+    int branched = 0;   /* whether it was left by a taken branch */
+    const BlockInsn* insn;
+    BlockInsn abandon[2] = {{NULL, 0}, {&&leaveBlock, 0}};
+    long executed = 0;
+    M6502_JitState state = {0};
+    M6502_JitLink* link = NULL; /* taken by the last compiled block run */
+
+    internalise();
+    mpu->flags &= ~M6502_StopRequested;
+    state.code = cache->code;
+    call = ++cache->call << 16;
+    cache->epoch++;
+
+    while (remaining)
+    {
+        block = &cache->blocks[PC & (BLOCK_SLOTS - 1)];
+        if ((block->key != (call | PC)) ||
+            (block->version[0] != cache->pageVersion[PC >> 8]) ||
+            (block->version[1] != cache->pageVersion[block->lastPage]))
+        {
+            if (!block->key || (block->pc != PC) ||
+                !revalidateBlock(cache, block, memory, traps))
+                block = decodeBlock(
+                    cache, memory, traps, PC, codes, &&leaveBlock);
+        }
+
+        /* Traps, instructions which can't be cached, and the last few of
+         * the budget go through the normal interpreter. As that doesn't
+         * look for writes to code, everything is rechecked afterwards. */
+
+        if (!block || (block->count > remaining))
+        {
+            unsigned long n = block ? remaining : 1;
+            unsigned long wanted = n;
+            externalise();
+            reason = runUntilDirect(mpu, traps, &n);
+            internalise();
+            remaining -= wanted - n;
+            call = ++cache->call << 16;
+            cache->epoch++;
+            link = NULL;
+            from = NULL;
+            if (reason != M6502_BudgetExhausted)
+                break;
+            continue;
+        }
+
+        if (from)
+        {
+            from->next[branched] = block;
+            from->linked[branched] = cache->epoch;
+            from = NULL;
+        }
+
+        if (jit && !(P & flagD))
+        {
+            /* Code compiled before the JIT last ran out of space is gone. */
+            if (block->native && (block->generation != cache->jitGeneration))
+            {
+                block->native = NULL;
+                block->heat = 0;
+            }
+
+            if (block->native)
+            {
+                if (link)
+                    M6502_jitLink(
+                        link, block->native, block->count, cache->epoch);
+                state.a = A;
+                state.x = X;
+                state.y = Y;
+                state.p = P;
+                state.s = S;
+                state.cycles = cycles;
+                state.remaining = remaining;
+                state.epoch = cache->epoch;
+                block->native(&state, memory);
+                A = state.a;
+                X = state.x;
+                Y = state.y;
+                P = state.p;
+                S = state.s;
+                PC = state.pc;
+                cycles = state.cycles;
+                remaining = state.remaining;
+                link = state.link;
+                if (state.written)
+                {
+                    cache->pageVersion[state.address >> 8]++;
+                    cache->epoch++;
+                    state.written = 0;
+                }
+                continue;
+            }
+
+            if (++block->heat == JIT_HEAT)
+            {
+                block->native = M6502_jitCompile(
+                    jit, block->pc, block->bytes, block->count);
+                if (cache->jitGeneration != M6502_jitGeneration(jit))
+                {
+                    cache->jitGeneration = M6502_jitGeneration(jit);
+                    cache->epoch++;
+                }
+                block->generation = cache->jitGeneration;
+            }
+        }
+
+        link = NULL;
+
+    runBlock:
+        insn = block->insns;
+        goto*insn->code;
+
+        do_insns(dispatch);
+
+    leaveBlock:
+        if (insn == &abandon[1])
+        {
+            remaining -= executed;
+            continue;
+        }
+        remaining -= insn - block->insns;
+        branched = 0;
+        goto followBlock;
+
+    branchTaken:
+        remaining -= insn - block->insns;
+        branched = 1;
+        if ((PC == block->pc) && (block->count <= remaining) && !jit)
+            goto runBlock;
+
+    followBlock:
+        if (!jit)
+        {
+            Block* next = block->next[branched];
+            if (next && (block->linked[branched] == cache->epoch) &&
+                (next->pc == PC) && (next->count <= remaining))
+            {
+                block = next;
+                goto runBlock;
+            }
+            from = block;
+        }
+    }
+
     externalise();
+    *budget = remaining;
+    return reason;
+}
+
+#undef blockCode
+#undef next
+#undef dispatch
+#undef putMemory
+#undef getMemory
+#undef callCallback
+#undef isCode
+#undef branch
+#undef immediate
+#undef abs
+#undef relative
+#undef absx
+#undef absy
+#undef zp
+#undef zpx
+#undef zpy
+#undef indx
+#undef indy
+#undef indzp
+
+#define next() break
+#define dispatch(num, name, mode, cycles) \
+    case 0x##num:                         \
+        name(cycles, mode);               \
+        next();
+
+#endif
+
+
+#define putMemory(ADDR, BYTE)                                  \
+    (findCallback(writeCallback, ADDR)                         \
+            ? writeCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, BYTE) \
+            : (memory[ADDR] = BYTE))
+
+#define getMemory(ADDR)                                                \
+    (findCallback(readCallback, ADDR)                                  \
+            ? readCallback[(ADDR) >> 8][(ADDR) & 0xff](mpu, ADDR, 0) \
+            : memory[ADDR])
+
+#define callCallback(ADDR) findCallback(mpu->callbacks->call, ADDR)
+
+int M6502_runUntil(M6502* mpu, const M6502_TrapTable traps, unsigned long* budget)
+{
+    if (mpu->opcodeCounts)
+        return runUntilCounting(mpu, traps, budget);
+    if (mpu->callbacks->pages)
+        return runUntilWithCallbacks(mpu, traps, budget);
+#if defined(__GNUC__)
+    if (mpu->blockCache)
+        return runBlocks(mpu, traps, budget);
+#endif
+    return runUntilDirect(mpu, traps, budget);
+}
+
+/* Asks M6502_runUntil() to return once the current instruction completes. */
+
+void M6502_stop(M6502* mpu)
+{
+    mpu->flags |= M6502_StopRequested;
+}
+
 #undef internalise
 #undef externalise
 #undef fetch
 #undef next
 #undef dispatch
-}
 
 int M6502_disassemble(M6502* mpu, word ip, char buffer[64])
 {
@@ -919,6 +1656,62 @@ int M6502_disassemble(M6502* mpu, word ip, char buffer[64])
     return 0;
 }
 
+#undef _implied
+#undef _immediate
+#undef _zp
+#undef _zpx
+#undef _zpy
+#undef _abs
+#undef _absx
+#undef _absy
+#undef _relative
+#undef _zpr
+#undef _indirect
+#undef _indzp
+#undef _indx
+#undef _indy
+#undef _indabsx
+
+/* Returns the address which the instruction at ip would access, given the
+ * current register values, or -1 if it does not address memory. */
+
+int M6502_effectiveAddress(M6502* mpu, word ip)
+{
+    byte* m = mpu->memory;
+    M6502_Registers* r = mpu->registers;
+    byte b1 = m[(word)(ip + 1)];
+    word w1 = b1 | (m[(word)(ip + 2)] << 8);
+
+    switch (m[ip])
+    {
+#define _implied return -1;
+#define _immediate return -1;
+#define _relative return -1;
+#define _zp return b1;
+#define _zpr return b1;
+#define _zpx return (byte)(b1 + r->x);
+#define _zpy return (byte)(b1 + r->y);
+#define _abs return w1;
+#define _absx return (word)(w1 + r->x);
+#define _absy return (word)(w1 + r->y);
+#define _indirect return m[w1] | (m[(word)(w1 + 1)] << 8);
+#define _indzp return m[b1] | (m[(byte)(b1 + 1)] << 8);
+#define _indx                                                  \
+    return m[(byte)(b1 + r->x)] | (m[(byte)(b1 + r->x + 1)] << 8);
+#define _indy \
+    return (word)((m[b1] | (m[(byte)(b1 + 1)] << 8)) + r->y);
+#define _indabsx                                                     \
+    return m[(word)(w1 + r->x)] | (m[(word)(w1 + r->x + 1)] << 8);
+
+#define effective(num, name, mode, cycles) \
+    case 0x##num:                          \
+        _##mode
+        do_insns(effective);
+    }
+
+    return -1;
+}
+
 void M6502_dump(M6502* mpu, char buffer[64])
 {
     M6502_Registers* r = mpu->registers;
@@ -983,14 +1776,123 @@ M6502* M6502_new(
     return mpu;
 }
 
+static void freeCallbackMap(M6502_CallbackMap map)
+{
+    for (int i = 0; i < 0x100; i++)
+        free(map[i]);
+}
+
 void M6502_delete(M6502* mpu)
 {
     if (mpu->flags & M6502_CallbacksAllocated)
+    {
+        freeCallbackMap(mpu->callbacks->read);
+        freeCallbackMap(mpu->callbacks->write);
+        freeCallbackMap(mpu->callbacks->call);
         free(mpu->callbacks);
+    }
     if (mpu->flags & M6502_MemoryAllocated)
         free(mpu->memory);
     if (mpu->flags & M6502_RegistersAllocated)
         free(mpu->registers);
+    M6502_setBlockCache(mpu, 0);
 
     free(mpu);
 }
+
+/* Turns the block cache on or off. It's only used by M6502_runUntil(), and
+ * only when no callbacks are installed and opcodes aren't being counted;
+ * otherwise the normal interpreter is used. Returns false if the block cache
+ * isn't available. */
+
+int M6502_setBlockCache(M6502* mpu, int enable)
+{
+#if defined(__GNUC__)
+    if (enable && !mpu->blockCache)
+    {
+        mpu->blockCache = calloc(1, sizeof(M6502_BlockCache));
+        if (!mpu->blockCache)
+            outOfMemory();
+    }
+    else if (!enable && mpu->blockCache)
+    {
+        M6502_jitDelete(mpu->blockCache->jit);
+        free(mpu->blockCache);
+        mpu->blockCache = NULL;
+    }
+    return 1;
+#else
+    return !enable;
+#endif
+}
+
+/* Turns the JIT on or off. Turning it on also turns on the block cache,
+ * whose blocks it compiles. As blocks are decoded differently for the JIT,
+ * any already decoded are thrown away either way. Returns false if the JIT
+ * isn't available on this host. */
+
+int M6502_setJit(M6502* mpu, int enable)
+{
+#if defined(__GNUC__)
+    if (enable)
+    {
+        M6502_setBlockCache(mpu, 1);
+        if (!mpu->blockCache->jit)
+        {
+            mpu->blockCache->jit = M6502_jitNew();
+            for (int i = 0; i < BLOCK_SLOTS; i++)
+                mpu->blockCache->blocks[i].key = 0;
+        }
+        return mpu->blockCache->jit != NULL;
+    }
+    if (mpu->blockCache && mpu->blockCache->jit)
+    {
+        for (int i = 0; i < BLOCK_SLOTS; i++)
+        {
+            mpu->blockCache->blocks[i].key = 0;
+            mpu->blockCache->blocks[i].native = NULL;
+            mpu->blockCache->blocks[i].heat = 0;
+        }
+        M6502_jitDelete(mpu->blockCache->jit);
+        mpu->blockCache->jit = NULL;
+    }
+    return 1;
+#else
+    return !enable;
+#endif
+}
+
+/* Installs (or, if fn is NULL, removes) a callback. Pages are allocated on
+ * demand and released again when their last callback is removed, so that
+ * M6502_runUntil() can go back to accessing memory directly. */
+
+void M6502_installCallback(M6502_Callbacks* callbacks,
+    M6502_CallbackMap map,
+    uint16_t address,
+    M6502_Callback fn)
+{
+    M6502_Callback* page = map[address >> 8];
+    if (!page)
+    {
+        if (!fn)
+            return;
+        page = calloc(0x100, sizeof(M6502_Callback));
+        if (!page)
+            outOfMemory();
+        map[address >> 8] = page;
+        callbacks->pages++;
+    }
+
+    page[address & 0xff] = fn;
+    if (fn)
+        return;
+
+    for (int i = 0; i < 0x100; i++)
+    {
+        if (page[i])
+            return;
+    }
+    free(page);
+    map[address >> 8] = NULL;
+    callbacks->pages--;
+}
@@ -8,12 +8,16 @@
 typedef struct _M6502		M6502;
 typedef struct _M6502_Registers	M6502_Registers;
 typedef struct _M6502_Callbacks	M6502_Callbacks;
+typedef struct _M6502_BlockCache	M6502_BlockCache;
 
 typedef int   (*M6502_Callback)(M6502 *mpu, uint16_t address, uint8_t data);
 
-typedef M6502_Callback	M6502_CallbackTable[0x10000];
+/* Callbacks are stored per 256-byte page; a page's table is only allocated
+ * once a callback is installed in it. */
+typedef M6502_Callback	*M6502_CallbackMap[0x100];
 typedef M6502_Callback	M6502_IllegalInstructionCallbackTable[0x100];
 typedef uint8_t		M6502_Memory[0x10000];
+typedef uint8_t		M6502_TrapTable[0x10000];
 
 enum {
   M6502_NMIVector= 0xfffa,  M6502_NMIVectorLSB= 0xfffa,  M6502_NMIVectorMSB= 0xfffb,
@@ -33,10 +37,11 @@ struct _M6502_Registers
 
 struct _M6502_Callbacks
 {
-  M6502_CallbackTable read;
-  M6502_CallbackTable write;
-  M6502_CallbackTable call;
+  M6502_CallbackMap read;
+  M6502_CallbackMap write;
+  M6502_CallbackMap call;
   M6502_IllegalInstructionCallbackTable illegal_instruction;
+  unsigned int pages;	/* number of allocated read/write/call pages */
 };
 
 struct _M6502
@@ -45,12 +50,24 @@ struct _M6502
   uint8_t	  *memory;
   M6502_Callbacks *callbacks;
   unsigned int	   flags;
+  uint64_t	   cycles;	/* clock cycles executed so far */
+  uint64_t	  *opcodeCounts; /* if set, 256 per-opcode instruction counts */
+  uint8_t	   lowestStack;	/* lowest S seen while counting opcodes */
+  M6502_BlockCache *blockCache; /* see M6502_setBlockCache() */
+};
+
+/* Reasons for M6502_runUntil() to return. */
+enum {
+  M6502_BudgetExhausted = 0,	/* executed the requested number of instructions */
+  M6502_Trapped		= 1,	/* PC reached an address marked in the trap table */
+  M6502_Stopped		= 2	/* a callback called M6502_stop() */
 };
 
 enum {
   M6502_RegistersAllocated = 1 << 0,
   M6502_MemoryAllocated    = 1 << 1,
-  M6502_CallbacksAllocated = 1 << 2
+  M6502_CallbacksAllocated = 1 << 2,
+  M6502_StopRequested      = 1 << 3
 };
 
 extern M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks);
@@ -58,9 +75,15 @@ extern void   M6502_reset(M6502 *mpu);
 extern void   M6502_nmi(M6502 *mpu);
 extern void   M6502_irq(M6502 *mpu);
 extern void   M6502_run(M6502 *mpu);
+extern int    M6502_runUntil(M6502 *mpu, const M6502_TrapTable traps, unsigned long *budget);
+extern void   M6502_stop(M6502 *mpu);
+extern int    M6502_setBlockCache(M6502 *mpu, int enable);
+extern int    M6502_setJit(M6502 *mpu, int enable);
 extern int    M6502_disassemble(M6502 *mpu, uint16_t addr, char buffer[64]);
+extern int    M6502_effectiveAddress(M6502 *mpu, uint16_t addr);
 extern void   M6502_dump(M6502 *mpu, char buffer[64]);
 extern void   M6502_delete(M6502 *mpu);
+extern void   M6502_installCallback(M6502_Callbacks *callbacks, M6502_CallbackMap map, uint16_t address, M6502_Callback fn);
 
 #define M6502_getVector(MPU, VEC)			\
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]) )		\
@@ -70,8 +93,14 @@ extern void   M6502_delete(M6502 *mpu);
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]= ((uint8_t)(ADDR)) & 0xff) )	\
     , ((MPU)->memory[M6502_##VEC##VectorMSB]= (uint8_t)((ADDR) >> 8)) )
 
-#define M6502_getCallback(MPU, TYPE, ADDR)	((MPU)->callbacks->TYPE[ADDR])
-#define M6502_setCallback(MPU, TYPE, ADDR, FN)	((MPU)->callbacks->TYPE[ADDR]= (FN))
+static inline M6502_Callback M6502_lookupCallback(M6502_CallbackMap map, uint16_t address)
+{
+  M6502_Callback *page= map[address >> 8];
+  return page ? page[address & 0xff] : NULL;
+}
+
+#define M6502_getCallback(MPU, TYPE, ADDR)	M6502_lookupCallback((MPU)->callbacks->TYPE, (ADDR))
+#define M6502_setCallback(MPU, TYPE, ADDR, FN)	M6502_installCallback((MPU)->callbacks, (MPU)->callbacks->TYPE, (ADDR), (FN))
 
 
 #endif /*__m6502_h */
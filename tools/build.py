@@ -13,8 +13,11 @@ cxxprogram(name="xextobin", srcs=["./xextobin.cc"], deps=["+libfmt"])
 cxxprogram(name="shuffle", srcs=["./shuffle.cc"], deps=["+libfmt"])
 cxxprogram(name="mkoricdsk", srcs=["./mkoricdsk.cc"], deps=["+libfmt"])
 cxxprogram(name="mkcombifs", srcs=["./mkcombifs.cc"], deps=["+libfmt"])
-cxxprogram(name="fillfile", srcs=["./fillfile.cc"], deps=["+libfmt"])
+cxxprogram(name="mkcpmfs", srcs=["./mkcpmfs.cc"], deps=["+libfmt"])
 cxxprogram(name="mkusr", srcs=["./mkusr.cc"], deps=["+libfmt", "+libelf"])
+cxxprogram(
+    name="elftocom", srcs=["./elftocom.cc"], deps=["+libfmt", "+libelf"]
+)
 cprogram(name="unixtocpm", srcs=["./unixtocpm.c"])
 cprogram(name="mkdfs", srcs=["./mkdfs.c"])
 cprogram(name="mkimd", srcs=["./mkimd.c"])
@@ -22,6 +25,11 @@ cprogram(
     name="fontconvert", srcs=["./fontconvert.c", "./libbdf.c", "./libbdf.h"]
 )
 cprogram(name="img2osi", srcs=["./img2osi.c", "./osi.h"])
+cprogram(
+    name="relobench",
+    srcs=["./relobench.c"],
+    deps=["third_party/lib6502"],
+)
 
 
 @Rule
@@ -50,6 +58,18 @@ def multilink(
     )
 
 
+@Rule
+def elftocom(self, name=None, src: Target = None):
+    simplerule(
+        replaces=self,
+        ins=[src],
+        outs=[f"={name}.com"],
+        deps=["tools+elftocom"],
+        commands=["$[deps[0]] -r $[ins[0]] -w $[outs[0]]"],
+        label="ELFTOCOM",
+    )
+
+
 @Rule
 def xextobin(self, name=None, src: Target = None, address=0):
     simplerule(
@@ -72,46 +92,28 @@ def mkcpmfs(
     size=None,
     items: TargetsMap = {},
 ):
-    cs = []
+    flags = "-f %s" % format
+    deps = ["diskdefs", "tools+mkcpmfs"]
     if template:
-        cs += ["cp %s $[outs[0]]" % filenameof(template)]
-    else:
-        # Some versions of mkfs.cpm don't work right if the input file
-        # doesn't exist.
-        cs += ["$[deps[1]] -f $[outs[0]] -b 0xe5 -n 100000"]
-        mkfs = "mkfs.cpm -f %s" % format
-        if bootimage:
-            mkfs += " -b %s" % filenameof(bootimage)
-        mkfs += " $[outs[0]]"
-        cs += [mkfs]
+        flags += " -t %s" % filenameof(template)
+        deps += [template]
+    if bootimage:
+        flags += " -b %s" % filenameof(bootimage)
+        deps += [bootimage]
+    if size:
+        flags += " -s %d" % size
 
     ins = []
     for k, v in items.items():
-        flags = None
-        if "@" in k:
-            k, flags = k.split("@")
-
-        cs += ["cpmcp -f %s $[outs[0]] %s %s" % (format, filenameof(v), k)]
-        if flags:
-            cs += ["cpmchattr -f %s $[outs[0]] %s %s" % (format, flags, k)]
+        flags += " %s=%s" % (k, filenameof(v))
         ins += [v]
 
-    if size:
-        cs += ["truncate -s %d $[outs[0]]" % size]
-
     simplerule(
         replaces=self,
         ins=ins,
         outs=[f"={name}.img"],
-        deps=(
-            ["diskdefs", "tools+fillfile"]
-            + (
-                [bootimage]
-                if bootimage
-                else [] + [template] if template else []
-            )
-        ),
-        commands=cs,
+        deps=deps,
+        commands=["$[deps[1]] -d $[deps[0]] -o $[outs[0]] " + flags],
         label="MKCPMFS",
     )
 
@@ -9,13 +9,10 @@
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "globals.h"
 
-static uint16_t dma;
-static uint8_t current_disk;
-static int exitcode = 0;
-uint16_t himem = BDOS_ADDRESS;
-
 static const char* bdos_names[] = {
     "BDOS_EXIT_PROGRAM",
     "BDOS_CONSOLE_INPUT",
@@ -80,20 +77,25 @@ static struct fcb* fcb_at(uint16_t address);
 
 void bios_coldboot(void) {}
 
+/* Set in the zero page usage byte of the header when the relocation data is in
+ * the version 2 format. */
+
+#define COMHDR_ZP_RELV2 0x80
+
 static uint16_t do_relocation_item(uint16_t address, uint8_t n, uint8_t addend)
 {
     address += n;
     if (n != 0xe)
-        ram[address] += addend;
+        ctx->ram[address] += addend;
     return address;
 }
 
-static uint16_t do_relocation(uint16_t relotable, uint8_t addend)
+static uint16_t do_relocation(
+    uint16_t address, uint16_t relotable, uint8_t addend)
 {
-    uint16_t address = TPA_BASE;
     for (;;)
     {
-        uint8_t b = ram[relotable++];
+        uint8_t b = ctx->ram[relotable++];
         uint8_t msb = b >> 4;
         if (msb == 0xf)
             return relotable;
@@ -106,10 +108,160 @@ static uint16_t do_relocation(uint16_t relotable, uint8_t addend)
     }
 }
 
-static void relocate(uint16_t relotable)
+static uint8_t relocation_byte_v2(unsigned* relotable)
+{
+    if (*relotable >= sizeof(ctx->ram))
+        fatal("version 2 relocation data runs off the end of memory");
+    return ctx->ram[(*relotable)++];
+}
+
+/* Applies one table of version 2 relocation data: groups of fixups, each
+ * preceded by the number of pages to advance and the number of fixups, and
+ * ending with 0xff. Fixups must be in the image, which ends where the table
+ * starts. Returns the address of the byte after the table. */
+
+static uint16_t do_relocation_v2(
+    unsigned address, uint16_t relotable, uint16_t limit, uint8_t addend)
+{
+    unsigned p = relotable;
+    for (;;)
+    {
+        uint8_t skip = relocation_byte_v2(&p);
+        if (skip == 0xff)
+            return p;
+        address += skip << 8;
+
+        uint8_t count = relocation_byte_v2(&p);
+        if (!count)
+            fatal("empty group in version 2 relocation data");
+        while (count--)
+        {
+            unsigned fixup = address + relocation_byte_v2(&p);
+            if (fixup >= limit)
+                fatal("version 2 relocation at 0x%04x is past the image",
+                    fixup);
+            ctx->ram[fixup] += addend;
+        }
+    }
+}
+
+/* Relocates the image at the start of the given page to run there, using
+ * zero page from zp upwards. Returns the address of its relocation table. */
+
+uint16_t relocate_image(uint8_t page, uint8_t zp)
+{
+    uint16_t base = page << 8;
+    uint16_t relotable =
+        (ctx->ram[base + 2] | (ctx->ram[base + 3] << 8)) + base;
+    if (ctx->ram[base + 0] & COMHDR_ZP_RELV2)
+    {
+        ctx->ram[base + 0] &= ~COMHDR_ZP_RELV2;
+        uint16_t memtable = do_relocation_v2(base, relotable, relotable, zp);
+        do_relocation_v2(base, memtable, relotable, page);
+    }
+    else
+        do_relocation(base, do_relocation(base, relotable, zp), page);
+    return relotable;
+}
+
+/* Relocated program images, so that running the same program many times (as
+ * the job modes do) only reads and relocates it once. Entries are keyed on
+ * the path and revalidated against the file's identity and timestamp. */
+
+struct image
+{
+    struct image* next;
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    uint16_t relotable;
+    uint8_t data[];
+};
+
+static struct image* images;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool image_matches(const struct image* i, const struct stat* st)
+{
+    return (i->dev == st->st_dev) && (i->ino == st->st_ino) &&
+           (i->size == st->st_size) &&
+           (i->mtime.tv_sec == st->st_mtim.tv_sec) &&
+           (i->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void cache_image(
+    const char* path, const struct stat* st, uint16_t relotable)
+{
+    struct image* i = malloc(sizeof(struct image) + st->st_size);
+    if (!i)
+        return;
+    i->path = strdup(path);
+    i->dev = st->st_dev;
+    i->ino = st->st_ino;
+    i->mtime = st->st_mtim;
+    i->size = st->st_size;
+    i->relotable = relotable;
+    memcpy(i->data, &ctx->ram[TPA_BASE], st->st_size);
+
+    pthread_mutex_lock(&images_lock);
+    struct image** p = &images;
+    while (*p && strcmp((*p)->path, path))
+        p = &(*p)->next;
+    if (*p)
+    {
+        struct image* old = *p;
+        *p = old->next;
+        free(old->path);
+        free(old);
+    }
+    i->next = images;
+    images = i;
+    pthread_mutex_unlock(&images_lock);
+}
+
+/* Loads and relocates a program into the TPA, returning the address of its
+ * relocation table. */
+
+static uint16_t load_program(const char* path)
 {
-    relotable = do_relocation(relotable, ZP_BASE);
-    do_relocation(relotable, TPA_BASE >> 8);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        fatal("couldn't open program: %s", strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        fatal("couldn't stat program: %s", strerror(errno));
+
+    bool cached = false;
+    uint16_t relotable;
+    pthread_mutex_lock(&images_lock);
+    for (struct image* i = images; i; i = i->next)
+    {
+        if ((strcmp(i->path, path) == 0) && image_matches(i, &st) &&
+            (i->size <= ctx->himem - TPA_BASE))
+        {
+            memcpy(&ctx->ram[TPA_BASE], i->data, i->size);
+            relotable = i->relotable;
+            cached = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&images_lock);
+
+    if (!cached)
+    {
+        ssize_t len = read(fd, &ctx->ram[TPA_BASE], ctx->himem - TPA_BASE);
+        relotable = relocate_image(TPA_BASE >> 8, ZP_BASE);
+
+        /* Only whole programs are worth keeping. */
+
+        if (len == st.st_size)
+            cache_image(path, &st, relotable);
+    }
+    close(fd);
+
+    return relotable;
 }
 
 static void makefcb(uint16_t address, const char* word)
@@ -155,64 +307,56 @@ static void makefcb(uint16_t address, const char* word)
 
 void bios_warmboot(void)
 {
-    M6502_reset(cpu);
+    M6502_reset(ctx->cpu);
+
+    if (ctx->terminated)
+        emulator_exit(ctx->exitcode);
 
-    if (user_command_line[0])
+    if (ctx->user_command_line[0])
     {
-        static bool terminate_next_time = false;
-        if (terminate_next_time)
-            exit(exitcode);
-        terminate_next_time = true;
+        ctx->terminated = true;
 
         /* Push the return address onto the stack. */
-        ram[0x01fe] = (EXIT_ADDRESS-1) & 0xff;
-        ram[0x01ff] = (EXIT_ADDRESS-1) >> 8;
-        cpu->registers->s = 0xfd;
-
-        int fd = open(user_command_line[0], O_RDONLY);
-        if (fd == -1)
-            fatal("couldn't open program: %s", strerror(errno));
-        read(fd, &ram[TPA_BASE], himem - TPA_BASE);
-        close(fd);
+        ctx->ram[0x01fe] = (EXIT_ADDRESS-1) & 0xff;
+        ctx->ram[0x01ff] = (EXIT_ADDRESS-1) >> 8;
+        ctx->cpu->registers->s = 0xfd;
 
-        uint16_t relotable =
-            (ram[TPA_BASE + 2] | (ram[TPA_BASE + 3] << 8)) + TPA_BASE;
-        relocate(relotable);
+        uint16_t relotable = load_program(ctx->user_command_line[0]);
 
 		/* Parse the first word of the command line into the primary FCB. */
 
-		makefcb(relotable, user_command_line[1]);
-		if (user_command_line[1])
-			makefcb(relotable+16, user_command_line[2]);
+		makefcb(relotable, ctx->user_command_line[1]);
+		if (ctx->user_command_line[1])
+			makefcb(relotable+16, ctx->user_command_line[2]);
 
 		/* Generate the command line. */
 
-        dma = relotable + 37; /* leave space for the FCBs */
+        ctx->dma = relotable + 37; /* leave space for the FCBs */
 
         int offset = 1;
-        for (int word = 1; user_command_line[word]; word++)
+        for (int word = 1; ctx->user_command_line[word]; word++)
         {
             if (word > 1)
             {
-                ram[dma + offset] = ' ';
+                ctx->ram[ctx->dma + offset] = ' ';
                 offset++;
             }
 
-            const char* pin = user_command_line[word];
+            const char* pin = ctx->user_command_line[word];
             while (*pin)
             {
                 if (offset > 125)
                     fatal("user command line too long");
-                ram[dma + offset] = toupper(*pin++);
+                ctx->ram[ctx->dma + offset] = toupper(*pin++);
                 offset++;
             }
         }
-        ram[dma] = offset - 1;
-        ram[dma + offset] = 0xe5; /* deliberately not zero-terminated */
+        ctx->ram[ctx->dma] = offset - 1;
+        ctx->ram[ctx->dma + offset] = 0xe5; /* deliberately not zero-terminated */
 
-        ram[TPA_BASE + 5] = BDOS_ADDRESS & 0xff;
-        ram[TPA_BASE + 6] = BDOS_ADDRESS >> 8;
-        cpu->registers->pc = TPA_BASE + 7;
+        ctx->ram[TPA_BASE + 5] = BDOS_ADDRESS & 0xff;
+        ctx->ram[TPA_BASE + 6] = BDOS_ADDRESS >> 8;
+        ctx->cpu->registers->pc = TPA_BASE + 7;
     }
     else
     {
@@ -220,28 +364,138 @@ void bios_warmboot(void)
     }
 }
 
-static void bios_const(void)
+/* Console output is buffered, and written out when the buffer fills, before
+ * the guest waits for input, on exit, and on a status poll once output has
+ * been waiting for longer than CONSOLE_FLUSH_DELAY (so that programs which
+ * check for ^C as they go don't force a write per character). */
+
+#define CONSOLE_FLUSH_DELAY 50000000 /* ns */
+
+uint64_t now_ns(void)
 {
-    struct pollfd pollfd = {0, POLLIN, 0};
-    poll(&pollfd, 1, 0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void console_flush(void)
+{
+    const uint8_t* p = ctx->console_buffer;
+    int len = ctx->console_buffered;
+    while (len > 0)
+    {
+        ssize_t n = SYSCALL(write(ctx->console_out, p, len));
+        if (n <= 0)
+            break;
+        p += n;
+        len -= n;
+    }
+    ctx->console_buffered = 0;
+}
+
+void console_putc(uint8_t c)
+{
+    if (!ctx->console_buffered)
+        ctx->console_buffered_since = now_ns();
+    ctx->console_buffer[ctx->console_buffered++] = c;
+
+    /* Keep the output in step with the trace and the debugger. */
+
+    if ((ctx->console_buffered == CONSOLE_BUFFER_SIZE) || tracing ||
+        ctx->singlestepping)
+        console_flush();
+}
+
+/* With idle detection on, a program which polls the console status over
+ * and over with little else in between is assumed to be waiting for a key,
+ * and the poll blocks with a timeout which doubles on each empty poll up to
+ * IDLE_MAX_TIMEOUT. The time spent blocked is accounted as idle time. */
+
+bool idle_detection = false;
+
+#define IDLE_POLL_CYCLES 2000 /* max cycles between polls in a busy loop */
+#define IDLE_POLL_COUNT 16    /* polls before we consider the guest idle */
+#define IDLE_MAX_TIMEOUT 64   /* ms */
+
+static int idle_timeout(void)
+{
+    if (ctx->cpu->cycles - ctx->last_poll_cycles > IDLE_POLL_CYCLES)
+    {
+        ctx->idle_polls = 0;
+        ctx->idle_timeout = 0;
+        return 0;
+    }
+
+    if (++ctx->idle_polls < IDLE_POLL_COUNT)
+        return 0;
+    if (!ctx->idle_timeout)
+        ctx->idle_timeout = 1;
+    else if (ctx->idle_timeout < IDLE_MAX_TIMEOUT)
+        ctx->idle_timeout *= 2;
+    return ctx->idle_timeout;
+}
+
+void bios_const(void)
+{
+    if (ctx->replay)
+    {
+        set_result(replay_ready() ? 0xff : 0, true);
+        return;
+    }
+
+    int timeout = idle_detection ? idle_timeout() : 0;
+    if (timeout || (ctx->console_buffered &&
+                       (now_ns() - ctx->console_buffered_since >
+                           CONSOLE_FLUSH_DELAY)))
+        console_flush();
+
+    uint64_t start = timeout ? now_ns() : 0;
+    struct pollfd pollfd = {ctx->console_in, POLLIN, 0};
+    SYSCALL(poll(&pollfd, 1, timeout));
+    if (timeout)
+        ctx->idle_ns += now_ns() - start;
+    ctx->last_poll_cycles = ctx->cpu->cycles;
+
     if (pollfd.revents & POLLIN)
+    {
+        ctx->idle_polls = 0;
+        ctx->idle_timeout = 0;
         set_result(0xff, true);
+    }
     else
         set_result(0, true);
 }
 
-static void bios_getchar(void)
+/* Blocks for a key, returning -1 at the end of the input. */
+
+int console_getc(void)
 {
-    char c = 0;
-    (void)read(0, &c, 1);
+    uint8_t c;
+    snapshot_before_input();
+    console_flush();
+    if (ctx->replay)
+    {
+        int k = replay_getc();
+        if (k == -1)
+            return -1;
+        c = k;
+    }
+    else if (SYSCALL(read(ctx->console_in, &c, 1)) != 1)
+        return -1;
     if (c == '\n')
         c = '\r';
-    set_result(c, true);
+    return c;
+}
+
+static void bios_getchar(void)
+{
+    int c = console_getc();
+    set_result((c == -1) ? 0 : c, true);
 }
 
 static void bios_putchar(void)
 {
-    (void)write(1, &cpu->registers->a, 1);
+    console_putc(ctx->cpu->registers->a);
 }
 
 static void bios_finddrv(void)
@@ -267,7 +521,7 @@ void bios_entry(uint8_t bios_call)
         case 2: bios_const(); return; // const
         case 3: bios_getchar(); return; // conin
         case 4: bios_putchar(); return; // conout
-		case 9: set_result((TPA_BASE>>8) | (himem&0xff00), true); return; // gettpa
+		case 9: set_result((TPA_BASE>>8) | (ctx->himem&0xff00), true); return; // gettpa
         case 15: bios_finddrv(); return;
             // clang-format on
     }
@@ -283,17 +537,19 @@ static void bdos_getchar(void)
 
 static void bdos_putchar(void)
 {
-    uint8_t c = cpu->registers->a;
-    (void)write(1, &c, 1);
+    console_putc(ctx->cpu->registers->a);
 }
 
 static void bdos_consoleio(void)
 {
-    switch (cpu->registers->x)
+    switch (ctx->cpu->registers->x)
     {
         case 0xff:
+            /* bios_const() overwrites the registers, so a snapshot taken by
+             * console_getc() wouldn't resume this call. */
+            snapshot_before_input();
             bios_const();
-            if (cpu->registers->a == 0xff)
+            if (ctx->cpu->registers->a == 0xff)
                 bios_getchar();
             break;
 
@@ -312,39 +568,53 @@ static void bdos_printstring(void)
     uint16_t xa = get_xa();
     for (;;)
     {
-        uint8_t c = ram[xa++];
+        uint8_t c = ctx->ram[xa++];
         if (!c || (c == '$'))
             break;
-        (void)write(1, &c, 1);
+        console_putc(c);
     }
 }
 
 static void bdos_consolestatus(void)
 {
     bios_const();
-    set_result(cpu->registers->a, true);
+    set_result(ctx->cpu->registers->a, true);
 }
 
 void bdos_readline(void)
 {
     fflush(stdout);
+    snapshot_before_input();
+    console_flush();
 
     uint16_t xa = get_xa();
-    uint8_t maxcount = ram[xa + 0];
-    int count = read(0, &ram[xa + 2], maxcount);
-    if ((count > 0) && (ram[xa + 2 + count - 1] == '\n'))
+    uint8_t maxcount = ctx->ram[xa + 0];
+    int count = 0;
+    if (ctx->replay)
+    {
+        while (count < maxcount)
+        {
+            int c = replay_getc();
+            if ((c == -1) || (c == '\r'))
+                break;
+            ctx->ram[xa + 2 + count++] = c;
+        }
+    }
+    else
+        count = SYSCALL(read(ctx->console_in, &ctx->ram[xa + 2], maxcount));
+    if ((count > 0) && (ctx->ram[xa + 2 + count - 1] == '\n'))
         count--;
-    ram[xa + 1] = count;
+    ctx->ram[xa + 1] = count;
     set_result(count, true);
 }
 
 static struct fcb* fcb_at(uint16_t address)
 {
-    struct fcb* fcb = (struct fcb*)&ram[address];
+    struct fcb* fcb = (struct fcb*)&ctx->ram[address];
 
     /* Autoselect the current drive. */
     if (fcb->filename.drive == 0)
-        fcb->filename.drive = current_disk + 1;
+        fcb->filename.drive = ctx->current_disk + 1;
 
     return fcb;
 }
@@ -372,18 +642,18 @@ static void set_current_record(struct fcb* fcb, int record, int total)
 
 static void bdos_resetdisk(void)
 {
-    current_disk = 0; /* select drive A */
+    ctx->current_disk = 0; /* select drive A */
     set_result(0xff, true);
 }
 
 static void bdos_selectdisk(void)
 {
-    current_disk = cpu->registers->a;
+    ctx->current_disk = ctx->cpu->registers->a;
 }
 
 static void bdos_getdisk(void)
 {
-    set_result(current_disk, true);
+    set_result(ctx->current_disk, true);
 }
 
 static void bdos_openfile(void)
@@ -432,7 +702,7 @@ static void bdos_renamefile(void)
 
 static void bdos_findnext(void)
 {
-    struct fcb* fcb = (struct fcb*)&ram[dma];
+    struct fcb* fcb = (struct fcb*)&ctx->ram[ctx->dma];
     memset(fcb, 0, sizeof(struct fcb));
     int i = file_findnext(&fcb->filename);
     set_result(i ? 0xff : 0, !i);
@@ -463,7 +733,7 @@ static void bdos_readwritesequential(readwrite_cb* readwrite)
 
     struct file* f = file_open(&fcb->filename);
     int here = get_current_record(fcb);
-    int i = readwrite(f, &ram[dma], here);
+    int i = readwrite(f, &ctx->ram[ctx->dma], here);
     set_current_record(fcb, here + 1, file_getrecordcount(f));
     if (i == -1)
         set_result(0xff, false);
@@ -479,7 +749,7 @@ static void bdos_readwriterandom(readwrite_cb* readwrite)
 
     uint16_t record = fcb->r[0] + (fcb->r[1] << 8);
     struct file* f = file_open(&fcb->filename);
-    int i = readwrite(f, &ram[dma], record);
+    int i = readwrite(f, &ctx->ram[ctx->dma], record);
     set_current_record(fcb, record, file_getrecordcount(f));
     if (i == -1)
         set_result(0xff, false);
@@ -502,7 +772,7 @@ static void bdos_filelength(void)
 
 static void bdos_getsetuser(void)
 {
-    if (cpu->registers->a == 0xff)
+    if (ctx->cpu->registers->a == 0xff)
         set_result(0, true);
 }
 
@@ -553,13 +823,13 @@ void parse_filename(uint8_t fcb[16], const char* filename)
         fill(fcb+9, filename+1, 3);
 
 	set_result(get_xa(), filename);
-    cpu->registers->p &= ~0x01;
+    ctx->cpu->registers->p &= ~0x01;
 }
 
 static void bdos_parsefilename(void)
 {
-	uint8_t* fcb = &ram[dma];
-    const char* filename = &ram[get_xa()];
+	uint8_t* fcb = &ctx->ram[ctx->dma];
+    const char* filename = &ctx->ram[get_xa()];
 
 	parse_filename(fcb, filename);
 }
@@ -602,11 +872,13 @@ void bdos_entry(uint8_t bdos_call, bool log)
         fprintf(stderr, ") -> ");
     }
 
-    cpu->registers->p &= ~0x01;
+    uint64_t syscalls = ctx->syscalls;
+    uint64_t start = now_ns();
+    ctx->cpu->registers->p &= ~0x01;
     switch (bdos_call)
     {
             // clang-format off
-		case 0: exit(0); break;
+		case 0: emulator_exit(0); break;
         case 1: bdos_getchar(); break;
         case 2: bdos_putchar(); break;
         case 6: bdos_consoleio(); break;
@@ -627,7 +899,7 @@ void bdos_entry(uint8_t bdos_call, bool log)
         case 23: bdos_renamefile(); break;
         case 24: set_result(0xffff, false); break; // get login vector
         case 25: bdos_getdisk(); break; // get current disk
-        case 26: dma = get_xa(); break; // set DMA
+        case 26: ctx->dma = get_xa(); break; // set DMA
         case 27: set_result(0, false); break; // get allocation vector
         case 29: set_result(0x0000, false); break; // get read-only vector
         case 31: set_result(0, false); break; // get disk parameter block
@@ -637,7 +909,7 @@ void bdos_entry(uint8_t bdos_call, bool log)
         case 35: bdos_filelength(); break;
 		case 38: set_result(BIOS_ADDRESS, true); break;
         case 40: bdos_readwriterandom(file_write); break;
-		case 42: set_result((TPA_BASE>>8) | (himem&0xff00), true); break;
+		case 42: set_result((TPA_BASE>>8) | (ctx->himem&0xff00), true); break;
 		case 43: bdos_parsefilename(); break;
             // clang-format on
     
@@ -646,10 +918,50 @@ void bdos_entry(uint8_t bdos_call, bool log)
             fatal("unimplemented bdos entry %d", bdos_call);
     }
 
+    ctx->bdos_calls[bdos_call]++;
+    ctx->bdos_syscalls[bdos_call] += ctx->syscalls - syscalls;
+    ctx->bdos_ns[bdos_call] += now_ns() - start;
+
     if (log)
     {
-        if (cpu->registers->p & 0x01)
+        if (ctx->cpu->registers->p & 0x01)
             fprintf(stderr, "FAILED ");
         fprintf(stderr, "%04x\n", get_xa());
     }
 }
+
+void bdos_call_name(char* buffer, size_t len, int bdos_call)
+{
+    if (bdos_call < sizeof(bdos_names) / sizeof(*bdos_names))
+        snprintf(buffer, len, "%s", bdos_names[bdos_call]);
+    else
+        snprintf(buffer, len, "BDOS_%d", bdos_call);
+}
+
+void bdos_report_stats(FILE* fp)
+{
+    fprintf(fp,
+        "%-28s %10s %10s %8s\n",
+        "bdos call",
+        "calls",
+        "syscalls",
+        "per call");
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t calls = ctx->bdos_calls[i];
+        if (!calls)
+            continue;
+
+        char name[32];
+        bdos_call_name(name, sizeof(name), i);
+        fprintf(fp,
+            "%-28s %10llu %10llu %8.2f\n",
+            name,
+            (unsigned long long)calls,
+            (unsigned long long)ctx->bdos_syscalls[i],
+            (double)ctx->bdos_syscalls[i] / calls);
+    }
+    fprintf(fp, "total syscalls: %llu\n", (unsigned long long)ctx->syscalls);
+    if (idle_detection)
+        fprintf(fp, "idle time: %.6fs\n", ctx->idle_ns / 1e9);
+}
@@ -4,11 +4,39 @@ cprogram(
     name="cpmemu",
     srcs=[
         "./biosbdos.c",
+        "./diskbios.c",
         "./emulator.c",
         "./fileio.c",
         "./screen.c",
+        "./jobs.c",
+        "./server.c",
         "./main.c",
+        "./profile.c",
+        "./replay.c",
+        "./snapshot.c",
+        "./stats.c",
+        "./trace.c",
+        "./trace.h",
         "./globals.h",
     ],
     deps=["third_party/lib6502", "+libreadline"],
+    ldflags=["-lpthread"],
+)
+
+cprogram(
+    name="tracedump",
+    srcs=["./tracedump.c", "./trace.h"],
+    deps=["third_party/lib6502"],
+)
+
+cprogram(
+    name="watchbench",
+    srcs=["./watchbench.c"],
+    deps=["third_party/lib6502"],
+)
+
+cprogram(
+    name="jitcheck",
+    srcs=["./jitcheck.c"],
+    deps=["third_party/lib6502"],
 )
@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "globals.h"
+
+/* BIOS mode. Rather than trapping BDOS calls, this loads the real BDOS
+ * (which then loads CCP.SYS from drive A) and provides the BIOS underneath
+ * it: a TTY driver on the console, and drives backed by CP/M filesystem
+ * images, as made by mkcpmfs, mapped into memory. Disk geometries come from
+ * a cpmtools diskdefs file.
+ *
+ * The BIOS's own structures (the TTY driver, DPHs, DPBs and the buffers
+ * they point at) are allocated downwards from the top of memory; the TPA is
+ * everything below that, and the BDOS is loaded at the bottom of it, as the
+ * real ports do. */
+
+#define SECTOR_SIZE 128
+#define MAX_DRIVES 16
+
+/* BIOS entrypoints and structures; see include/cpm65.inc and driver.inc. */
+
+#define BIOS_CONST 0
+#define BIOS_CONIN 1
+#define BIOS_CONOUT 2
+#define BIOS_SELDSK 3
+#define BIOS_SETSEC 4
+#define BIOS_SETDMA 5
+#define BIOS_READ 6
+#define BIOS_WRITE 7
+#define BIOS_RELOCATE 8
+#define BIOS_GETTPA 9
+#define BIOS_SETTPA 10
+#define BIOS_GETZP 11
+#define BIOS_SETZP 12
+#define BIOS_SETBANK 13
+#define BIOS_ADDDRV 14
+#define BIOS_FINDDRV 15
+
+#define COMHDR_ENTRY 7
+
+#define DRVID_TTY 1
+#define DRVSTRUCT_ID 0
+#define DRVSTRUCT_STRAT 2
+#define DRVSTRUCT_NEXT 4
+#define DRVSTRUCT_NAME 6
+
+#define DPH_DIRBUF 8
+#define DPH_DPB 10
+#define DPH_CSV 12
+#define DPH_ALV 14
+#define DPH_SIZE 16
+
+#define DPB_BSH 2
+#define DPB_BLM 3
+#define DPB_EXM 4
+#define DPB_DSM 5
+#define DPB_DRM 7
+#define DPB_AL 9
+#define DPB_CKS 11
+#define DPB_OFF 13
+#define DPB_SIZE 15
+
+struct geometry
+{
+    int seclen;
+    int tracks;
+    int sectrk;
+    int blocksize;
+    int maxdir;
+    int boottrk;
+};
+
+struct disk
+{
+    char* path;
+    char* format;
+    uint8_t* data;
+    size_t size;
+    bool readonly;
+    uint32_t sectors;
+    uint16_t dph;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+struct disks
+{
+    struct disk drives[MAX_DRIVES];
+    struct disk* current;
+    uint32_t sector;
+    uint16_t dma;
+    uint16_t top; /* bottom of the BIOS's data */
+    uint16_t drvtop;
+    uint8_t tpa_base;
+    uint8_t tpa_end;
+    uint8_t zp_base;
+    uint8_t zp_end;
+};
+
+static const char* bios_names[] = {
+    "BIOS_CONST",
+    "BIOS_CONIN",
+    "BIOS_CONOUT",
+    "BIOS_SELDSK",
+    "BIOS_SETSEC",
+    "BIOS_SETDMA",
+    "BIOS_READ",
+    "BIOS_WRITE",
+    "BIOS_RELOCATE",
+    "BIOS_GETTPA",
+    "BIOS_SETTPA",
+    "BIOS_GETZP",
+    "BIOS_SETZP",
+    "BIOS_SETBANK",
+    "BIOS_ADDDRV",
+    "BIOS_FINDDRV",
+};
+
+const char* diskdefs_filename = "diskdefs";
+
+const char* disk_bios_name(int bios_call)
+{
+    if (bios_call < sizeof(bios_names) / sizeof(*bios_names))
+        return bios_names[bios_call];
+    return NULL;
+}
+
+static void put_word(uint16_t address, uint16_t value)
+{
+    ctx->ram[address] = value;
+    ctx->ram[(uint16_t)(address + 1)] = value >> 8;
+}
+
+static uint16_t get_word(uint16_t address)
+{
+    return ctx->ram[address] | (ctx->ram[(uint16_t)(address + 1)] << 8);
+}
+
+/* Mounts a CP/M filesystem image on a drive; spec is IMAGE,FORMAT. The image
+ * is only opened when the machine boots. */
+
+void disk_mount(int drive, const char* spec)
+{
+    if (!ctx->disks)
+    {
+        ctx->disks = calloc(1, sizeof(struct disks));
+        if (!ctx->disks)
+            fatal("out of memory");
+    }
+
+    const char* comma = strrchr(spec, ',');
+    if ((drive < 0) || (drive >= MAX_DRIVES) || !comma || (comma == spec) ||
+        !comma[1])
+        fatal("invalid syntax in disk image assignment");
+
+    struct disk* disk = &ctx->disks->drives[drive];
+    free(disk->path);
+    free(disk->format);
+    disk->path = strndup(spec, comma - spec);
+    disk->format = strdup(comma + 1);
+}
+
+/* Looks up a disk format in the diskdefs file. Only the parameters the BIOS
+ * cares about are read; images are assumed to be unskewed, as all of ours
+ * are. */
+
+static void read_geometry(const char* format, struct geometry* g)
+{
+    FILE* fp = fopen(diskdefs_filename, "r");
+    if (!fp)
+        fatal("cannot open '%s': %s", diskdefs_filename, strerror(errno));
+
+    memset(g, 0, sizeof(*g));
+    bool found = false;
+    bool inside = false;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "#;\r\n")] = '\0';
+
+        char key[64];
+        char value[64];
+        int n = sscanf(line, "%63s %63s", key, value);
+        if (n < 1)
+            continue;
+
+        if (!inside)
+        {
+            if ((n == 2) && !strcmp(key, "diskdef") && !strcmp(value, format))
+                inside = found = true;
+            continue;
+        }
+
+        if (!strcmp(key, "end"))
+            break;
+        if (n != 2)
+            continue;
+
+        int v = strtol(value, NULL, 0);
+        if (!strcmp(key, "seclen"))
+            g->seclen = v;
+        else if (!strcmp(key, "tracks"))
+            g->tracks = v;
+        else if (!strcmp(key, "sectrk"))
+            g->sectrk = v;
+        else if (!strcmp(key, "blocksize"))
+            g->blocksize = v;
+        else if (!strcmp(key, "maxdir"))
+            g->maxdir = v;
+        else if (!strcmp(key, "boottrk"))
+            g->boottrk = v;
+    }
+    fclose(fp);
+
+    if (!found)
+        fatal("disk format '%s' not found in '%s'", format, diskdefs_filename);
+    if (!g->seclen || !g->tracks || !g->sectrk || !g->blocksize || !g->maxdir)
+        fatal("disk format '%s' is incomplete", format);
+}
+
+static uint16_t bios_alloc(int len)
+{
+    struct disks* d = ctx->disks;
+    if (d->top - len < TPA_BASE + 0x1000)
+        fatal("out of memory for BIOS structures");
+    d->top -= len;
+    memset(&ctx->ram[d->top], 0, len);
+    return d->top;
+}
+
+/* Builds the DPB and DPH for a drive, exactly as define_dpb and define_dph
+ * would, except that the number of blocks excludes the reserved tracks (which
+ * is what cpmtools assumes when it builds the image). */
+
+static uint16_t make_dph(const struct geometry* g, uint16_t dirbuf)
+{
+    int shift = 0;
+    while ((SECTOR_SIZE << shift) < g->blocksize)
+        shift++;
+    if ((g->blocksize < 1024) || (g->blocksize > 16384) ||
+        ((SECTOR_SIZE << shift) != g->blocksize))
+        fatal("invalid block size %d", g->blocksize);
+
+    int sectors = g->tracks * g->sectrk * g->seclen / SECTOR_SIZE;
+    int reserved = g->boottrk * g->sectrk * g->seclen / SECTOR_SIZE;
+    int blocks = (sectors - reserved) * SECTOR_SIZE / g->blocksize;
+    int dirblocks = g->maxdir * 32 / g->blocksize;
+    if (!dirblocks || (dirblocks > 16) || ((g->maxdir * 32) % g->blocksize))
+        fatal("directory is not a whole number of blocks");
+
+    if ((blocks >= 256) && (g->blocksize == 1024))
+        fatal("can't use a block size of 1024 on a large disk");
+    int extent_mask = (blocks < 256) ? (g->blocksize / 1024 - 1)
+                                     : (g->blocksize / 2048 - 1);
+
+    uint16_t allocation_bitmap = (0xffff << (16 - dirblocks)) & 0xffff;
+    int checksum_size = (g->maxdir + 3) / 4;
+    int allocation_size = (blocks + 7) / 8;
+
+    uint16_t dpb = bios_alloc(DPB_SIZE);
+    ctx->ram[dpb + DPB_BSH] = shift;
+    ctx->ram[dpb + DPB_BLM] = (1 << shift) - 1;
+    ctx->ram[dpb + DPB_EXM] = extent_mask;
+    put_word(dpb + DPB_DSM, blocks - 1);
+    put_word(dpb + DPB_DRM, g->maxdir - 1);
+    ctx->ram[dpb + DPB_AL + 0] = allocation_bitmap >> 8;
+    ctx->ram[dpb + DPB_AL + 1] = allocation_bitmap & 0xff;
+    put_word(dpb + DPB_CKS, checksum_size);
+    put_word(dpb + DPB_OFF, reserved);
+
+    uint16_t csv = bios_alloc(checksum_size);
+    uint16_t alv = bios_alloc(allocation_size);
+
+    uint16_t dph = bios_alloc(DPH_SIZE);
+    put_word(dph + DPH_DIRBUF, dirbuf);
+    put_word(dph + DPH_DPB, dpb);
+    put_word(dph + DPH_CSV, csv);
+    put_word(dph + DPH_ALV, alv);
+    return dph;
+}
+
+static void open_image(struct disk* disk)
+{
+    int fd = open(disk->path, O_RDWR);
+    if ((fd == -1) && ((errno == EACCES) || (errno == EROFS)))
+    {
+        fd = open(disk->path, O_RDONLY);
+        disk->readonly = true;
+    }
+    if (fd == -1)
+        fatal("cannot open disk image '%s': %s", disk->path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        fatal("cannot stat disk image '%s': %s", disk->path, strerror(errno));
+    if (!st.st_size)
+        fatal("disk image '%s' is empty", disk->path);
+
+    disk->size = st.st_size;
+    disk->data = mmap(NULL,
+        disk->size,
+        PROT_READ | (disk->readonly ? 0 : PROT_WRITE),
+        MAP_SHARED,
+        fd,
+        0);
+    if (disk->data == MAP_FAILED)
+        fatal("cannot map disk image '%s': %s", disk->path, strerror(errno));
+    close(fd);
+}
+
+/* Sets up the BIOS and starts the BDOS in the given file. */
+
+void disk_bios_boot(const char* bdos)
+{
+    struct disks* d = ctx->disks;
+    if (!d || !d->drives[0].path)
+        fatal("BIOS mode needs a disk image on drive A");
+    d->top = ctx->himem;
+
+    /* The console driver, which is the only one. */
+
+    uint16_t drv = bios_alloc(DRVSTRUCT_NAME + 4);
+    put_word(drv + DRVSTRUCT_ID, DRVID_TTY);
+    put_word(drv + DRVSTRUCT_STRAT, TTY_ADDRESS);
+    put_word(drv + DRVSTRUCT_NEXT, 0);
+    memcpy(&ctx->ram[drv + DRVSTRUCT_NAME], "TTY", 4);
+    d->drvtop = drv;
+
+    uint16_t dirbuf = bios_alloc(SECTOR_SIZE);
+    for (int i = 0; i < MAX_DRIVES; i++)
+    {
+        struct disk* disk = &d->drives[i];
+        if (!disk->path)
+            continue;
+
+        struct geometry g;
+        read_geometry(disk->format, &g);
+        disk->sectors = g.tracks * g.sectrk * g.seclen / SECTOR_SIZE;
+        disk->dph = make_dph(&g, dirbuf);
+        open_image(disk);
+    }
+
+    d->tpa_base = TPA_BASE >> 8;
+    d->tpa_end = d->top >> 8;
+    d->zp_base = ZP_BASE;
+    d->zp_end = 0xff;
+
+    /* Load and relocate the BDOS, and enter it with the BIOS address in XA. */
+
+    int fd = open(bdos, O_RDONLY);
+    if (fd == -1)
+        fatal("couldn't open BDOS: %s", strerror(errno));
+    ssize_t len = read(fd, &ctx->ram[TPA_BASE], (d->tpa_end << 8) - TPA_BASE);
+    close(fd);
+    if (len < COMHDR_ENTRY)
+        fatal("couldn't read BDOS");
+    relocate_image(d->tpa_base, d->zp_base);
+
+    M6502_reset(ctx->cpu);
+    ctx->cpu->registers->s = 0xff;
+    ctx->cpu->registers->pc = TPA_BASE + COMHDR_ENTRY;
+    set_xa(BIOS_ADDRESS);
+}
+
+/* Returns the strategy routine of the first driver with the given ID, or 0. */
+
+static uint16_t find_driver(uint16_t id)
+{
+    for (uint16_t drv = ctx->disks->drvtop; drv;
+         drv = get_word(drv + DRVSTRUCT_NEXT))
+    {
+        if (get_word(drv + DRVSTRUCT_ID) == id)
+            return get_word(drv + DRVSTRUCT_STRAT);
+    }
+    return 0;
+}
+
+void disk_tty_entry(uint8_t tty_call)
+{
+    switch (tty_call)
+    {
+        case BIOS_CONST:
+            bios_const();
+            break;
+
+        case BIOS_CONIN:
+        {
+            /* There's nothing else to run once the input runs out. */
+
+            int c = console_getc();
+            if (c == -1)
+                emulator_exit(0);
+            set_result(c, true);
+            break;
+        }
+
+        case BIOS_CONOUT:
+            console_putc(ctx->cpu->registers->a);
+            set_result(get_xa(), true);
+            break;
+
+        default:
+            set_result(0, false);
+    }
+}
+
+static bool select_disk(uint8_t drive)
+{
+    struct disks* d = ctx->disks;
+    if ((drive >= MAX_DRIVES) || !d->drives[drive].data)
+        return false;
+    d->current = &d->drives[drive];
+    set_result(d->current->dph, true);
+    return true;
+}
+
+/* Returns the current sector in the image, or NULL if it's not on the disk.
+ * Sectors beyond the end of a short image read as empty. */
+
+static uint8_t* current_sector(bool* empty)
+{
+    struct disks* d = ctx->disks;
+    struct disk* disk = d->current;
+    if (!disk || (d->sector >= disk->sectors))
+        return NULL;
+
+    size_t offset = (size_t)d->sector * SECTOR_SIZE;
+    *empty = (offset + SECTOR_SIZE > disk->size);
+    return disk->data + offset;
+}
+
+static void read_sector(void)
+{
+    struct disks* d = ctx->disks;
+    bool empty;
+    uint8_t* p = current_sector(&empty);
+    if (!p)
+    {
+        set_result(0, false);
+        return;
+    }
+
+    d->current->reads++;
+    ctx->drive_bytes_read[d->current - d->drives] += SECTOR_SIZE;
+    for (int i = 0; i < SECTOR_SIZE; i++)
+        ctx->ram[(uint16_t)(d->dma + i)] = empty ? 0xe5 : p[i];
+    set_result(0, true);
+}
+
+static void write_sector(void)
+{
+    struct disks* d = ctx->disks;
+    bool empty;
+    uint8_t* p = current_sector(&empty);
+    if (!p || empty || d->current->readonly)
+    {
+        set_result(0, false);
+        return;
+    }
+
+    d->current->writes++;
+    ctx->drive_bytes_written[d->current - d->drives] += SECTOR_SIZE;
+    for (int i = 0; i < SECTOR_SIZE; i++)
+        p[i] = ctx->ram[(uint16_t)(d->dma + i)];
+    set_result(0, true);
+}
+
+void disk_bios_entry(uint8_t bios_call)
+{
+    struct disks* d = ctx->disks;
+    M6502_Registers* r = ctx->cpu->registers;
+    uint16_t xa = get_xa();
+
+    switch (bios_call)
+    {
+        case BIOS_CONST:
+        case BIOS_CONIN:
+        case BIOS_CONOUT:
+        {
+            /* Programs may install their own TTY driver, in which case the
+             * call goes to that instead. TTY opcodes are the same as the
+             * BIOS ones. */
+
+            uint16_t strat = find_driver(DRVID_TTY);
+            if (strat && (strat != TTY_ADDRESS))
+                r->pc = strat;
+            else
+                disk_tty_entry(bios_call);
+            return;
+        }
+
+        case BIOS_SELDSK:
+            if (!select_disk(r->a))
+                set_result(0, false);
+            return;
+
+        case BIOS_SETSEC:
+            d->sector = ctx->ram[xa] | (ctx->ram[(uint16_t)(xa + 1)] << 8) |
+                        (ctx->ram[(uint16_t)(xa + 2)] << 16);
+            set_result(xa, true);
+            return;
+
+        case BIOS_SETDMA:
+            d->dma = xa;
+            set_result(xa, true);
+            return;
+
+        case BIOS_READ:
+            read_sector();
+            return;
+
+        case BIOS_WRITE:
+            write_sector();
+            return;
+
+        case BIOS_RELOCATE:
+            relocate_image(r->a, r->x);
+            set_result(xa, true);
+            return;
+
+        case BIOS_GETTPA:
+            set_result(d->tpa_base | (d->tpa_end << 8), true);
+            return;
+
+        case BIOS_SETTPA:
+            d->tpa_base = r->a;
+            d->tpa_end = r->x;
+            set_result(xa, true);
+            return;
+
+        case BIOS_GETZP:
+            set_result(d->zp_base | (d->zp_end << 8), true);
+            return;
+
+        case BIOS_SETZP:
+            d->zp_base = r->a;
+            d->zp_end = r->x;
+            set_result(xa, true);
+            return;
+
+        case BIOS_SETBANK:
+            /* There's only one bank. */
+            set_result(xa, true);
+            return;
+
+        case BIOS_ADDDRV:
+            put_word(xa + DRVSTRUCT_NEXT, d->drvtop);
+            d->drvtop = xa;
+            set_result(xa, true);
+            return;
+
+        case BIOS_FINDDRV:
+        {
+            uint16_t strat = xa ? find_driver(xa) : d->drvtop;
+            set_result(strat, !!strat);
+            return;
+        }
+    }
+
+    showregs();
+    fatal("unimplemented bios entry %d", bios_call);
+}
+
+void disks_report_stats(FILE* fp)
+{
+    if (!ctx->disks)
+        return;
+
+    fprintf(fp,
+        "%-5s %-32s %12s %12s\n",
+        "drive",
+        "image",
+        "sector reads",
+        "writes");
+    for (int i = 0; i < MAX_DRIVES; i++)
+    {
+        struct disk* disk = &ctx->disks->drives[i];
+        if (!disk->data)
+            continue;
+
+        fprintf(fp,
+            "%c:    %-32s %12llu %12llu\n",
+            'A' + i,
+            disk->path,
+            (unsigned long long)disk->reads,
+            (unsigned long long)disk->writes);
+    }
+}
@@ -8,9 +8,30 @@
 #include <readline/history.h>
 #include "globals.h"
 
-M6502* cpu;
-uint8_t ram[0x10000];
-bool breakpoints[0x10000];
+_Thread_local struct context* ctx;
+
+/* Addresses at which the batched interpreter must stop and hand control back
+ * to us. This is shared by all guests; breakpoints can only be set from the
+ * debugger, which is never used when running jobs. */
+
+#define TRAP_SYSTEM 0x01
+#define TRAP_BREAKPOINT 0x02
+static M6502_TrapTable traps = {
+    [BDOS_ADDRESS] = TRAP_SYSTEM,
+    [BIOS_ADDRESS] = TRAP_SYSTEM,
+    [EXIT_ADDRESS] = TRAP_SYSTEM,
+    [SCREEN_ADDRESS] = TRAP_SYSTEM,
+    [BRK_ADDRESS] = TRAP_SYSTEM,
+    [TTY_ADDRESS] = TRAP_SYSTEM,
+};
+
+/* Number of instructions to run in one go when not single stepping; this
+ * bounds how long it takes to notice SIGUSR1. */
+
+#define RUN_BUDGET 100000
+
+/* Watchpoints are implemented as lib6502 write callbacks, so only stores to
+ * a watched address cost anything. */
 
 struct watchpoint
 {
@@ -21,42 +42,43 @@ struct watchpoint
 
 static struct watchpoint watchpoints[16];
 bool tracing = false;
-bool singlestepping = true;
+bool block_cache = false;
+bool jit = false;
 static bool bdosbreak = false;
 static bool bdoslog = false;
 
 uint16_t get_xa(void)
 {
-    return (cpu->registers->x << 8) | cpu->registers->a;
+    return (ctx->cpu->registers->x << 8) | ctx->cpu->registers->a;
 }
 
 void set_xa(uint16_t xa)
 {
-    cpu->registers->x = xa >> 8;
-    cpu->registers->a = xa;
+    ctx->cpu->registers->x = xa >> 8;
+    ctx->cpu->registers->a = xa;
 }
 
 void set_result(uint16_t xa, bool succeeded)
 {
     set_xa(xa);
     if (succeeded)
-        cpu->registers->p &= ~0x01;
+        ctx->cpu->registers->p &= ~0x01;
     else
-        cpu->registers->p |= 0x01;
+        ctx->cpu->registers->p |= 0x01;
 }
 
 void showregs(void)
 {
     char buffer[64];
-    M6502_dump(cpu, buffer);
+    M6502_dump(ctx->cpu, buffer);
     printf("%s\n", buffer);
 
-    int bytes = M6502_disassemble(cpu, cpu->registers->pc, buffer);
-    printf("%04x : ", cpu->registers->pc);
+    int bytes = M6502_disassemble(ctx->cpu, ctx->cpu->registers->pc, buffer);
+    printf("%04x : ", ctx->cpu->registers->pc);
 	for (int i=0; i<3; i++)
 	{
 		if (i < bytes)
-			printf("%02x ", ram[cpu->registers->pc + i]);
+			printf("%02x ", ctx->ram[ctx->cpu->registers->pc + i]);
 		else
 			printf("   ");
 	}
@@ -73,17 +95,17 @@ static void cmd_register(void)
         uint16_t value = strtoul(w2, NULL, 16);
 
         if (strcmp(w1, "sp") == 0)
-            cpu->registers->s = value;
+            ctx->cpu->registers->s = value;
         else if (strcmp(w1, "pc") == 0)
-            cpu->registers->pc = value;
+            ctx->cpu->registers->pc = value;
         else if (strcmp(w1, "p") == 0)
-            cpu->registers->p = value;
+            ctx->cpu->registers->p = value;
         else if (strcmp(w1, "a") == 0)
-            cpu->registers->a = value;
+            ctx->cpu->registers->a = value;
         else if (strcmp(w1, "x") == 0)
-            cpu->registers->x = value;
+            ctx->cpu->registers->x = value;
         else if (strcmp(w1, "y") == 0)
-            cpu->registers->y = value;
+            ctx->cpu->registers->y = value;
         else
         {
             printf("Bad register\n");
@@ -94,25 +116,19 @@ static void cmd_register(void)
     showregs();
 }
 
-static int break_cb(M6502* cpu, uint16_t address, uint8_t data)
-{
-    singlestepping = true;
-    return address;
-}
-
 static void cmd_break(void)
 {
     char* w1 = strtok(NULL, " ");
     if (w1)
     {
         uint16_t breakpc = strtoul(w1, NULL, 16);
-        breakpoints[breakpc] = true;
+        traps[breakpc] |= TRAP_BREAKPOINT;
     }
     else
     {
         for (int i = 0; i < 0x10000; i++)
         {
-            if (breakpoints[i])
+            if (traps[i] & TRAP_BREAKPOINT)
                 printf("%04x\n", i);
         }
     }
@@ -124,8 +140,46 @@ static void cmd_delete_breakpoint(void)
     if (w1)
     {
         uint16_t breakpc = strtoul(w1, NULL, 16);
-        breakpoints[breakpc] = false;
+        traps[breakpc] &= ~TRAP_BREAKPOINT;
+    }
+}
+
+static bool check_watchpoint(struct watchpoint* w)
+{
+    if (w->enabled && (ctx->ram[w->address] != w->value))
+    {
+        printf("\nWatchpoint hit: %04x has changed from %02x to %02x\n",
+            w->address,
+            w->value,
+            ctx->ram[w->address]);
+        w->value = ctx->ram[w->address];
+        return true;
+    }
+    return false;
+}
+
+static int watch_cb(M6502* mpu, uint16_t address, uint8_t data)
+{
+    ctx->ram[address] = data;
+    for (int i = 0; i < sizeof(watchpoints) / sizeof(*watchpoints); i++)
+    {
+        struct watchpoint* w = &watchpoints[i];
+        if ((w->address == address) && check_watchpoint(w))
+        {
+            ctx->singlestepping = true;
+            M6502_stop(mpu);
+        }
     }
+    return data;
+}
+
+/* Catches changes made behind the interpreter's back, i.e. by the BDOS or
+ * by stack pushes, which don't go through the write callbacks. */
+
+static void check_all_watchpoints(void)
+{
+    for (int i = 0; i < sizeof(watchpoints) / sizeof(*watchpoints); i++)
+        ctx->singlestepping |= check_watchpoint(&watchpoints[i]);
 }
 
 static void cmd_watch(void)
@@ -141,7 +195,8 @@ static void cmd_watch(void)
             {
                 w->address = watchaddr;
                 w->enabled = true;
-                w->value = ram[watchaddr];
+                w->value = ctx->ram[watchaddr];
+                M6502_setCallback(ctx->cpu, write, watchaddr, watch_cb);
                 return;
             }
         }
@@ -164,16 +219,27 @@ static void cmd_delete_watchpoint(void)
     if (w1)
     {
         uint16_t address = strtoul(w1, NULL, 16);
-        for (int i = 0; i < sizeof(breakpoints) / sizeof(*breakpoints); i++)
+        for (int i = 0; i < sizeof(watchpoints) / sizeof(*watchpoints); i++)
         {
             struct watchpoint* w = &watchpoints[i];
             if (w->enabled && (w->address == address))
             {
                 w->enabled = false;
-                return;
+                break;
             }
         }
-        printf("No such watchpoint\n");
+
+        for (int i = 0; i < sizeof(watchpoints) / sizeof(*watchpoints); i++)
+        {
+            struct watchpoint* w = &watchpoints[i];
+            if (w->enabled && (w->address == address))
+                return;
+        }
+
+        if (M6502_getCallback(ctx->cpu, write, address) == watch_cb)
+            M6502_setCallback(ctx->cpu, write, address, NULL);
+        else
+            printf("No such watchpoint\n");
     }
 }
 
@@ -201,7 +267,7 @@ static void cmd_memory(void)
             {
                 uint16_t pp = p + i;
                 if ((pp >= startaddr) && (pp < endaddr))
-                    printf("%02x ", ram[pp]);
+                    printf("%02x ", ctx->ram[pp]);
                 else
                     printf("   ");
             }
@@ -211,7 +277,7 @@ static void cmd_memory(void)
                 uint16_t pp = p + i;
                 if ((pp >= startaddr) && (pp < endaddr))
                 {
-                    uint8_t c = ram[pp];
+                    uint8_t c = ctx->ram[pp];
                     if ((c < 32) || (c > 127))
                         c = '.';
                     putchar(c);
@@ -241,12 +307,12 @@ static void cmd_unassemble(void)
         while (addr < endaddr)
         {
             char buffer[64];
-            int len = M6502_disassemble(cpu, addr, buffer);
+            int len = M6502_disassemble(ctx->cpu, addr, buffer);
             printf("%04x : ", addr);
 			for (int i=0; i<3; i++)
 			{
 				if (i < len)
-					printf("%02x ", ram[addr + i]);
+					printf("%02x ", ctx->ram[addr + i]);
 				else
 					printf("   ");
 			}
@@ -279,6 +345,15 @@ static void cmd_tracing(void)
         printf("tracing: %s\n", tracing ? "on" : "off");
 }
 
+static void cmd_snapshot(void)
+{
+    char* w1 = strtok(NULL, " ");
+    if (w1)
+        snapshot_save(w1);
+    else
+        printf("usage: snapshot <file>\n");
+}
+
 static void cmd_help(void)
 {
     printf(
@@ -295,18 +370,23 @@ static void cmd_help(void)
         "  s               single step\n"
         "  g               continue\n"
         "  bdos 0|1|L      enable break/log on bdos entry\n"
-        "  trace 0|1       enable tracing\n");
+        "  trace 0|1       enable tracing\n"
+        "  snapshot <file> save a snapshot of the machine\n");
 }
 
 static void debug(void)
 {
+    if (ctx->exit_jmp)
+        fatal("program stopped at %04x", ctx->cpu->registers->pc);
+
     bool go = false;
+    console_flush();
     showregs();
     while (!go)
     {
         char* cmdline = readline("debug>");
         if (!cmdline)
-            exit(0);
+            emulator_exit(0);
 
         char* token = strtok(cmdline, " ");
         if (token != NULL)
@@ -329,18 +409,20 @@ static void debug(void)
                 cmd_unassemble();
             else if (strcmp(token, "s") == 0)
             {
-                singlestepping = true;
+                ctx->singlestepping = true;
                 go = true;
             }
             else if (strcmp(token, "g") == 0)
             {
-                singlestepping = false;
+                ctx->singlestepping = false;
                 go = true;
             }
             else if (strcmp(token, "bdos") == 0)
                 cmd_bdos();
             else if (strcmp(token, "trace") == 0)
                 cmd_tracing();
+            else if (strcmp(token, "snapshot") == 0)
+                cmd_snapshot();
             else
                 printf("Bad command\n");
         }
@@ -352,52 +434,126 @@ static void debug(void)
 static int rts(void)
 {
     uint16_t pc;
-    pc = (uint16_t)ram[++cpu->registers->s + 0x100];
-    pc |= (uint16_t)ram[++cpu->registers->s + 0x100] << 8;
-    cpu->registers->pc = pc + 1;
+    pc = (uint16_t)ctx->ram[++ctx->cpu->registers->s + 0x100];
+    pc |= (uint16_t)ctx->ram[++ctx->cpu->registers->s + 0x100] << 8;
+    ctx->cpu->registers->pc = pc + 1;
 }
 
 static void sigusr1_cb(int number)
 {
-    singlestepping = true;
+    if (ctx)
+        ctx->singlestepping = true;
+}
+
+struct context* context_new(void)
+{
+    struct context* c = calloc(1, sizeof(struct context));
+    if (!c)
+        fatal("out of memory");
+
+    c->cpu = M6502_new(NULL, c->ram, NULL);
+    M6502_setBlockCache(c->cpu, block_cache);
+    if (jit && !M6502_setJit(c->cpu, true))
+        fatal("the JIT is not available on this host");
+    c->himem = BDOS_ADDRESS;
+    c->console_in = 0;
+    c->console_out = 1;
+    return c;
+}
+
+void context_free(struct context* c)
+{
+    M6502_delete(c->cpu);
+    free(c);
+}
+
+/* Ends the guest program. Jobs return to run_jobs(); otherwise the whole
+ * process exits. */
+
+void emulator_exit(int code)
+{
+    console_flush();
+    if (ctx->exit_jmp)
+    {
+        ctx->exitcode = code;
+        longjmp(*ctx->exit_jmp, 1);
+    }
+    if (ctx->files)
+        files_flush();
+    exit(code);
 }
 
 void emulator_init(void)
 {
-	memset(ram, 0xee, sizeof(ram));
+	memset(ctx->ram, 0xee, sizeof(ctx->ram));
+
+    ctx->singlestepping = flag_enter_debugger;
+    ctx->start_ns = now_ns();
+
+    /* BRK vectors to a trap address so that the batched interpreter stops on
+     * it; see brk_trap(). */
 
-    cpu = M6502_new(NULL, ram, NULL);
-    singlestepping = flag_enter_debugger;
+    ctx->ram[M6502_IRQVectorLSB] = BRK_ADDRESS & 0xff;
+    ctx->ram[M6502_IRQVectorMSB] = BRK_ADDRESS >> 8;
+}
 
+void emulator_init_debugger(void)
+{
     struct sigaction action = {.sa_handler = sigusr1_cb};
     sigaction(SIGUSR1, &action, NULL);
 }
 
+/* A BRK was executed by the batched interpreter. Undo the stack frame it
+ * pushed and rewind to the BRK itself, so that it's handled exactly as the
+ * single stepper would have. */
+
+static void brk_trap(void)
+{
+    uint8_t s = ctx->cpu->registers->s;
+    uint16_t pc = ctx->ram[0x100 + (uint8_t)(s + 2)];
+    pc |= ctx->ram[0x100 + (uint8_t)(s + 3)] << 8;
+
+    /* BRK pushes P with the B and unused bits set; drop them again. */
+    ctx->cpu->registers->p = ctx->ram[0x100 + (uint8_t)(s + 1)] & ~0x30;
+    ctx->cpu->registers->s = s + 3;
+    ctx->cpu->registers->pc = pc - 2;
+    ctx->singlestepping = true;
+}
+
 void emulator_run(void)
 {
     for (;;)
     {
-        uint16_t pc = cpu->registers->pc;
-        singlestepping |= breakpoints[pc];
-
-        if ((pc < BDOS_ADDRESS) && (ram[pc] == 0))
-            singlestepping = true;
-
-        for (int i = 0; i < sizeof(watchpoints) / sizeof(*watchpoints); i++)
+        if (!ctx->singlestepping && !tracing && !profiling && !binary_tracing)
         {
-            struct watchpoint* w = &watchpoints[i];
-            if (w->enabled && (ram[w->address] != w->value))
+            unsigned long budget = RUN_BUDGET;
+            int reason = M6502_runUntil(ctx->cpu, traps, &budget);
+            ctx->instructions += RUN_BUDGET - budget;
+            switch (reason)
             {
-                printf("\nWatchpoint hit: %04x has changed from %02x to %02x\n",
-                    w->address,
-                    w->value,
-                    ram[w->address]);
-                w->value = ram[w->address];
-                singlestepping = true;
+                case M6502_BudgetExhausted:
+                    continue;
+
+                case M6502_Stopped:
+                    /* A watchpoint fired. */
+                    break;
+
+                case M6502_Trapped:
+                    if (ctx->cpu->registers->pc == BRK_ADDRESS)
+                        brk_trap();
+                    break;
             }
+
+            /* Fall through to handle the trap. */
         }
 
-        if (singlestepping)
+        uint16_t pc = ctx->cpu->registers->pc;
+        ctx->singlestepping |= !!(traps[pc] & TRAP_BREAKPOINT);
+
+        if ((pc < BDOS_ADDRESS) && (ctx->ram[pc] == 0))
+            ctx->singlestepping = true;
+
+        if (ctx->singlestepping)
             debug();
         else if (tracing)
             showregs();
@@ -406,32 +562,66 @@ void emulator_run(void)
         {
             case BDOS_ADDRESS:
                 if (bdosbreak)
-                    singlestepping = true;
-                bdos_entry(cpu->registers->y, bdoslog);
+                    ctx->singlestepping = true;
+                bdos_entry(ctx->cpu->registers->y, bdoslog);
+                check_all_watchpoints();
                 rts();
                 continue;
 
             case BIOS_ADDRESS:
+            {
                 if (bdosbreak)
-                    singlestepping = true;
-                bios_entry(cpu->registers->y);
+                    ctx->singlestepping = true;
+                uint8_t call = ctx->cpu->registers->y;
+                uint64_t start = now_ns();
+                if (ctx->disks)
+                    disk_bios_entry(call);
+                else
+                    bios_entry(call);
+                ctx->bios_calls[call]++;
+                ctx->bios_ns[call] += now_ns() - start;
+                check_all_watchpoints();
+
+                /* The call may have been handed on to guest code, which
+                 * returns to the caller itself. */
+                if (ctx->cpu->registers->pc == BIOS_ADDRESS)
+                    rts();
+                continue;
+            }
+
+            case TTY_ADDRESS:
+                disk_tty_entry(ctx->cpu->registers->y);
+                check_all_watchpoints();
                 rts();
                 continue;
 
             case SCREEN_ADDRESS:
                 if (bdosbreak)
-                    singlestepping = true;
-                screen_entry(cpu->registers->y);
+                    ctx->singlestepping = true;
+                screen_entry(ctx->cpu->registers->y);
+                check_all_watchpoints();
                 rts();
                 continue;
 
             case EXIT_ADDRESS:
-                exit(0);
+                emulator_exit(0);
+
+            case BRK_ADDRESS:
+                brk_trap();
+                continue;
         }
 
-        if (ram[pc] == 0)
-            cpu->registers->pc++;
+        if (profiling)
+            profile_instruction();
+        if (binary_tracing)
+            trace_instruction();
+
+        if (ctx->ram[pc] == 0)
+            ctx->cpu->registers->pc++;
         else
-            M6502_run(cpu);
+        {
+            M6502_run(ctx->cpu);
+            ctx->instructions++;
+        }
     }
 }
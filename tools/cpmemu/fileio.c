@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
@@ -15,101 +16,189 @@
 
 struct file
 {
-    struct file* prev;
+    struct file* prev; /* LRU list, most recently used first */
     struct file* next;
+    struct file* hnext; /* hash chain */
     cpm_filename_t filename;
     int fd;
     int flags;
+
+    /* Block cache: one extent of the file, or the whole file mapped if it is
+     * on a read-only drive. Writes accumulate in the extent and are only
+     * written back when another extent is needed, or on close, rename,
+     * delete or exit. */
+    uint8_t* cache;
+    off_t cache_start; /* -1 if nothing is cached */
+    size_t cache_len;
+    size_t dirty_lo;
+    size_t dirty_hi;
+    bool mapped;
+
+    /* The file's logical size including unflushed writes; only fetched from
+     * the kernel the first time it's needed. */
+    off_t size;
+    bool size_known;
 };
 
-#define NUM_FILES 16
-static struct file files[NUM_FILES];
-static struct file* firstfile;
+/* A snapshot of the CP/M-visible files in a drive's directory, so that
+ * searches and wildcard deletes don't go to the host filesystem for every
+ * entry. Snapshots are dropped when the guest creates, deletes or renames a
+ * file and are also checked against the directory's mtime; they're
+ * refcounted so that a search in progress keeps its snapshot. */
 
+struct dirindex_entry
+{
+    cpm_filename_t filename; /* drive is not set */
+    char unixfilename[13];
+};
+
+struct dirindex
+{
+    int refs;
+    struct timespec mtime;
+    int count;
+    struct dirindex_entry entries[];
+};
+
+#define NUM_BUCKETS 256
 #define NUM_DRIVES 16
-static int drives[NUM_DRIVES];
+#define EXTENT_SIZE 0x10000
 
-static cpm_filename_t currentpattern;
-static int currentsearchdrivefd;
-static DIR* currentdir;
+/* Limits on the open file table and on the host file descriptors it may
+ * hold open; entries beyond the first limit are recycled, and descriptors
+ * beyond the second are closed and transparently reopened when needed. */
 
-void files_init(void)
-{
-    for (int i = 0; i < NUM_DRIVES; i++)
-        drives[i] = -1;
-    file_set_drive(0, ".");
+int max_open_files = 64;
+int max_open_fds = 32;
 
-    for (int i = 0; i < NUM_FILES; i++)
-    {
-        struct file* f = &files[i];
-        if (i == 0)
-            f->prev = NULL;
-        else
-            f->prev = &files[i - 1];
+/* Per-guest file state, hung off the context. Open files are hashed on drive
+ * and name. */
 
-        if (i == (NUM_FILES - 1))
-            f->next = NULL;
-        else
-            f->next = &files[i + 1];
+struct files
+{
+    struct file* buckets[NUM_BUCKETS];
+    struct file* firstfile;
+    struct file* lastfile;
+    int num_files;
+    int num_fds;
+    uint64_t file_evictions;
+    uint64_t fd_evictions;
+
+    int drives[NUM_DRIVES];
+    bool readonly[NUM_DRIVES];
+
+    struct dirindex* dirs[NUM_DRIVES];
+
+    cpm_filename_t currentpattern;
+    struct dirindex* currentsearch;
+    int currentsearchpos;
+};
 
-        memset(&f->filename.bytes, ' ', 11);
-        f->filename.drive = 0;
-        f->fd = -1;
-        f->flags = 0;
+static void release_dirindex(struct dirindex* di)
+{
+    if (di && !--di->refs)
+        free(di);
+}
+
+static void invalidate_dirindex(int drive)
+{
+    struct files* fs = ctx->files;
+    drive--;
+    if ((drive >= 0) && (drive < NUM_DRIVES))
+    {
+        release_dirindex(fs->dirs[drive]);
+        fs->dirs[drive] = NULL;
     }
+}
 
-    firstfile = &files[0];
+void files_init(void)
+{
+    struct files* fs = calloc(1, sizeof(struct files));
+    if (!fs)
+        fatal("out of memory");
+    ctx->files = fs;
+
+    for (int i = 0; i < NUM_DRIVES; i++)
+        fs->drives[i] = -1;
+    file_set_drive(0, ".", false);
 }
 
-void file_set_drive(int drive, const char* path)
+void file_set_drive(int drive, const char* path, bool readonly)
 {
+    struct files* fs = ctx->files;
     if ((drive < 0) || (drive >= NUM_DRIVES))
         fatal("bad drive letter");
 
-    if (drives[drive] != -1)
-        close(drives[drive]);
-    drives[drive] = open(path, O_RDONLY);
-    if (drives[drive] == -1)
+    if (fs->drives[drive] != -1)
+        SYSCALL(close(fs->drives[drive]));
+    invalidate_dirindex(drive + 1);
+    fs->drives[drive] = SYSCALL(open(path, O_RDONLY));
+    if (fs->drives[drive] == -1)
         fatal("could not open '%s': %s", path, strerror(errno));
 
     struct stat st;
-    fstat(drives[drive], &st);
+    SYSCALL(fstat(fs->drives[drive], &st));
     if (!S_ISDIR(st.st_mode))
         fatal("could not open '%s': not a directory", path);
+    fs->readonly[drive] = readonly;
     logf("[drive %c now pointing at %s (fd %d)]\n",
         drive + 'A',
         path,
-        drives[drive]);
+        fs->drives[drive]);
 }
 
-static void bump(struct file* f)
+static void unlink_lru(struct file* f)
+{
+    struct files* fs = ctx->files;
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        fs->firstfile = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        fs->lastfile = f->prev;
+    f->prev = f->next = NULL;
+}
+
+static void push_lru(struct file* f)
 {
-    // logf("[bumping file %d to front]\n", f-files);
+    struct files* fs = ctx->files;
+    f->prev = NULL;
+    f->next = fs->firstfile;
+    if (fs->firstfile)
+        fs->firstfile->prev = f;
+    else
+        fs->lastfile = f;
+    fs->firstfile = f;
+}
 
-    if (f != firstfile)
+static void bump(struct file* f)
+{
+    if (f != ctx->files->firstfile)
     {
-        /* Remove from list. */
-        if (f->prev)
-            f->prev->next = f->next;
-        if (f->next)
-            f->next->prev = f->prev;
-
-        /* Reinsert at head of list. */
-        firstfile->prev = f;
-        f->prev = NULL;
-        f->next = firstfile;
-        firstfile = f;
+        unlink_lru(f);
+        push_lru(f);
     }
+}
 
-    // logf("[first file is %d]\n", firstfile-files);
-    // for (int i=0; i<NUM_FILES; i++)
-    // {
-    // 	f = &files[i];
-    // 	logf("[file %02d: %c:%.11s, fd=%d, prev=%d next=%d]\n",
-    // 		i, 'A'-1+f->filename.drive, f->filename.bytes, f->fd,
-    // 		f->prev ? (f->prev - files) : -1,
-    // 		f->next ? (f->next - files) : -1);
-    // }
+static struct file** hash_bucket(cpm_filename_t* filename)
+{
+    /* FNV-1a over the drive and name. */
+
+    const uint8_t* p = (const uint8_t*)filename;
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < sizeof(cpm_filename_t); i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return &ctx->files->buckets[hash % NUM_BUCKETS];
+}
+
+static void unhash(struct file* f)
+{
+    struct file** p = hash_bucket(&f->filename);
+    while (*p != f)
+        p = &(*p)->hnext;
+    *p = f->hnext;
 }
 
 static void cpm_filename_to_unix(
@@ -188,13 +277,14 @@ static bool match_filenames(cpm_filename_t* pattern, cpm_filename_t* filename)
 
 static int get_drive_fd(cpm_filename_t* filename)
 {
+    struct files* fs = ctx->files;
     int drive = filename->drive - 1;
     if ((drive < 0) || (drive >= NUM_DRIVES))
     {
         logf("[reference to bad drive %c]\n", drive + 'A');
         return -1;
     }
-    int drivefd = drives[drive];
+    int drivefd = fs->drives[drive];
     if (drivefd == -1)
     {
         logf("[reference to undefined drive %c]\n", drive + 'A');
@@ -204,6 +294,145 @@ static int get_drive_fd(cpm_filename_t* filename)
     return drivefd;
 }
 
+static bool is_readonly(cpm_filename_t* filename)
+{
+    int drive = filename->drive - 1;
+    return (drive >= 0) && (drive < NUM_DRIVES) &&
+           ctx->files->readonly[drive];
+}
+
+static int flush(struct file* f)
+{
+    int result = 0;
+    if (f->dirty_hi > f->dirty_lo)
+    {
+        logf("[flushing %zu bytes of '%.11s']\n",
+            f->dirty_hi - f->dirty_lo,
+            f->filename.bytes);
+        if (SYSCALL(pwrite(f->fd,
+                f->cache + f->dirty_lo,
+                f->dirty_hi - f->dirty_lo,
+                f->cache_start + f->dirty_lo)) == -1)
+            result = -1;
+    }
+    f->dirty_lo = f->dirty_hi = 0;
+    return result;
+}
+
+static void drop_cache(struct file* f)
+{
+    flush(f);
+    if (f->mapped)
+    {
+        if (f->cache_len)
+            SYSCALL(munmap(f->cache, f->cache_len));
+    }
+    else
+        free(f->cache);
+    f->cache = NULL;
+    f->cache_start = -1;
+    f->cache_len = 0;
+    f->mapped = false;
+}
+
+/* Gives up a file's descriptor, keeping its cache and size. */
+
+static void release_fd(struct file* f)
+{
+    flush(f);
+    if (f->fd != -1)
+    {
+        logf("[closing file descriptor %d]\n", f->fd);
+        SYSCALL(close(f->fd));
+        ctx->files->num_fds--;
+    }
+    f->fd = -1;
+    f->flags = 0;
+}
+
+/* Closes a file's descriptor, writing back anything still cached. */
+
+static void close_file(struct file* f)
+{
+    drop_cache(f);
+    release_fd(f);
+    f->size_known = false;
+}
+
+/* Makes room in the descriptor pool by closing the least recently used
+ * descriptor other than f's. */
+
+static void evict_fd(struct file* f)
+{
+    struct files* fs = ctx->files;
+    for (struct file* victim = fs->lastfile; victim; victim = victim->prev)
+    {
+        if ((victim != f) && (victim->fd != -1))
+        {
+            logf("[evicting descriptor of '%.11s']\n", victim->filename.bytes);
+            release_fd(victim);
+            fs->fd_evictions++;
+            return;
+        }
+    }
+}
+
+/* Files on read-only drives can't change under us, so are mapped whole. */
+
+static void map_file(struct file* f)
+{
+    struct stat st;
+    if (SYSCALL(fstat(f->fd, &st)) == -1)
+        return;
+
+    f->cache = NULL;
+    if (st.st_size)
+    {
+        void* p =
+            SYSCALL(mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0));
+        if (p == MAP_FAILED)
+            return;
+        f->cache = p;
+    }
+    f->mapped = true;
+    f->cache_start = 0;
+    f->cache_len = st.st_size;
+    f->size = st.st_size;
+    f->size_known = true;
+}
+
+static bool in_extent(struct file* f, off_t offset)
+{
+    return (f->cache_start != -1) && (offset >= f->cache_start) &&
+           (offset < f->cache_start + EXTENT_SIZE);
+}
+
+/* Reads the extent containing offset, which also serves as read-ahead for
+ * sequential access. */
+
+static int load_extent(struct file* f, off_t offset)
+{
+    if (flush(f) == -1)
+        return -1;
+    if (!f->cache)
+    {
+        f->cache = malloc(EXTENT_SIZE);
+        if (!f->cache)
+            fatal("out of memory");
+    }
+
+    f->cache_start = offset & ~(off_t)(EXTENT_SIZE - 1);
+    ssize_t len =
+        SYSCALL(pread(f->fd, f->cache, EXTENT_SIZE, f->cache_start));
+    if (len == -1)
+    {
+        f->cache_start = -1;
+        return -1;
+    }
+    f->cache_len = len;
+    return 0;
+}
+
 static void reopen(struct file* f, int flags)
 {
     if ((f->fd == -1) || ((f->flags == O_RDONLY) && (flags == O_RDWR)))
@@ -216,67 +445,115 @@ static void reopen(struct file* f, int flags)
             logf("[reopening actual file '%s' on %d with different flags]\n",
                 unixfilename,
                 f->fd);
-            close(f->fd);
+            SYSCALL(close(f->fd));
+            f->fd = -1;
+            ctx->files->num_fds--;
         }
 
         int drivefd = get_drive_fd(&f->filename);
         if (drivefd == -1)
             return;
+        if (ctx->files->num_fds >= max_open_fds)
+            evict_fd(f);
 
         f->flags = flags & O_ACCMODE;
         errno = 0;
-        f->fd = openat(drivefd, unixfilename, flags, 0666);
+        f->fd = SYSCALL(openat(drivefd, unixfilename, flags, 0666));
         logf("[opened actual file '%s' to fd %d: %s]\n",
             unixfilename,
             f->fd,
             strerror(errno));
+        if (f->fd != -1)
+            ctx->files->num_fds++;
+
+        if ((f->fd != -1) && !f->cache && is_readonly(&f->filename))
+            map_file(f);
     }
 }
 
-static struct file* find_file(cpm_filename_t* filename)
+static struct file* lookup_file(cpm_filename_t* filename)
 {
-    struct file* f = firstfile;
-    for (;;)
+    for (struct file* f = *hash_bucket(filename); f; f = f->hnext)
     {
         if (memcmp(filename, &f->filename, sizeof(cpm_filename_t)) == 0)
-            break;
+            return f;
+    }
+    return NULL;
+}
 
-        if (f->next)
-            f = f->next;
-        else
-        {
-            logf("[allocating file %d for '%.11s']\n",
-                f - files,
-                filename->bytes);
-            bump(f);
-            if (f->fd != -1)
-            {
-                logf("[closing old file %d for '%.11s']\n",
-                    f - files,
-                    f->filename.bytes);
-                close(f->fd);
-            }
-            f->fd = -1;
-            f->filename = *filename;
-            f->flags = 0;
-            break;
-        }
+static void free_file(struct file* f)
+{
+    close_file(f);
+    unhash(f);
+    unlink_lru(f);
+    ctx->files->num_files--;
+    free(f);
+}
+
+/* Drops any table entry for a file which is about to be deleted or renamed,
+ * so that its cached extent and size don't outlive it. */
+
+static void forget_file(cpm_filename_t* filename)
+{
+    struct file* f = lookup_file(filename);
+    if (f)
+    {
+        logf("[forgetting '%.11s']\n", f->filename.bytes);
+        free_file(f);
+    }
+}
+
+static struct file* find_file(cpm_filename_t* filename)
+{
+    struct files* fs = ctx->files;
+    struct file* f = lookup_file(filename);
+    if (f)
+    {
+        bump(f);
+        return f;
     }
+
+    if (fs->num_files >= max_open_files)
+    {
+        logf("[evicting '%.11s']\n", fs->lastfile->filename.bytes);
+        free_file(fs->lastfile);
+        fs->file_evictions++;
+    }
+
+    logf("[allocating file for '%.11s']\n", filename->bytes);
+    f = calloc(1, sizeof(struct file));
+    if (!f)
+        fatal("out of memory");
+    f->filename = *filename;
+    f->fd = -1;
+    f->cache_start = -1;
+
+    struct file** bucket = hash_bucket(filename);
+    f->hnext = *bucket;
+    *bucket = f;
+    push_lru(f);
+    fs->num_files++;
     return f;
 }
 
+/* The descriptor isn't opened until something needs it: everything which
+ * does reopens it, and once the size is known, file_getrecordcount()
+ * doesn't. */
+
 struct file* file_open(cpm_filename_t* filename)
 {
-    struct file* f = find_file(filename);
-    reopen(f, O_RDONLY);
-    return f;
+    return find_file(filename);
 }
 
 struct file* file_create(cpm_filename_t* filename)
 {
+    if (is_readonly(filename))
+        return NULL;
+
     struct file* f = find_file(filename);
-    logf("[creating file %d for '%.11s']\n", f - files, f->filename.bytes);
+    logf("[creating file for '%.11s']\n", f->filename.bytes);
     reopen(f, O_RDWR | O_CREAT);
+    invalidate_dirindex(filename->drive);
     if (f->fd == -1)
         return NULL;
     return f;
@@ -284,21 +561,13 @@ struct file* file_create(cpm_filename_t* filename)
 
 int file_close(cpm_filename_t* filename)
 {
-    struct file* f = find_file(filename);
-
-    logf("[explicitly closing file %d for '%.11s']\n",
-        f - files,
-        f->filename.bytes);
-    if (f->fd != -1)
+    struct file* f = lookup_file(filename);
+    if (f)
     {
-        logf("[closing file descriptor %d]\n", f->fd);
-        close(f->fd);
+        logf("[explicitly closing file for '%.11s']\n", f->filename.bytes);
+        free_file(f);
     }
 
-    memset(&f->filename.bytes, ' ', 11);
-    f->fd = -1;
-    f->flags = 0;
-
     return 0;
 }
 
@@ -306,103 +575,251 @@ int file_read(struct file* f, uint8_t* data, uint16_t record)
 {
     reopen(f, O_RDONLY);
 
-    logf("[read record %04x from file %d for '%.11s']\n",
-        record,
-        f - files,
-        f->filename.bytes);
+    logf("[read record %04x from file '%.11s']\n", record, f->filename.bytes);
     bump(f);
     memset(data, '\0', 128);
-    return pread(f->fd, data, 128, record * 128);
+    if (f->fd == -1)
+        return -1;
+
+    off_t offset = record * 128;
+    if (!f->mapped && !in_extent(f, offset) && (load_extent(f, offset) == -1))
+        return -1;
+
+    size_t pos = offset - f->cache_start;
+    if (pos >= f->cache_len)
+        return 0;
+    size_t len = f->cache_len - pos;
+    if (len > 128)
+        len = 128;
+    memcpy(data, f->cache + pos, len);
+    ctx->drive_bytes_read[f->filename.drive - 1] += len;
+    return len;
 }
 
 int file_write(struct file* f, uint8_t* data, uint16_t record)
 {
+    if (is_readonly(&f->filename))
+        return -1;
     reopen(f, O_RDWR);
 
-    logf("[write record %04x from file %d for '%.11s']\n",
-        record,
-        f - files,
-        f->filename.bytes);
+    logf("[write record %04x to file '%.11s']\n", record, f->filename.bytes);
     bump(f);
-    return pwrite(f->fd, data, 128, record * 128);
+    if (f->fd == -1)
+        return -1;
+
+    off_t offset = record * 128;
+    if (!in_extent(f, offset) && (load_extent(f, offset) == -1))
+        return -1;
+
+    size_t pos = offset - f->cache_start;
+    if (pos > f->cache_len)
+        memset(f->cache + f->cache_len, 0, pos - f->cache_len);
+    memcpy(f->cache + pos, data, 128);
+    if (pos + 128 > f->cache_len)
+        f->cache_len = pos + 128;
+    if (f->size_known && (offset + 128 > f->size))
+        f->size = offset + 128;
+
+    if (f->dirty_hi == f->dirty_lo)
+    {
+        f->dirty_lo = pos;
+        f->dirty_hi = pos + 128;
+    }
+    else
+    {
+        if (pos < f->dirty_lo)
+            f->dirty_lo = pos;
+        if (pos + 128 > f->dirty_hi)
+            f->dirty_hi = pos + 128;
+    }
+    ctx->drive_bytes_written[f->filename.drive - 1] += 128;
+    return 128;
 }
 
+/* The size is only fetched from the kernel once, so the descriptor (which
+ * may have been evicted) is only needed the first time. */
+
 int file_getrecordcount(struct file* f)
 {
-    reopen(f, O_RDONLY);
+    if (f->size_known)
+        return (f->size + 127) >> 7;
 
+    reopen(f, O_RDONLY);
     struct stat st;
-    fstat(f->fd, &st);
-    return (st.st_size + 127) >> 7;
+    if (SYSCALL(fstat(f->fd, &st)) == -1)
+        return 0;
+    f->size = st.st_size;
+    if ((f->dirty_hi > f->dirty_lo) &&
+        (f->cache_start + f->dirty_hi > f->size))
+        f->size = f->cache_start + f->dirty_hi;
+    f->size_known = true;
+    return (f->size + 127) >> 7;
 }
 
 void file_setrecordcount(struct file* f, int count)
 {
-    reopen(f, O_RDONLY);
+    if (is_readonly(&f->filename))
+        return;
 
     if (count != file_getrecordcount(f))
     {
-        logf("[truncating file %d to %d records]\n", f - files, count);
+        logf("[truncating '%.11s' to %d records]\n", f->filename.bytes, count);
         reopen(f, O_RDWR);
-        ftruncate(f->fd, count * 128);
+        flush(f);
+        SYSCALL(ftruncate(f->fd, count * 128));
+        f->cache_start = -1;
+        f->size = count * 128;
     }
 }
 
-int file_findfirst(cpm_filename_t* pattern)
+/* Writes back everything cached for every open file. */
+
+void files_flush(void)
+{
+    for (struct file* f = ctx->files->firstfile; f; f = f->next)
+        flush(f);
+}
+
+void files_report_stats(FILE* fp)
+{
+    struct files* fs = ctx->files;
+    fprintf(fp,
+        "open files: %d (limit %d), descriptors: %d (limit %d)\n",
+        fs->num_files,
+        max_open_files,
+        fs->num_fds,
+        max_open_fds);
+    fprintf(fp,
+        "file evictions: %llu, descriptor evictions: %llu\n",
+        (unsigned long long)fs->file_evictions,
+        (unsigned long long)fs->fd_evictions);
+}
+
+static struct dirindex* build_dirindex(int drivefd, struct timespec* mtime)
 {
-    if (currentdir)
+    DIR* dir = fdopendir(SYSCALL(dup(drivefd)));
+    if (!dir)
+        return NULL;
+    rewinddir(dir);
+
+    int max = 64;
+    struct dirindex* di =
+        malloc(sizeof(struct dirindex) + max * sizeof(struct dirindex_entry));
+    if (!di)
+        fatal("out of memory");
+    di->refs = 1;
+    di->mtime = *mtime;
+    di->count = 0;
+
+    for (;;)
     {
-        closedir(currentdir);
-        currentdir = NULL;
+        struct dirent* de = readdir(dir);
+        if (!de)
+            break;
+
+        cpm_filename_t filename;
+        if (!unix_filename_to_cpm(de->d_name, &filename))
+            continue;
+        if ((de->d_type != DT_REG) && (de->d_type != DT_UNKNOWN) &&
+            (de->d_type != DT_LNK))
+            continue;
+        if (de->d_type != DT_REG)
+        {
+            struct stat st;
+            if ((SYSCALL(fstatat(drivefd, de->d_name, &st, 0)) != 0) ||
+                !S_ISREG(st.st_mode))
+                continue;
+        }
+
+        if (di->count == max)
+        {
+            max *= 2;
+            di = realloc(di,
+                sizeof(struct dirindex) + max * sizeof(struct dirindex_entry));
+            if (!di)
+                fatal("out of memory");
+        }
+        struct dirindex_entry* e = &di->entries[di->count++];
+        e->filename = filename;
+        e->filename.drive = 0;
+        strcpy(e->unixfilename, de->d_name);
     }
 
-    currentpattern = *pattern;
+    closedir(dir);
+    logf("[indexed %d files]\n", di->count);
+    return di;
+}
+
+/* Returns the (borrowed) directory index for the drive a filename refers
+ * to, rebuilding it if it is missing or the directory has changed. */
+
+static struct dirindex* get_dirindex(cpm_filename_t* filename)
+{
+    struct files* fs = ctx->files;
+    int drivefd = get_drive_fd(filename);
+    if (drivefd == -1)
+        return NULL;
+    int drive = filename->drive - 1;
+
+    struct stat st;
+    if (SYSCALL(fstat(drivefd, &st)) == -1)
+        return NULL;
+
+    struct dirindex* di = fs->dirs[drive];
+    if (di && (di->mtime.tv_sec == st.st_mtim.tv_sec) &&
+        (di->mtime.tv_nsec == st.st_mtim.tv_nsec))
+        return di;
+
+    invalidate_dirindex(filename->drive);
+    fs->dirs[drive] = build_dirindex(drivefd, &st.st_mtim);
+    return fs->dirs[drive];
+}
+
+int file_findfirst(cpm_filename_t* pattern)
+{
+    struct files* fs = ctx->files;
+    release_dirindex(fs->currentsearch);
+    fs->currentsearch = NULL;
+
+    fs->currentpattern = *pattern;
     logf("[reset search; current find pattern is '%.11s']\n",
-        currentpattern.bytes);
-    currentsearchdrivefd = get_drive_fd(pattern);
-    if (currentsearchdrivefd == -1)
+        fs->currentpattern.bytes);
+    if (get_drive_fd(pattern) == -1)
         return 0;
 
-    currentdir = fdopendir(dup(currentsearchdrivefd));
-    if (currentdir)
-    {
-        rewinddir(currentdir);
-        return 0;
-    }
-    return -1;
+    fs->currentsearch = get_dirindex(pattern);
+    if (!fs->currentsearch)
+        return -1;
+    fs->currentsearch->refs++;
+    fs->currentsearchpos = 0;
+    return 0;
 }
 
 int file_findnext(cpm_filename_t* result)
 {
-    for (;;)
-    {
-        if (!currentdir)
-            return -1;
-
-        struct dirent* de = readdir(currentdir);
-        if (!de)
-        {
-            closedir(currentdir);
-            currentdir = NULL;
-            logf("[finished search]\n");
-            return -1;
-        }
+    struct files* fs = ctx->files;
+    struct dirindex* di = fs->currentsearch;
+    if (!di)
+        return -1;
 
-        struct stat st;
-        if ((fstatat(currentsearchdrivefd, de->d_name, &st, 0) == 0) &&
-            S_ISREG(st.st_mode) && unix_filename_to_cpm(de->d_name, result))
+    while (fs->currentsearchpos < di->count)
+    {
+        *result = di->entries[fs->currentsearchpos++].filename;
+        result->drive = fs->currentpattern.drive;
+        logf("[compare '%.11s' with pattern '%.11s']\n",
+            result->bytes,
+            fs->currentpattern.bytes);
+        if (match_filenames(&fs->currentpattern, result))
         {
-            result->drive = currentpattern.drive;
-            logf("[compare '%.11s' with pattern '%.11s']\n",
-                result->bytes,
-                currentpattern.bytes);
-            if (match_filenames(&currentpattern, result))
-            {
-                logf("[positive match]\n");
-                return 0;
-            }
+            logf("[positive match]\n");
+            return 0;
         }
     }
+
+    logf("[finished search]\n");
+    release_dirindex(di);
+    fs->currentsearch = NULL;
+    return -1;
 }
 
 int file_delete(cpm_filename_t* pattern)
@@ -411,41 +828,84 @@ int file_delete(cpm_filename_t* pattern)
         pattern->bytes,
         '@' + pattern->drive);
     int drivefd = get_drive_fd(pattern);
-    DIR* dir = fdopendir(dup(drivefd));
-    if (!dir)
+    if ((drivefd == -1) || is_readonly(pattern))
+        return -1;
+    files_flush();
+    struct dirindex* di = get_dirindex(pattern);
+    if (!di)
         return -1;
-    rewinddir(dir);
 
     int result = -1;
-    for (;;)
+    for (int i = 0; i < di->count; i++)
     {
-        struct dirent* de = readdir(dir);
-        if (!de)
-            break;
-
-        struct stat st;
-        cpm_filename_t candidate;
-
-        if ((fstatat(drivefd, de->d_name, &st, 0) == 0) &&
-            S_ISREG(st.st_mode) && unix_filename_to_cpm(de->d_name, &candidate))
+        cpm_filename_t candidate = di->entries[i].filename;
+        candidate.drive = pattern->drive;
+        logf("[compare '%.11s' with pattern '%.11s']\n",
+            candidate.bytes,
+            pattern->bytes);
+        if (match_filenames(pattern, &candidate))
         {
-            candidate.drive = pattern->drive;
-            logf("[compare '%.11s' with pattern '%.11s']\n",
-                candidate.bytes,
-                pattern->bytes);
-            if (match_filenames(pattern, &candidate))
-            {
-                logf("[positive match, deleting]\n");
-                unlinkat(drivefd, de->d_name, 0);
-                result = 0;
-            }
+            logf("[positive match, deleting]\n");
+            forget_file(&candidate);
+            SYSCALL(unlinkat(drivefd, di->entries[i].unixfilename, 0));
+            result = 0;
         }
     }
 
-    closedir(dir);
+    if (result == 0)
+        invalidate_dirindex(pattern->drive);
     return result;
 }
 
+/* Open files are saved in snapshots by name only, least recently used
+ * first; restoring them just recreates the table entries. */
+
+void files_save(FILE* fp)
+{
+    struct files* fs = ctx->files;
+    fputc(fs->num_files & 0xff, fp);
+    fputc(fs->num_files >> 8, fp);
+    for (struct file* f = fs->lastfile; f; f = f->prev)
+        fwrite(&f->filename, 1, sizeof(cpm_filename_t), fp);
+}
+
+void files_load(FILE* fp)
+{
+    int lo = fgetc(fp);
+    int hi = fgetc(fp);
+    if ((lo == EOF) || (hi == EOF))
+        fatal("snapshot is truncated");
+
+    int count = lo | (hi << 8);
+    for (int i = 0; i < count; i++)
+    {
+        cpm_filename_t filename;
+        if (fread(&filename, 1, sizeof(filename), fp) != sizeof(filename))
+            fatal("snapshot is truncated");
+        file_open(&filename);
+    }
+}
+
+/* Closes everything the guest left open. */
+
+void files_free(void)
+{
+    struct files* fs = ctx->files;
+    while (fs->firstfile)
+        free_file(fs->firstfile);
+    for (int i = 0; i < NUM_DRIVES; i++)
+    {
+        if (fs->drives[i] != -1)
+            close(fs->drives[i]);
+    }
+    for (int i = 0; i < NUM_DRIVES; i++)
+        release_dirindex(fs->dirs[i]);
+    release_dirindex(fs->currentsearch);
+
+    free(fs);
+    ctx->files = NULL;
+}
+
 int file_rename(cpm_filename_t* src, cpm_filename_t* dest)
 {
     logf("[renaming %.11s to %.11s on drive %c]\n",
@@ -460,5 +920,17 @@ int file_rename(cpm_filename_t* src, cpm_filename_t* dest)
     cpm_filename_to_unix(dest, destunixfilename);
 
     int drivefd = get_drive_fd(src);
-    return renameat(drivefd, srcunixfilename, drivefd, destunixfilename);
+    if ((drivefd == -1) || is_readonly(src))
+        return -1;
+    files_flush();
+    invalidate_dirindex(src->drive);
+
+    /* The destination is on the source's drive, whatever its FCB says. */
+
+    cpm_filename_t destfilename = *dest;
+    destfilename.drive = src->drive;
+    forget_file(src);
+    forget_file(&destfilename);
+    return SYSCALL(
+        renameat(drivefd, srcunixfilename, drivefd, destunixfilename));
 }
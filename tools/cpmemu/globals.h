@@ -1,7 +1,9 @@
 #ifndef GLOBALS_H
 #define GLOBALS_H
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <setjmp.h>
 #include "third_party/lib6502/lib6502.h"
 
 #define TPA_BASE 0x0200
@@ -11,19 +13,86 @@
 #define BIOS_ADDRESS 0xff01
 #define EXIT_ADDRESS 0xff02
 #define SCREEN_ADDRESS 0xff03
+#define BRK_ADDRESS 0xff04
+#define TTY_ADDRESS 0xff05
+
+#define CONSOLE_BUFFER_SIZE 4096
+
+/* Everything belonging to one guest. Each thread running a guest points ctx
+ * at its own context. */
+
+struct context
+{
+    M6502* cpu;
+    uint8_t ram[0x10000];
+    bool singlestepping;
+
+    uint16_t dma;
+    uint8_t current_disk;
+    int exitcode;
+    uint16_t himem;
+    bool terminated;
+    char* const* user_command_line;
+    int console_in;
+    int console_out;
+    struct replay* replay; /* scripted console input; see replay.c */
+
+    /* Console output waiting to be written; see console_flush(). */
+    uint8_t console_buffer[CONSOLE_BUFFER_SIZE];
+    int console_buffered;
+    uint64_t console_buffered_since; /* ns */
+
+    /* Idle detection state for console status polls. */
+    uint64_t last_poll_cycles;
+    int idle_polls;
+    int idle_timeout; /* ms */
+    uint64_t idle_ns;
+
+    struct files* files;
+    struct disks* disks; /* only in BIOS mode; see diskbios.c */
+
+    /* Host syscalls made on the guest's behalf, in total and per BDOS call,
+     * and the time spent in the BDOS and BIOS handlers. */
+    uint64_t syscalls;
+    uint64_t bdos_calls[256];
+    uint64_t bdos_syscalls[256];
+    uint64_t bdos_ns[256];
+    uint64_t bios_calls[256];
+    uint64_t bios_ns[256];
+
+    /* Execution statistics; opcodes are only counted when the CPU's
+     * opcodeCounts points at opcode_counts. */
+    uint64_t instructions;
+    uint64_t opcode_counts[256];
+    uint64_t start_ns;
+    uint64_t drive_bytes_read[16];
+    uint64_t drive_bytes_written[16];
+
+    /* When running as a job, guest exit and fatal errors return here rather
+     * than exiting the process. */
+    jmp_buf* exit_jmp;
+};
+
+extern _Thread_local struct context* ctx;
+
+#define SYSCALL(x) (ctx->syscalls++, (x))
+
+extern struct context* context_new(void);
+extern void context_free(struct context* c);
+extern void emulator_exit(int code);
 
-extern M6502* cpu;
-extern uint8_t ram[0x10000];
-extern uint16_t himem;
 extern bool tracing;
+extern bool idle_detection;
+extern bool block_cache;
+extern bool jit;
 
 extern void emulator_init(void);
+extern void emulator_init_debugger(void);
 extern void emulator_run(void);
 extern void showregs(void);
 extern uint16_t get_xa();
 extern void set_xa(uint16_t xa);
 extern void set_result(uint16_t xa, bool success);
-extern bool singlestepping;
 
 extern const uint8_t ccp_data[];
 extern const int ccp_len;
@@ -34,7 +103,17 @@ extern const int biosbdosdata_len;
 extern void bios_coldboot(void);
 extern void bios_warmboot(void);
 
+extern uint16_t relocate_image(uint8_t page, uint8_t zp);
+
+extern uint64_t now_ns(void);
+extern void console_flush(void);
+extern void console_putc(uint8_t c);
+extern int console_getc(void);
+extern void bios_const(void);
 extern void bdos_entry(uint8_t bdos_call, bool log);
+extern void bdos_report_stats(FILE* fp);
+extern void bdos_call_name(char* buffer, size_t len, int bdos_call);
+extern const char* disk_bios_name(int bios_call);
 extern void bios_entry(uint8_t bios_call);
 extern void screen_entry(uint8_t screen_call);
 
@@ -47,8 +126,15 @@ cpm_filename_t;
 
 extern bool parse_fcb(uint8_t fcb[16], const char* filename);
 
+extern int max_open_files;
+extern int max_open_fds;
 extern void files_init(void);
-extern void file_set_drive(int drive, const char* path);
+extern void files_free(void);
+extern void files_flush(void);
+extern void files_report_stats(FILE* fp);
+extern void files_save(FILE* fp);
+extern void files_load(FILE* fp);
+extern void file_set_drive(int drive, const char* path, bool readonly);
 extern struct file* file_open(cpm_filename_t* filename);
 extern struct file* file_create(cpm_filename_t* filename);
 extern int file_close(cpm_filename_t* filename);
@@ -61,10 +147,48 @@ extern int file_findnext(cpm_filename_t* result);
 extern int file_delete(cpm_filename_t* pattern);
 extern int file_rename(cpm_filename_t* src, cpm_filename_t* dest);
 
+extern const char* diskdefs_filename;
+extern void disk_mount(int drive, const char* spec);
+extern void disk_bios_boot(const char* bdos);
+extern void disk_bios_entry(uint8_t bios_call);
+extern void disk_tty_entry(uint8_t tty_call);
+extern void disks_report_stats(FILE* fp);
+
+extern void stats_init(const char* filename);
+
+extern void replay_load(const char* filename);
+extern bool replay_ready(void);
+extern int replay_getc(void);
+extern void replay_free(void);
+
+extern bool profiling;
+extern void profile_init(const char* filename);
+extern void profile_load_symbols(const char* spec);
+extern void profile_instruction(void);
+
+extern bool binary_tracing;
+extern void trace_init(const char* spec);
+extern void trace_instruction(void);
+
+extern const char* snapshot_on_input;
+extern void snapshot_save(const char* filename);
+extern void snapshot_load(const char* filename);
+extern void snapshot_before_input(void);
+
 extern void fatal(const char* message, ...);
 
 extern bool flag_enter_debugger;
-extern char* const* user_command_line;
+
+struct job;
+extern struct job* job_parse(
+    char* const* words, const char* cwd, const char** error);
+extern int job_run(struct job* j, int capture_fd);
+extern void job_free(struct job* j);
+extern void copy_output(int fd, int outfd);
+extern int run_jobs(const char* manifest, int threads);
+
+extern void run_server(const char* path, int threads);
+extern int run_client(const char* path, char* const* words);
 
 #endif
 
@@ -0,0 +1,335 @@
+/* Checks that lib6502's JIT and block cache give exactly the same results as
+ * the interpreter. A few handwritten programs, and then many random ones made
+ * of loops of instructions the JIT can compile, are run side by side on three
+ * CPUs, one with the JIT on and one with just the block cache, in randomly
+ * sized slices of the budget and with some traps set; registers, cycle counts,
+ * budgets and memory must all agree after every slice. Exits with 1 on the
+ * first difference. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "third_party/lib6502/lib6502.h"
+
+#define CODE_ADDRESS 0x1000
+#define DATA_ADDRESS 0x2000
+#define COUNTER 0xf0
+#define SLICES 200
+#define PROGRAMS 1000
+
+static uint8_t ram1[0x10000];
+static uint8_t ram2[0x10000];
+static uint8_t ram3[0x10000];
+static uint8_t traps[0x10000];
+
+/* A self-modifying copy loop which patches the operands of its own LDA and
+ * STA, as relocating loaders do. */
+
+static const uint8_t patching[] = {
+    0xa2, 0x00,       /* 1000 LDX #0 */
+    0xad, 0x00, 0x20, /* 1002 LDA $2000 */
+    0x8d, 0x00, 0x30, /* 1005 STA $3000 */
+    0xee, 0x03, 0x10, /* 1008 INC $1003 */
+    0xee, 0x06, 0x10, /* 100b INC $1006 */
+    0xca,             /* 100e DEX */
+    0xd0, 0xf1,       /* 100f BNE $1002 */
+    0x4c, 0x00, 0x10, /* 1011 JMP $1000 */
+};
+
+/* A BCD counter, which must stay with the interpreter while D is set. */
+
+static const uint8_t decimal[] = {
+    0xf8,             /* 1000 SED */
+    0x18,             /* 1001 CLC */
+    0xa5, 0x10,       /* 1002 LDA $10 */
+    0x69, 0x01,       /* 1004 ADC #1 */
+    0x85, 0x10,       /* 1006 STA $10 */
+    0xd8,             /* 1008 CLD */
+    0xa5, 0x11,       /* 1009 LDA $11 */
+    0x69, 0x07,       /* 100b ADC #7 */
+    0x85, 0x11,       /* 100d STA $11 */
+    0x4c, 0x00, 0x10, /* 100f JMP $1000 */
+};
+
+/* Subroutine calls, pushes and pulls. */
+
+static const uint8_t calls[] = {
+    0xa9, 0x42,       /* 1000 LDA #$42 */
+    0x48,             /* 1002 PHA */
+    0x20, 0x10, 0x10, /* 1003 JSR $1010 */
+    0x68,             /* 1006 PLA */
+    0x08,             /* 1007 PHP */
+    0xfa,             /* 1008 PLX */
+    0xba,             /* 1009 TSX */
+    0xe8,             /* 100a INX */
+    0x80, 0xf3,       /* 100b BRA $1000 */
+    0xea, 0xea, 0xea, /* 100d NOP */
+    0xe6, 0x20,       /* 1010 INC $20 */
+    0xa4, 0x20,       /* 1012 LDY $20 */
+    0x5a,             /* 1014 PHY */
+    0x7a,             /* 1015 PLY */
+    0x60,             /* 1016 RTS */
+};
+
+/* Instructions the random programs are made from. */
+
+static const uint8_t implied[] = {0x0a, 0x4a, 0x2a, 0x6a, 0x1a, 0x3a, 0xe8,
+    0xc8, 0xca, 0x88, 0xaa, 0xa8, 0x8a, 0x98, 0xba, 0x18, 0x38, 0xb8, 0x58,
+    0x78, 0xd8, 0xea};
+static const uint8_t immediate[] = {
+    0xa9, 0xa2, 0xa0, 0x69, 0xe9, 0x29, 0x09, 0x49, 0xc9, 0xe0, 0xc0, 0x89};
+static const uint8_t zeropage[] = {0xa5, 0xa6, 0xa4, 0x85, 0x86, 0x84, 0x64,
+    0x65, 0xe5, 0x25, 0x05, 0x45, 0xc5, 0xe4, 0xc4, 0x24, 0xe6, 0xc6, 0x06,
+    0x46, 0x26, 0x66, 0xb5, 0xb4, 0x95, 0x94, 0x74, 0x75, 0xf5, 0x35, 0x15,
+    0x55, 0xd5, 0x34, 0xf6, 0xd6, 0x16, 0x56, 0x36, 0x76, 0xb6, 0x96, 0xa1,
+    0x81, 0x61, 0xe1, 0x21, 0x01, 0x41, 0xc1, 0xb1, 0x91, 0x71, 0xf1, 0x31,
+    0x11, 0x51, 0xd1, 0xb2, 0x92, 0x72, 0xf2, 0x32, 0x12, 0x52, 0xd2};
+static const uint8_t absolute[] = {0xad, 0xae, 0xac, 0x8d, 0x8e, 0x8c, 0x9c,
+    0x6d, 0xed, 0x2d, 0x0d, 0x4d, 0xcd, 0xec, 0xcc, 0x2c, 0xee, 0xce, 0x0e,
+    0x4e, 0x2e, 0x6e, 0xbd, 0xbc, 0x9d, 0x9e, 0x7d, 0xfd, 0x3d, 0x1d, 0x5d,
+    0xdd, 0x3c, 0xfe, 0xde, 0x1e, 0x5e, 0x3e, 0x7e, 0xb9, 0xbe, 0x99, 0x79,
+    0xf9, 0x39, 0x19, 0x59, 0xd9};
+static const uint8_t pushes[] = {0x48, 0xda, 0x5a, 0x08};
+static const uint8_t pulls[] = {0x68, 0xfa, 0x7a};
+static const uint8_t branches[] = {
+    0x10, 0x30, 0x50, 0x70, 0x90, 0xb0, 0xd0, 0xf0, 0x80};
+
+#define PICK(TABLE) TABLE[rand() % sizeof(TABLE)]
+
+static uint16_t address(void)
+{
+    switch (rand() % 8)
+    {
+        case 0:
+            return CODE_ADDRESS + (rand() % 0x200);
+        case 1:
+            return rand() & 0xffff;
+        default:
+            return DATA_ADDRESS + (rand() % 0x180);
+    }
+}
+
+/* Writes a random program of loops into memory. */
+
+static void generate(uint8_t* memory)
+{
+    uint16_t pc = CODE_ADDRESS;
+    uint16_t loops[8];
+    int numloops = 0;
+
+    while (pc < (CODE_ADDRESS + 0x1f0))
+    {
+        int kind = rand() % 16;
+        if (kind < 4)
+            memory[pc++] = PICK(implied);
+        else if (kind < 6)
+        {
+            memory[pc++] = PICK(immediate);
+            memory[pc++] = rand();
+        }
+        else if (kind < 9)
+        {
+            memory[pc++] = PICK(zeropage);
+            memory[pc++] = rand() % COUNTER;
+        }
+        else if (kind < 12)
+        {
+            uint16_t a = address();
+            memory[pc++] = PICK(absolute);
+            memory[pc++] = a;
+            memory[pc++] = a >> 8;
+        }
+        else if (kind == 12)
+        {
+            memory[pc++] = PICK(pushes);
+            memory[pc++] = PICK(implied);
+            memory[pc++] = PICK(pulls);
+        }
+        else if (kind == 13)
+        {
+            /* The start of a loop, counted down in COUNTER. */
+            memory[pc++] = 0xa9; /* LDA #n */
+            memory[pc++] = 1 + (rand() % 40);
+            memory[pc++] = 0x85; /* STA COUNTER */
+            memory[pc++] = COUNTER;
+            if (numloops < 8)
+                loops[numloops++] = pc;
+        }
+        else if ((kind == 14) && numloops &&
+                 ((pc - loops[numloops - 1]) < 120))
+        {
+            /* The end of the innermost loop. */
+            uint16_t start = loops[--numloops];
+            memory[pc++] = 0xc6; /* DEC COUNTER */
+            memory[pc++] = COUNTER;
+            memory[pc++] = 0xd0; /* BNE start */
+            memory[pc] = start - (pc + 1);
+            pc++;
+        }
+        else if (kind == 15)
+        {
+            memory[pc++] = PICK(branches);
+            memory[pc++] = (rand() % 16) - 8;
+        }
+        else if (rand() % 4 == 0)
+            memory[pc++] = 0xf8; /* SED */
+    }
+
+    memory[pc++] = 0x4c; /* JMP CODE_ADDRESS */
+    memory[pc++] = CODE_ADDRESS & 0xff;
+    memory[pc++] = CODE_ADDRESS >> 8;
+
+    /* Zero page pointers into the data area. */
+
+    for (int i = 0; i < COUNTER; i += 2)
+    {
+        uint16_t a = address();
+        memory[i] = a;
+        memory[i + 1] = a >> 8;
+    }
+}
+
+/* Compares b, running from memory, and called what, against the
+ * interpreter. */
+
+static bool compare(const char* name,
+    M6502* a,
+    M6502* b,
+    const char* what,
+    const uint8_t* memory,
+    int slice)
+{
+    M6502_Registers* ra = a->registers;
+    M6502_Registers* rb = b->registers;
+    if ((ra->a == rb->a) && (ra->x == rb->x) && (ra->y == rb->y) &&
+        (ra->p == rb->p) && (ra->s == rb->s) && (ra->pc == rb->pc) &&
+        (a->cycles == b->cycles) && !memcmp(ram1, memory, sizeof(ram1)))
+        return true;
+
+    printf("%s: differs with the %s after slice %d\n", name, what, slice);
+    printf("  interpreter: A=%02x X=%02x Y=%02x P=%02x S=%02x PC=%04x "
+           "cycles=%llu\n",
+        ra->a, ra->x, ra->y, ra->p, ra->s, ra->pc,
+        (unsigned long long)a->cycles);
+    printf("  %s:%*sA=%02x X=%02x Y=%02x P=%02x S=%02x PC=%04x "
+           "cycles=%llu\n",
+        what, (int)(12 - strlen(what)), "", rb->a, rb->x, rb->y, rb->p, rb->s, rb->pc,
+        (unsigned long long)b->cycles);
+    for (int i = 0; i < 0x10000; i++)
+    {
+        if (ram1[i] != memory[i])
+            printf("  memory %04x: %02x %02x\n", i, ram1[i], memory[i]);
+    }
+    return false;
+}
+
+/* Runs whatever is in ram1 on all three CPUs. */
+
+static bool check(const char* name)
+{
+    char buffer[64];
+    bool ok = true;
+    memcpy(ram2, ram1, sizeof(ram1));
+    memcpy(ram3, ram1, sizeof(ram1));
+    M6502* a = M6502_new(NULL, ram1, NULL);
+    M6502* b = M6502_new(NULL, ram2, NULL);
+    M6502* c = M6502_new(NULL, ram3, NULL);
+    M6502_setJit(b, 1);
+    M6502_setBlockCache(c, 1);
+    a->registers->pc = b->registers->pc = c->registers->pc = CODE_ADDRESS;
+    a->registers->s = b->registers->s = c->registers->s = 0xff;
+
+    for (int slice = 0; ok && (slice < SLICES); slice++)
+    {
+        unsigned long budget1 = 1 + (rand() % 5000);
+        unsigned long budget2 = budget1;
+        unsigned long budget3 = budget1;
+        int r1 = M6502_runUntil(a, traps, &budget1);
+        int r2 = M6502_runUntil(b, traps, &budget2);
+        int r3 = M6502_runUntil(c, traps, &budget3);
+        if ((r1 != r2) || (budget1 != budget2))
+        {
+            printf("%s: slice %d returned %d/%lu, but %d/%lu with the jit\n",
+                name, slice, r1, budget1, r2, budget2);
+            ok = false;
+        }
+        else if ((r1 != r3) || (budget1 != budget3))
+        {
+            printf("%s: slice %d returned %d/%lu, but %d/%lu with the block "
+                   "cache\n",
+                name, slice, r1, budget1, r3, budget3);
+            ok = false;
+        }
+        else
+            ok = compare(name, a, b, "jit", ram2, slice) &&
+                 compare(name, a, c, "block cache", ram3, slice);
+
+        /* Skip over traps, and sometimes poke memory behind their backs. */
+
+        if (r1 == M6502_Trapped)
+        {
+            a->registers->pc += M6502_disassemble(a, a->registers->pc, buffer);
+            b->registers->pc = c->registers->pc = a->registers->pc;
+        }
+        if (rand() % 8 == 0)
+        {
+            uint16_t addr = address();
+            ram1[addr] = ram2[addr] = ram3[addr] = rand();
+        }
+    }
+
+    M6502_delete(a);
+    M6502_delete(b);
+    M6502_delete(c);
+    return ok;
+}
+
+static bool check_program(const char* name, const uint8_t* code, size_t len)
+{
+    memset(ram1, 0, sizeof(ram1));
+    memset(traps, 0, sizeof(traps));
+    memcpy(&ram1[CODE_ADDRESS], code, len);
+    return check(name);
+}
+
+int main(int argc, const char* argv[])
+{
+    int programs = (argc > 1) ? atoi(argv[1]) : PROGRAMS;
+
+    M6502* cpu = M6502_new(NULL, ram1, NULL);
+    bool available = M6502_setJit(cpu, 1);
+    M6502_delete(cpu);
+    if (!available)
+    {
+        printf("the JIT is not available on this host\n");
+        return 0;
+    }
+
+    if (!check_program("patching", patching, sizeof(patching)) ||
+        !check_program("decimal", decimal, sizeof(decimal)) ||
+        !check_program("calls", calls, sizeof(calls)))
+        return 1;
+
+    for (int i = 0; i < programs; i++)
+    {
+        char name[32];
+        sprintf(name, "random %d", i);
+        srand(i);
+
+        for (int j = 0; j < 0x10000; j++)
+            ram1[j] = rand();
+        generate(ram1);
+
+        memset(traps, 0, sizeof(traps));
+        for (int j = 0; j < 4; j++)
+            traps[CODE_ADDRESS + (rand() % 0x200)] = 1;
+
+        if (!check(name))
+            return 1;
+    }
+
+    printf("%d programs ok\n", programs + 3);
+    return 0;
+}
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "globals.h"
+
+/* Runs many CP/M programs concurrently, each with its own context, on a pool
+ * of threads. The manifest has one job per line:
+ *
+ *   [-p|-r DRIVE=PATH]... [-m NUM] [-i FILE|-R SCRIPT] [-o FILE]
+ *       program.com [args...]
+ *   [-p|-r DRIVE=PATH]... [-i FILE|-R SCRIPT] [-o FILE] -K SNAPSHOT
+ *
+ * Blank lines and lines starting with # are ignored. Console input comes
+ * from FILE (or /dev/null), or is replayed from SCRIPT (see replay.c);
+ * console output goes to FILE, or if not given is captured and written to
+ * stdout in one piece when the job finishes.
+ *
+ * The same job syntax is used for requests to the job server. */
+
+struct drive_mapping
+{
+    int drive;
+    char* path;
+    bool readonly;
+};
+
+struct job
+{
+    int line;
+    char* cwd;
+    struct drive_mapping drives[16];
+    int num_drives;
+    uint16_t himem;
+    char* input;
+    char* script;
+    char* output;
+    char* snapshot;
+    char** argv;
+    int exitcode;
+};
+
+static struct job** jobs;
+static int num_jobs;
+static int next_job;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char** split_words(char* line)
+{
+    int count = 0;
+    char** words = NULL;
+    char* saveptr;
+    for (char* w = strtok_r(line, " \t\r\n", &saveptr); w;
+         w = strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        words = realloc(words, (count + 2) * sizeof(char*));
+        if (!words)
+            fatal("out of memory");
+        words[count++] = w;
+    }
+    if (words)
+        words[count] = NULL;
+    return words;
+}
+
+/* Makes a path relative to the job's working directory, if it has one. */
+
+static char* resolve(struct job* j, const char* path)
+{
+    if (!j->cwd || (path[0] == '/'))
+        return strdup(path);
+
+    char* s = malloc(strlen(j->cwd) + strlen(path) + 2);
+    if (!s)
+        fatal("out of memory");
+    sprintf(s, "%s/%s", j->cwd, path);
+    return s;
+}
+
+void job_free(struct job* j)
+{
+    free(j->cwd);
+    for (int i = 0; i < j->num_drives; i++)
+        free(j->drives[i].path);
+    free(j->input);
+    free(j->script);
+    free(j->output);
+    free(j->snapshot);
+    if (j->argv)
+    {
+        for (char** w = j->argv; *w; w++)
+            free(*w);
+        free(j->argv);
+    }
+    free(j);
+}
+
+/* Parses a job from a NULL-terminated list of words. Relative paths are
+ * resolved against cwd if it is not NULL. On failure, returns NULL and sets
+ * *error. */
+
+struct job* job_parse(char* const* words, const char* cwd, const char** error)
+{
+    struct job* j = calloc(1, sizeof(struct job));
+    if (!j)
+        fatal("out of memory");
+    j->himem = BDOS_ADDRESS;
+    if (cwd)
+        j->cwd = strdup(cwd);
+
+    while (*words && (**words == '-'))
+    {
+        const char* flag = *words++;
+        const char* arg = *words++;
+        if (!arg || (strlen(flag) != 2))
+        {
+            *error = "bad job syntax";
+            goto fail;
+        }
+
+        switch (flag[1])
+        {
+            case 'p':
+            case 'r':
+                if (!arg[0] || (arg[1] != '=') ||
+                    (j->num_drives == sizeof(j->drives) / sizeof(*j->drives)))
+                {
+                    *error = "invalid drive assignment";
+                    goto fail;
+                }
+                j->drives[j->num_drives].drive = toupper(arg[0]) - 'A';
+                j->drives[j->num_drives].path = resolve(j, &arg[2]);
+                j->drives[j->num_drives].readonly = (flag[1] == 'r');
+                j->num_drives++;
+                break;
+
+            case 'm':
+                j->himem = strtoul(arg, NULL, 0);
+                break;
+
+            case 'i':
+                free(j->input);
+                j->input = resolve(j, arg);
+                break;
+
+            case 'R':
+                free(j->script);
+                j->script = resolve(j, arg);
+                break;
+
+            case 'o':
+                free(j->output);
+                j->output = resolve(j, arg);
+                break;
+
+            case 'K':
+                free(j->snapshot);
+                j->snapshot = resolve(j, arg);
+                break;
+
+            default:
+                *error = "unknown job option";
+                goto fail;
+        }
+    }
+
+    if (!*words && !j->snapshot)
+    {
+        *error = "no program specified";
+        goto fail;
+    }
+
+    int count = 0;
+    while (words[count])
+        count++;
+    j->argv = calloc(count + 1, sizeof(char*));
+    if (!j->argv)
+        fatal("out of memory");
+    if (count)
+        j->argv[0] = resolve(j, words[0]);
+    for (int i = 1; i < count; i++)
+        j->argv[i] = strdup(words[i]);
+    return j;
+
+fail:
+    job_free(j);
+    return NULL;
+}
+
+static void read_manifest(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (!fp)
+        fatal("cannot open job manifest '%s': %s", filename, strerror(errno));
+
+    char* line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline(&line, &len, fp) != -1)
+    {
+        lineno++;
+        char* p = line;
+        while (isspace(*p))
+            p++;
+        if (!*p || (*p == '#'))
+            continue;
+
+        char** words = split_words(p);
+        const char* error;
+        struct job* j = job_parse(words, NULL, &error);
+        free(words);
+        if (!j)
+            fatal("line %d: %s", lineno, error);
+        j->line = lineno;
+
+        jobs = realloc(jobs, (num_jobs + 1) * sizeof(struct job*));
+        if (!jobs)
+            fatal("out of memory");
+        jobs[num_jobs++] = j;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+void copy_output(int fd, int outfd)
+{
+    char buffer[4096];
+    lseek(fd, 0, SEEK_SET);
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            break;
+        (void)write(outfd, buffer, len);
+    }
+}
+
+/* Runs a job in a fresh context on the calling thread and returns its exit
+ * code. Console output goes to the job's output file if it has one, or to
+ * capture_fd otherwise. */
+
+int job_run(struct job* j, int capture_fd)
+{
+    jmp_buf exit_jmp;
+
+    ctx = context_new();
+    ctx->exit_jmp = &exit_jmp;
+    ctx->console_in = ctx->console_out = -1;
+
+    if (setjmp(exit_jmp) == 0)
+    {
+        files_init();
+        if (j->cwd)
+            file_set_drive(0, j->cwd, false);
+        for (int i = 0; i < j->num_drives; i++)
+            file_set_drive(
+                j->drives[i].drive, j->drives[i].path, j->drives[i].readonly);
+        ctx->himem = j->himem;
+        ctx->user_command_line = j->argv;
+
+        const char* input = j->input ? j->input : "/dev/null";
+        ctx->console_in = open(input, O_RDONLY);
+        if (ctx->console_in == -1)
+            fatal("cannot open '%s': %s", input, strerror(errno));
+        if (j->script)
+            replay_load(j->script);
+
+        if (j->output)
+        {
+            ctx->console_out =
+                open(j->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (ctx->console_out == -1)
+                fatal("cannot open '%s': %s", j->output, strerror(errno));
+        }
+        else
+            ctx->console_out = capture_fd;
+
+        emulator_init();
+        if (j->snapshot)
+            snapshot_load(j->snapshot);
+        else
+        {
+            bios_coldboot();
+            bios_warmboot();
+        }
+        for (;;)
+            emulator_run();
+    }
+
+    j->exitcode = ctx->exitcode;
+
+    if (ctx->files)
+        files_free();
+    if (ctx->replay)
+        replay_free();
+    if (ctx->console_in != -1)
+        close(ctx->console_in);
+    if (j->output && (ctx->console_out != -1))
+        close(ctx->console_out);
+    context_free(ctx);
+    ctx = NULL;
+
+    return j->exitcode;
+}
+
+static void* worker(void* arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&lock);
+        int n = next_job++;
+        pthread_mutex_unlock(&lock);
+        if (n >= num_jobs)
+            return NULL;
+
+        struct job* j = jobs[n];
+        FILE* capture = tmpfile();
+        if (!capture)
+            fatal("cannot create capture file: %s", strerror(errno));
+
+        job_run(j, fileno(capture));
+
+        pthread_mutex_lock(&lock);
+        copy_output(fileno(capture), 1);
+        if (j->exitcode)
+            fprintf(stderr,
+                "job on line %d (%s) failed with exit code %d\n",
+                j->line,
+                j->argv[0] ? j->argv[0] : j->snapshot,
+                j->exitcode);
+        pthread_mutex_unlock(&lock);
+        fclose(capture);
+    }
+}
+
+/* Returns the number of failed jobs. */
+
+int run_jobs(const char* manifest, int threads)
+{
+    read_manifest(manifest);
+    if (!num_jobs)
+        return 0;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > num_jobs)
+        threads = num_jobs;
+
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+            fatal("cannot create thread");
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    int failures = 0;
+    for (int i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i]->exitcode)
+            failures++;
+    }
+    return failures;
+}
@@ -4,10 +4,44 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "globals.h"
 
 bool flag_enter_debugger = false;
-char* const* user_command_line = NULL;
+static const char* job_manifest = NULL;
+static int job_threads = 0;
+static const char* server_socket = NULL;
+static const char* client_socket = NULL;
+static bool flag_stats = false;
+static const char* stats_json = NULL;
+static const char* restore_snapshot = NULL;
+static const char* bdos_image = NULL;
+static char* client_words[64];
+static int num_client_words = 0;
+
+struct clock_profile
+{
+    const char* name;
+    double hz;
+};
+
+static const struct clock_profile clock_profiles[] = {
+    {"apple2e",  1023000 },
+    {"atari800", 1790000 },
+    {"bbcmicro", 2000000 },
+    {"c64",      985248  },
+    {"kim1",     1000000 },
+    {"oric",     1000000 },
+    {"osi",      1000000 },
+    {"pet",      1000000 },
+    {"vic20",    1108405 },
+    {"x16",      8000000 },
+    {NULL,       0       }
+};
+
+static const struct clock_profile* clock_profile;
 
 void fatal(const char* message, ...)
 {
@@ -16,9 +50,55 @@ void fatal(const char* message, ...)
     fprintf(stderr, "fatal: ");
     vfprintf(stderr, message, ap);
     fprintf(stderr, "\n");
+    va_end(ap);
+
+    if (ctx)
+        emulator_exit(1);
     exit(1);
 }
 
+static void report_cycles(void)
+{
+    fprintf(stderr,
+        "cycles: %llu (%.6fs at %.3fMHz on %s)\n",
+        (unsigned long long)ctx->cpu->cycles,
+        ctx->cpu->cycles / clock_profile->hz,
+        clock_profile->hz / 1e6,
+        clock_profile->name);
+    if (idle_detection)
+        fprintf(stderr,
+            "idle: %llu cycles (%.6fs)\n",
+            (unsigned long long)(ctx->idle_ns / 1e9 * clock_profile->hz),
+            ctx->idle_ns / 1e9);
+}
+
+static void report_stats(void)
+{
+    bdos_report_stats(stderr);
+    files_report_stats(stderr);
+    disks_report_stats(stderr);
+}
+
+static void set_clock_profile(const char* name)
+{
+    for (const struct clock_profile* p = clock_profiles; p->name; p++)
+    {
+        if (strcmp(p->name, name) == 0)
+        {
+            clock_profile = p;
+            return;
+        }
+    }
+
+    static struct clock_profile custom;
+    char* end;
+    custom.hz = strtod(name, &end) * 1e6;
+    if (*end || (custom.hz <= 0))
+        fatal("unknown clock profile '%s'", name);
+    custom.name = name;
+    clock_profile = &custom;
+}
+
 static void syntax(void)
 {
     printf("cpm [<flags>] [command] [args]:\n");
@@ -27,6 +107,58 @@ static void syntax(void)
     printf("  -t             enable instruction tracing on startup\n");
 	printf("  -m NUM         top of memory (by default, 0xff\n");
     printf("  -p DRIVE=PATH  map a drive to a path (by default, A=.)\n");
+    printf("  -r DRIVE=PATH  map a drive to a path read-only\n");
+    printf("  -o FILE        write console output to FILE\n");
+    printf("  -R FILE        replay console input from the script in FILE, "
+           "with\n");
+    printf("                 console polls timed in emulated cycles so that "
+           "runs\n");
+    printf("                 are reproducible\n");
+    printf("  -B FILE        BIOS mode: boot the BDOS in FILE, which loads the\n");
+    printf("                 CCP from drive A, and read commands from the "
+           "console\n");
+    printf("  -D DRIVE=IMAGE,FORMAT\n");
+    printf("                 in BIOS mode, map a drive to a CP/M filesystem "
+           "image\n");
+    printf("  -F FILE        read disk formats from FILE (by default, "
+           "diskdefs)\n");
+    printf("  -k FILE        save a snapshot to FILE when the program first\n");
+    printf("                 reads from the console\n");
+    printf("  -K FILE        start from the snapshot in FILE instead of loading\n");
+    printf("                 a command\n");
+    printf("  -I             block instead of spinning when the program is\n");
+    printf("                 busy-waiting on the console status\n");
+    printf("  -f NUM[,FDS]   size of the open file table and of the host file\n");
+    printf("                 descriptor pool (by default, %d,%d)\n",
+        max_open_files,
+        max_open_fds);
+    printf("  -J FILE        run the jobs listed in FILE concurrently\n");
+    printf("  -j NUM         number of threads to use with -J or -L\n");
+    printf("  -L SOCKET      run as a job server listening on SOCKET\n");
+    printf("  -C SOCKET      run the command on the job server at SOCKET\n");
+    printf("  -T FILE[,NUM]  write a binary trace of the last NUM instructions\n");
+    printf("                 to FILE (decode it with tracedump)\n");
+    printf("  -P FILE        write a collapsed-stack execution profile to FILE\n");
+    printf("  -S FILE[,OFS]  read profile symbols from an ELF or map file\n");
+    printf("  -s             report BDOS calls and the syscalls they made on "
+           "exit\n");
+    printf("  --stats FILE   write instruction, opcode, BDOS/BIOS call and "
+           "drive\n");
+    printf("                 statistics to FILE as JSON on exit\n");
+    printf("  --block-cache  run cached, predecoded blocks rather than "
+           "interpreting\n");
+    printf("                 every instruction (experimental; the default "
+           "is\n");
+    printf("                 --no-block-cache)\n");
+    printf("  --jit          compile frequently run blocks to host code "
+           "(experimental,\n");
+    printf("                 x86-64 only)\n");
+    printf("  -c PROFILE     report cycles and time taken on exit; PROFILE is\n");
+    printf("                 a machine name or a clock speed in MHz\n");
+    printf("                ");
+    for (const struct clock_profile* p = clock_profiles; p->name; p++)
+        printf(" %s", p->name);
+    printf("\n");
     printf(
         "If command is specified, a Unix file of that name will be loaded "
         "and\n");
@@ -36,35 +168,174 @@ static void syntax(void)
     exit(1);
 }
 
+/* Remembers an option to forward to the job server. */
+
+static void add_client_word(const char* flag, char* arg)
+{
+    if (num_client_words + 2 >= sizeof(client_words) / sizeof(*client_words))
+        fatal("too many options");
+    client_words[num_client_words++] = (char*)flag;
+    client_words[num_client_words++] = arg;
+}
+
+#define OPT_STATS 256
+#define OPT_NO_BLOCK_CACHE 257
+#define OPT_JIT 258
+#define OPT_BLOCK_CACHE 259
+
+static const struct option long_options[] = {
+    {"stats",          required_argument, NULL, OPT_STATS         },
+    {"block-cache",    no_argument,       NULL, OPT_BLOCK_CACHE   },
+    {"no-block-cache", no_argument,       NULL, OPT_NO_BLOCK_CACHE},
+    {"jit",            no_argument,       NULL, OPT_JIT           },
+    {NULL,             0,                 NULL, 0                 }
+};
+
 static void parse_options(int argc, char* const* argv)
 {
     for (;;)
     {
-        switch (getopt(argc, argv, "hdp:m:t:"))
+        int c = getopt_long(argc,
+            argv,
+            "hdsIp:r:f:o:k:K:m:t:c:P:S:T:J:j:L:C:B:D:F:R:",
+            long_options,
+            NULL);
+        switch (c)
         {
             case -1:
                 goto end_of_flags;
 
+            case OPT_STATS:
+                stats_json = optarg;
+                break;
+
+            case OPT_BLOCK_CACHE:
+                block_cache = true;
+                M6502_setBlockCache(ctx->cpu, true);
+                break;
+
+            case OPT_NO_BLOCK_CACHE:
+                block_cache = false;
+                jit = false;
+                M6502_setBlockCache(ctx->cpu, false);
+                break;
+
+            case OPT_JIT:
+                block_cache = jit = true;
+                if (!M6502_setJit(ctx->cpu, true))
+                    fatal("the JIT is not available on this host");
+                break;
+
             case 'd':
                 flag_enter_debugger = true;
                 break;
 
 			case 'm':
-				himem = strtoul(optarg, NULL, 0);
+				ctx->himem = strtoul(optarg, NULL, 0);
+				add_client_word("-m", optarg);
 				break;
 
             case 't':
                 tracing = true;
                 break;
 
+            case 's':
+                flag_stats = true;
+                break;
+
+            case 'I':
+                idle_detection = true;
+                break;
+
+            case 'k':
+                snapshot_on_input = optarg;
+                break;
+
+            case 'K':
+                restore_snapshot = optarg;
+                add_client_word("-K", optarg);
+                break;
+
+            case 'o':
+                ctx->console_out =
+                    open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (ctx->console_out == -1)
+                    fatal("cannot open '%s': %s", optarg, strerror(errno));
+                add_client_word("-o", optarg);
+                break;
+
+            case 'R':
+                replay_load(optarg);
+                add_client_word("-R", optarg);
+                break;
+
+            case 'f':
+            {
+                char* end;
+                max_open_files = strtoul(optarg, &end, 0);
+                if (*end == ',')
+                    max_open_fds = strtoul(end + 1, &end, 0);
+                if (*end || (max_open_files <= 0) || (max_open_fds <= 0))
+                    fatal("invalid syntax in file table size");
+                break;
+            }
+
+            case 'c':
+                set_clock_profile(optarg);
+                break;
+
+            case 'B':
+                bdos_image = optarg;
+                break;
+
+            case 'D':
+                if (!optarg[0] || (optarg[1] != '='))
+                    fatal("invalid syntax in disk image assignment");
+                disk_mount(toupper(optarg[0]) - 'A', &optarg[2]);
+                break;
+
+            case 'F':
+                diskdefs_filename = optarg;
+                break;
+
+            case 'T':
+                trace_init(optarg);
+                break;
+
+            case 'J':
+                job_manifest = optarg;
+                break;
+
+            case 'j':
+                job_threads = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'L':
+                server_socket = optarg;
+                break;
+
+            case 'C':
+                client_socket = optarg;
+                break;
+
+            case 'P':
+                profile_init(optarg);
+                break;
+
+            case 'S':
+                profile_load_symbols(optarg);
+                break;
+
             case 'p':
+            case 'r':
             {
                 if (!optarg[0] || (optarg[1] != '='))
                     fatal("invalid syntax in drive assignment");
 
                 uint8_t drive = toupper(optarg[0]) - 'A';
                 const char* path = &optarg[2];
-                file_set_drive(drive, path);
+                file_set_drive(drive, path, c == 'r');
+                add_client_word((c == 'r') ? "-r" : "-p", optarg);
                 break;
             }
 
@@ -74,17 +345,77 @@ static void parse_options(int argc, char* const* argv)
     }
 
 end_of_flags:
-    user_command_line = &argv[optind];
+    ctx->user_command_line = &argv[optind];
 }
 
 int main(int argc, char* const* argv)
 {
+    ctx = context_new();
     files_init();
     parse_options(argc, argv);
 
+    /* These only make sense when running a single program in-process. */
+
+    bool local_only = flag_enter_debugger || tracing || profiling ||
+                      binary_tracing || clock_profile || flag_stats ||
+                      snapshot_on_input || bdos_image || ctx->disks ||
+                      stats_json;
+
+    if (job_manifest)
+    {
+        if (local_only || restore_snapshot || *ctx->user_command_line)
+            fatal("-J cannot be combined with a command or with -d, -t, -c, "
+                  "-s, --stats, -k, -K, -B, -D, -P or -T");
+        return run_jobs(job_manifest, job_threads) ? 1 : 0;
+    }
+
+    if (server_socket)
+    {
+        if (local_only || restore_snapshot || *ctx->user_command_line)
+            fatal("-L cannot be combined with a command or with -d, -t, -c, "
+                  "-s, --stats, -k, -K, -B, -D, -P or -T");
+        run_server(server_socket, job_threads);
+    }
+
+    if (client_socket)
+    {
+        if (local_only || (!restore_snapshot && !*ctx->user_command_line))
+            fatal("-C needs a command or -K and cannot be combined with -d, "
+                  "-t, -c, -s, --stats, -k, -B, -D, -P or -T");
+        for (char* const* w = ctx->user_command_line; *w; w++)
+        {
+            if (num_client_words + 1 >=
+                sizeof(client_words) / sizeof(*client_words))
+                fatal("command line too long");
+            client_words[num_client_words++] = *w;
+        }
+        return run_client(client_socket, client_words);
+    }
+
     emulator_init();
-    bios_coldboot();
-    bios_warmboot();
+    emulator_init_debugger();
+    if (clock_profile)
+        atexit(report_cycles);
+    if (flag_stats)
+        atexit(report_stats);
+    if (stats_json)
+        stats_init(stats_json);
+    if (bdos_image)
+    {
+        /* Snapshots don't record the BIOS's state. */
+        if (restore_snapshot || snapshot_on_input || *ctx->user_command_line)
+            fatal("-B cannot be combined with a command or with -k or -K");
+        disk_bios_boot(bdos_image);
+    }
+    else if (ctx->disks)
+        fatal("-D needs -B");
+    else if (restore_snapshot)
+        snapshot_load(restore_snapshot);
+    else
+    {
+        bios_coldboot();
+        bios_warmboot();
+    }
 
     for (;;)
     {
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <elf.h>
+#include "globals.h"
+
+/* Execution profiler. Every instruction executed is counted against its
+ * address and against the current call stack, which is tracked by watching
+ * for JSRs and for the stack pointer unwinding past a frame's return
+ * address. At exit a collapsed-stack file suitable for flamegraph.pl and
+ * friends is written, plus a flat per-address histogram. */
+
+struct symbol
+{
+    uint16_t address;
+    char* name;
+};
+
+struct node
+{
+    uint16_t function;
+    uint64_t count;
+    struct node* parent;
+    struct node* child;
+    struct node* sibling;
+};
+
+struct frame
+{
+    struct node* node;
+    uint8_t sp;
+};
+
+bool profiling = false;
+static const char* profile_filename;
+static uint64_t pc_counts[0x10000];
+
+static struct symbol* symbols;
+static int num_symbols;
+static int max_symbols;
+
+static struct node root;
+static struct frame stack[256];
+static int stack_depth;
+static bool after_jsr;
+static uint8_t jsr_sp;
+
+static void add_symbol(uint16_t address, const char* name)
+{
+    if ((name[0] == '\0') || (name[0] == '.'))
+        return;
+
+    if (num_symbols == max_symbols)
+    {
+        max_symbols = max_symbols ? (max_symbols * 2) : 256;
+        symbols = realloc(symbols, max_symbols * sizeof(struct symbol));
+        if (!symbols)
+            fatal("out of memory");
+    }
+
+    struct symbol* s = &symbols[num_symbols++];
+    s->address = address;
+    s->name = strdup(name);
+}
+
+static void load_elf_symbols(const uint8_t* data, size_t len, uint16_t offset)
+{
+    const Elf32_Ehdr* eh = (const Elf32_Ehdr*)data;
+    if ((len < sizeof(Elf32_Ehdr)) || (eh->e_ident[EI_CLASS] != ELFCLASS32) ||
+        (eh->e_shoff + eh->e_shnum * sizeof(Elf32_Shdr) > len))
+        fatal("unsupported ELF file");
+
+    const Elf32_Shdr* sections = (const Elf32_Shdr*)(data + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++)
+    {
+        const Elf32_Shdr* symtab = &sections[i];
+        if (symtab->sh_type != SHT_SYMTAB)
+            continue;
+
+        const char* strings =
+            (const char*)(data + sections[symtab->sh_link].sh_offset);
+        const Elf32_Sym* syms = (const Elf32_Sym*)(data + symtab->sh_offset);
+        int count = symtab->sh_size / sizeof(Elf32_Sym);
+        for (int j = 0; j < count; j++)
+        {
+            const Elf32_Sym* sym = &syms[j];
+            int type = ELF32_ST_TYPE(sym->st_info);
+            if ((type != STT_FUNC) && (type != STT_NOTYPE))
+                continue;
+            if ((sym->st_shndx == SHN_UNDEF) || (sym->st_shndx >= eh->e_shnum))
+                continue;
+            if (!(sections[sym->st_shndx].sh_flags & SHF_EXECINSTR))
+                continue;
+
+            add_symbol(sym->st_value + offset, strings + sym->st_name);
+        }
+    }
+}
+
+/* Parses the output of ld.lld -Map, where symbols are the lines with four
+ * numeric columns followed by a bare identifier. */
+
+static void load_map_symbols(FILE* fp, uint16_t offset)
+{
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        unsigned vma, lma, size, align;
+        int n;
+        if (sscanf(line, "%x %x %x %u %n", &vma, &lma, &size, &align, &n) != 4)
+            continue;
+
+        char* name = line + n;
+        name[strcspn(name, "\r\n")] = '\0';
+        if (!isalpha(*name) && (*name != '_'))
+            continue;
+        if (strpbrk(name, " :()"))
+            continue;
+
+        add_symbol(vma + offset, name);
+    }
+}
+
+static int compare_symbols(const void* p1, const void* p2)
+{
+    const struct symbol* s1 = p1;
+    const struct symbol* s2 = p2;
+    return (int)s1->address - (int)s2->address;
+}
+
+/* Reads symbols from FILE or FILE,OFFSET, where FILE is either an ELF file
+ * or an lld map file and OFFSET is added to every symbol (by default the
+ * TPA base, as relocatable programs are linked at zero). */
+
+void profile_load_symbols(const char* spec)
+{
+    char* filename = strdup(spec);
+    uint16_t offset = TPA_BASE;
+    char* comma = strrchr(filename, ',');
+    if (comma)
+    {
+        *comma = '\0';
+        offset = strtoul(comma + 1, NULL, 0);
+    }
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        fatal("cannot open symbol file '%s'", filename);
+
+    uint8_t magic[SELFMAG];
+    if ((fread(magic, 1, SELFMAG, fp) == SELFMAG) &&
+        (memcmp(magic, ELFMAG, SELFMAG) == 0))
+    {
+        fseek(fp, 0, SEEK_END);
+        size_t len = ftell(fp);
+        uint8_t* data = malloc(len);
+        fseek(fp, 0, SEEK_SET);
+        if (!data || (fread(data, 1, len, fp) != len))
+            fatal("cannot read symbol file '%s'", filename);
+        load_elf_symbols(data, len, offset);
+        free(data);
+    }
+    else
+    {
+        rewind(fp);
+        load_map_symbols(fp, offset);
+    }
+
+    fclose(fp);
+    free(filename);
+    qsort(symbols, num_symbols, sizeof(struct symbol), compare_symbols);
+}
+
+static const struct symbol* lookup_symbol(uint16_t address)
+{
+    int lo = 0;
+    int hi = num_symbols - 1;
+    const struct symbol* found = NULL;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].address <= address)
+        {
+            found = &symbols[mid];
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+static void print_function(FILE* fp, uint16_t address)
+{
+    const struct symbol* s = lookup_symbol(address);
+    if (s)
+        fprintf(fp, "%s", s->name);
+    else
+        fprintf(fp, "0x%04x", address);
+}
+
+static void print_address(FILE* fp, uint16_t address)
+{
+    const struct symbol* s = lookup_symbol(address);
+    if (s && (s->address != address))
+        fprintf(fp, "%s+0x%x", s->name, address - s->address);
+    else if (s)
+        fprintf(fp, "%s", s->name);
+    else
+        fprintf(fp, "0x%04x", address);
+}
+
+static struct node* find_child(struct node* parent, uint16_t function)
+{
+    for (struct node* n = parent->child; n; n = n->sibling)
+    {
+        if (n->function == function)
+            return n;
+    }
+
+    struct node* n = calloc(1, sizeof(struct node));
+    if (!n)
+        fatal("out of memory");
+    n->function = function;
+    n->parent = parent;
+    n->sibling = parent->child;
+    parent->child = n;
+    return n;
+}
+
+static void write_path(FILE* fp, struct node* n)
+{
+    if (n->parent)
+    {
+        write_path(fp, n->parent);
+        fputc(';', fp);
+    }
+    print_function(fp, n->function);
+}
+
+static void write_stacks(FILE* fp, struct node* n)
+{
+    if (n->count)
+    {
+        write_path(fp, n);
+        fprintf(fp, " %llu\n", (unsigned long long)n->count);
+    }
+
+    for (struct node* c = n->child; c; c = c->sibling)
+        write_stacks(fp, c);
+}
+
+static int compare_pcs(const void* p1, const void* p2)
+{
+    uint64_t c1 = pc_counts[*(const uint16_t*)p1];
+    uint64_t c2 = pc_counts[*(const uint16_t*)p2];
+    return (c1 < c2) - (c1 > c2);
+}
+
+static void write_profile(void)
+{
+    FILE* fp = fopen(profile_filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "cannot write profile to '%s'\n", profile_filename);
+        return;
+    }
+    write_stacks(fp, &root);
+    fclose(fp);
+
+    char pcfilename[strlen(profile_filename) + 4];
+    sprintf(pcfilename, "%s.pc", profile_filename);
+    fp = fopen(pcfilename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "cannot write profile to '%s'\n", pcfilename);
+        return;
+    }
+
+    static uint16_t pcs[0x10000];
+    int count = 0;
+    for (int pc = 0; pc < 0x10000; pc++)
+    {
+        if (pc_counts[pc])
+            pcs[count++] = pc;
+    }
+    qsort(pcs, count, sizeof(*pcs), compare_pcs);
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(fp,
+            "%04x %12llu ",
+            pcs[i],
+            (unsigned long long)pc_counts[pcs[i]]);
+        print_address(fp, pcs[i]);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+void profile_init(const char* filename)
+{
+    profiling = true;
+    profile_filename = filename;
+    atexit(write_profile);
+}
+
+/* Called before every instruction executed while profiling. */
+
+void profile_instruction(void)
+{
+    uint16_t pc = ctx->cpu->registers->pc;
+    uint8_t sp = ctx->cpu->registers->s;
+
+    if (!root.function)
+        root.function = pc;
+
+    /* Pop any frames whose return address has been removed from the stack. */
+
+    while (stack_depth && (sp > stack[stack_depth - 1].sp))
+        stack_depth--;
+
+    if (after_jsr && (sp == (uint8_t)(jsr_sp - 2)) &&
+        (stack_depth < sizeof(stack) / sizeof(*stack)))
+    {
+        struct node* parent =
+            stack_depth ? stack[stack_depth - 1].node : &root;
+        struct frame* f = &stack[stack_depth++];
+        f->node = find_child(parent, pc);
+        f->sp = sp;
+    }
+
+    after_jsr = (ctx->ram[pc] == 0x20);
+    jsr_sp = sp;
+
+    pc_counts[pc]++;
+    (stack_depth ? stack[stack_depth - 1].node : &root)->count++;
+}
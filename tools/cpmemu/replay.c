@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "globals.h"
+
+/* Scripted console input. Keys come from a script rather than the host, and
+ * a key only becomes available once enough emulated cycles have passed, so
+ * console status polls give the same answers on every run and the whole run
+ * is reproducible. A program waiting for a key which isn't due yet skips
+ * ahead to when it is.
+ *
+ * Each line of the script is typed followed by a carriage return; a
+ * backslash at the end of a line suppresses the return. Within a line, \r,
+ * \n, \t, \e, \\ and \xHH are escapes. Lines starting with @ are
+ * directives:
+ *
+ *   @wait CYCLES   the next key is due CYCLES after the previous one
+ *   @pace CYCLES   each key is due CYCLES after the previous one
+ *   @# ...         a comment
+ *   @@...          a line starting with a literal @
+ *
+ * After the last key, console status polls report no key pending (so that
+ * programs which run until a key is pressed keep running) and reads return
+ * end of file. */
+
+struct key
+{
+    uint8_t c;
+    uint64_t delay; /* cycles after the previous key */
+};
+
+struct replay
+{
+    struct key* keys;
+    int count;
+    int max_keys;
+    int next;
+    uint64_t last; /* cycle count when the previous key was read */
+};
+
+static void add_key(struct replay* r, uint8_t c, uint64_t delay)
+{
+    if (r->count == r->max_keys)
+    {
+        r->max_keys = r->max_keys ? (r->max_keys * 2) : 256;
+        r->keys = realloc(r->keys, r->max_keys * sizeof(struct key));
+        if (!r->keys)
+            fatal("out of memory");
+    }
+    r->keys[r->count].c = c;
+    r->keys[r->count].delay = delay;
+    r->count++;
+}
+
+static int hexdigit(char c)
+{
+    if (isdigit(c))
+        return c - '0';
+    if (isxdigit(c))
+        return toupper(c) - 'A' + 10;
+    return -1;
+}
+
+void replay_load(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (!fp)
+        fatal("cannot open input script '%s': %s", filename, strerror(errno));
+
+    struct replay* r = calloc(1, sizeof(struct replay));
+    if (!r)
+        fatal("out of memory");
+
+    uint64_t pace = 0;
+    uint64_t wait = 0;
+    char* line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline(&line, &len, fp) != -1)
+    {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        const char* p = line;
+        if (p[0] == '@')
+        {
+            p++;
+            if (*p == '#')
+                continue;
+            else if (!strncmp(p, "wait ", 5))
+            {
+                wait = strtoull(p + 5, NULL, 0);
+                continue;
+            }
+            else if (!strncmp(p, "pace ", 5))
+            {
+                pace = strtoull(p + 5, NULL, 0);
+                continue;
+            }
+            else if (*p != '@')
+                fatal("%s:%d: unknown directive", filename, lineno);
+        }
+
+        bool newline = true;
+        while (*p)
+        {
+            uint8_t c = *p++;
+            if (c == '\\')
+            {
+                c = *p++;
+                switch (c)
+                {
+                    case '\0':
+                        newline = false;
+                        p--;
+                        continue;
+
+                    case 'r':
+                    case 'n':
+                        c = '\r';
+                        break;
+
+                    case 't':
+                        c = '\t';
+                        break;
+
+                    case 'e':
+                        c = 27;
+                        break;
+
+                    case 'x':
+                    {
+                        int hi = hexdigit(p[0]);
+                        int lo = (hi == -1) ? -1 : hexdigit(p[1]);
+                        if (lo == -1)
+                            fatal("%s:%d: bad \\x escape", filename, lineno);
+                        c = (hi << 4) | lo;
+                        p += 2;
+                        break;
+                    }
+
+                    case '\\':
+                        break;
+
+                    default:
+                        fatal("%s:%d: unknown escape", filename, lineno);
+                }
+            }
+
+            add_key(r, c, pace + wait);
+            wait = 0;
+        }
+
+        if (newline)
+        {
+            add_key(r, '\r', pace + wait);
+            wait = 0;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    ctx->replay = r;
+}
+
+/* Returns true if a key is available. */
+
+bool replay_ready(void)
+{
+    struct replay* r = ctx->replay;
+    if (r->next == r->count)
+        return false;
+    return ctx->cpu->cycles >= r->last + r->keys[r->next].delay;
+}
+
+/* Returns the next key, skipping ahead in time if it isn't due yet, or -1 at
+ * the end of the script. */
+
+int replay_getc(void)
+{
+    struct replay* r = ctx->replay;
+    if (r->next == r->count)
+        return -1;
+
+    struct key* k = &r->keys[r->next++];
+    uint64_t due = r->last + k->delay;
+    if (ctx->cpu->cycles < due)
+        ctx->cpu->cycles = due;
+    r->last = ctx->cpu->cycles;
+    return k->c;
+}
+
+void replay_free(void)
+{
+    free(ctx->replay->keys);
+    free(ctx->replay);
+    ctx->replay = NULL;
+}
@@ -38,9 +38,9 @@ void screen_entry(uint8_t op)
             return;
 
         case 1: /* SCREEN_GETSIZE */
-            cpu->registers->a = 79;
-            cpu->registers->x = 24;
-            cpu->registers->p &= ~0x01;
+            ctx->cpu->registers->a = 79;
+            ctx->cpu->registers->x = 24;
+            ctx->cpu->registers->p &= ~0x01;
             return;
 
         case 2: /* SCREEN_CLEAR */
@@ -50,19 +50,19 @@ void screen_entry(uint8_t op)
         case 3: /* SCREEN_SETCURSOR */
             fprintf(stderr,
                 "screen_setcursor(%d, %d)\n",
-                cpu->registers->a,
-                cpu->registers->x);
+                ctx->cpu->registers->a,
+                ctx->cpu->registers->x);
             return;
 
         case 4: /* SCREEN_GETCURSOR */
             fprintf(stderr, "screen_getcursor()\n");
-            cpu->registers->a = cpu->registers->x = 0;
+            ctx->cpu->registers->a = ctx->cpu->registers->x = 0;
             return;
 
         case 5: /* SCREEN_PUTCHAR */
-            fprintf(stderr, "screen_putchar(%1$d '%1$c')\n", cpu->registers->a);
-            if (!isprint(cpu->registers->a))
-                singlestepping = true;
+            fprintf(stderr, "screen_putchar(%1$d '%1$c')\n", ctx->cpu->registers->a);
+            if (!isprint(ctx->cpu->registers->a))
+                ctx->singlestepping = true;
             return;
 
         case 6: /* SCREEN_PUTSTRING */
@@ -71,7 +71,7 @@ void screen_entry(uint8_t op)
             uint16_t xa = get_xa();
             for (;;)
             {
-                uint8_t c = ram[xa++];
+                uint8_t c = ctx->ram[xa++];
                 if (!c)
                     break;
                 putchar(c);
@@ -82,10 +82,20 @@ void screen_entry(uint8_t op)
 
         case 7: /* SCREEN_GETCHAR */
             fprintf(stderr, "screen_getchar(%d)\n", get_xa());
-            switch_to_raw_mode();
-            read(0, &cpu->registers->a, 1);
-            switch_to_cooked_mode();
-            cpu->registers->p &= ~0x01;
+            snapshot_before_input();
+            console_flush();
+            if (ctx->replay)
+            {
+                int c = replay_getc();
+                ctx->cpu->registers->a = (c == -1) ? 0 : c;
+            }
+            else
+            {
+                switch_to_raw_mode();
+                SYSCALL(read(ctx->console_in, &ctx->cpu->registers->a, 1));
+                switch_to_cooked_mode();
+            }
+            ctx->cpu->registers->p &= ~0x01;
             return;
 
         case 8: /* SCREEN_SHOWCURSOR */
@@ -105,7 +115,7 @@ void screen_entry(uint8_t op)
             return;
 
         case 12: /* SCREEN_SETSTYLE */
-            fprintf(stderr, "screen_setstyle(0x%02x)\n", cpu->registers->a);
+            fprintf(stderr, "screen_setstyle(0x%02x)\n", ctx->cpu->registers->a);
             return;
     }
 
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "globals.h"
+
+/* A resident job server. It listens on a Unix socket and runs each request
+ * as a job (see jobs.c) on a pool of threads; as program images are cached
+ * across jobs, running the same tool repeatedly only pays for loading it
+ * once.
+ *
+ * A request is a sequence of NUL-terminated strings: the client's working
+ * directory, then the words of a job line, then an empty string. The reply
+ * is the job's exit code as a 32-bit integer in host order, followed by its
+ * console output up to EOF. */
+
+#define MAX_REQUEST 65536
+
+static int listen_fd;
+
+static bool write_all(int fd, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Reads a request and splits it into words; the first word is the working
+ * directory. Returns NULL if the request is malformed. */
+
+static char** read_request(int fd, char* buffer)
+{
+    size_t len = 0;
+    for (;;)
+    {
+        if (len == MAX_REQUEST)
+            return NULL;
+        ssize_t n = read(fd, buffer + len, MAX_REQUEST - len);
+        if (n <= 0)
+            return NULL;
+        len += n;
+
+        /* The request ends with an empty string, i.e. two NULs in a row
+         * (the working directory is never empty). */
+
+        if ((len >= 2) && !buffer[len - 1] && !buffer[len - 2])
+            break;
+    }
+
+    int count = 0;
+    char** words = NULL;
+    for (char* p = buffer; *p; p += strlen(p) + 1)
+    {
+        words = realloc(words, (count + 2) * sizeof(char*));
+        if (!words)
+            fatal("out of memory");
+        words[count++] = p;
+    }
+    if (words)
+        words[count] = NULL;
+    return words;
+}
+
+static void serve(int fd)
+{
+    static _Thread_local char buffer[MAX_REQUEST];
+    char** words = read_request(fd, buffer);
+    if (!words)
+        return;
+
+    const char* error = "empty request";
+    struct job* j = words[1] ? job_parse(&words[1], words[0], &error) : NULL;
+    free(words);
+    if (!j)
+    {
+        int32_t exitcode = 1;
+        char message[128];
+        snprintf(message, sizeof(message), "cpmemu: %s\n", error);
+        if (write_all(fd, &exitcode, sizeof(exitcode)))
+            write_all(fd, message, strlen(message));
+        return;
+    }
+
+    FILE* capture = tmpfile();
+    if (!capture)
+        fatal("cannot create capture file: %s", strerror(errno));
+
+    int32_t exitcode = job_run(j, fileno(capture));
+    if (write_all(fd, &exitcode, sizeof(exitcode)))
+        copy_output(fileno(capture), fd);
+
+    fclose(capture);
+    job_free(j);
+}
+
+static void* worker(void* arg)
+{
+    for (;;)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fatal("cannot accept connection: %s", strerror(errno));
+        }
+
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void make_address(struct sockaddr_un* sa, const char* path)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path))
+        fatal("socket path '%s' is too long", path);
+    strcpy(sa->sun_path, path);
+}
+
+/* Never returns. */
+
+void run_server(const char* path, int threads)
+{
+    struct sockaddr_un sa;
+    make_address(&sa, path);
+
+    /* A client going away mid-reply must not kill the server. */
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+        fatal("cannot create socket: %s", strerror(errno));
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+        fatal("cannot bind to '%s': %s", path, strerror(errno));
+    if (listen(listen_fd, SOMAXCONN) == -1)
+        fatal("cannot listen on '%s': %s", path, strerror(errno));
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+            fatal("cannot create thread");
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    exit(0);
+}
+
+/* Sends a job to the server at path, copies its console output to stdout,
+ * and returns its exit code. */
+
+int run_client(const char* path, char* const* words)
+{
+    struct sockaddr_un sa;
+    make_address(&sa, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        fatal("cannot create socket: %s", strerror(errno));
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+        fatal("cannot connect to '%s': %s", path, strerror(errno));
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        fatal("cannot get current directory: %s", strerror(errno));
+    if (!write_all(fd, cwd, strlen(cwd) + 1))
+        fatal("cannot send request: %s", strerror(errno));
+    for (; *words; words++)
+    {
+        if (!**words)
+            continue;
+        if (!write_all(fd, *words, strlen(*words) + 1))
+            fatal("cannot send request: %s", strerror(errno));
+    }
+    if (!write_all(fd, "", 1))
+        fatal("cannot send request: %s", strerror(errno));
+
+    int32_t exitcode;
+    size_t len = 0;
+    while (len < sizeof(exitcode))
+    {
+        ssize_t n = read(fd, (uint8_t*)&exitcode + len, sizeof(exitcode) - len);
+        if (n <= 0)
+            fatal("server closed the connection");
+        len += n;
+    }
+
+    char buffer[4096];
+    for (;;)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            break;
+        write_all(1, buffer, n);
+    }
+
+    close(fd);
+    return exitcode;
+}
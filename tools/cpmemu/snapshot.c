@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "globals.h"
+
+/* Machine snapshots: RAM, CPU registers, the BDOS state which lives outside
+ * the guest (DMA address, current drive, top of memory) and the names of
+ * the open files. File contents and drive mappings are not included; the
+ * drives must be mapped the same way when restoring.
+ *
+ * RAM is stored a page at a time, with pages filled with a single value
+ * (which most unused memory is) stored as just that value. All multibyte
+ * values are little-endian. */
+
+#define SNAPSHOT_MAGIC "CPMSNAP"
+#define SNAPSHOT_VERSION 1
+
+#define PAGE_FILLED 0
+#define PAGE_RAW 1
+
+const char* snapshot_on_input = NULL;
+
+static void put(FILE* fp, uint64_t value, int bytes)
+{
+    while (bytes--)
+    {
+        fputc(value & 0xff, fp);
+        value >>= 8;
+    }
+}
+
+static uint64_t get(FILE* fp, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        int c = fgetc(fp);
+        if (c == EOF)
+            fatal("snapshot is truncated");
+        value |= (uint64_t)c << (i * 8);
+    }
+    return value;
+}
+
+static bool page_is_filled(const uint8_t* page)
+{
+    for (int i = 1; i < 0x100; i++)
+    {
+        if (page[i] != page[0])
+            return false;
+    }
+    return true;
+}
+
+void snapshot_save(const char* filename)
+{
+    console_flush();
+    files_flush();
+
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        fatal("cannot write snapshot to '%s': %s", filename, strerror(errno));
+
+    fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), fp);
+    put(fp, SNAPSHOT_VERSION, 4);
+
+    M6502_Registers* r = ctx->cpu->registers;
+    put(fp, r->pc, 2);
+    put(fp, r->a, 1);
+    put(fp, r->x, 1);
+    put(fp, r->y, 1);
+    put(fp, r->p, 1);
+    put(fp, r->s, 1);
+    put(fp, ctx->cpu->cycles, 8);
+
+    put(fp, ctx->dma, 2);
+    put(fp, ctx->current_disk, 1);
+    put(fp, ctx->himem, 2);
+
+    for (int page = 0; page < 0x100; page++)
+    {
+        const uint8_t* p = &ctx->ram[page << 8];
+        if (page_is_filled(p))
+        {
+            put(fp, PAGE_FILLED, 1);
+            put(fp, p[0], 1);
+        }
+        else
+        {
+            put(fp, PAGE_RAW, 1);
+            fwrite(p, 1, 0x100, fp);
+        }
+    }
+
+    files_save(fp);
+
+    if (fclose(fp) != 0)
+        fatal("cannot write snapshot to '%s': %s", filename, strerror(errno));
+}
+
+/* Replaces the state of the current context (which must have been through
+ * emulator_init()) with a snapshot. The guest resumes exactly where it was
+ * saved. */
+
+void snapshot_load(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        fatal("cannot open snapshot '%s': %s", filename, strerror(errno));
+
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    if ((fread(magic, 1, sizeof(magic), fp) != sizeof(magic)) ||
+        (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0))
+        fatal("'%s' is not a snapshot", filename);
+    if (get(fp, 4) != SNAPSHOT_VERSION)
+        fatal("snapshot '%s' is an unsupported version", filename);
+
+    M6502_Registers* r = ctx->cpu->registers;
+    r->pc = get(fp, 2);
+    r->a = get(fp, 1);
+    r->x = get(fp, 1);
+    r->y = get(fp, 1);
+    r->p = get(fp, 1);
+    r->s = get(fp, 1);
+    ctx->cpu->cycles = get(fp, 8);
+
+    ctx->dma = get(fp, 2);
+    ctx->current_disk = get(fp, 1);
+    ctx->himem = get(fp, 2);
+
+    for (int page = 0; page < 0x100; page++)
+    {
+        uint8_t* p = &ctx->ram[page << 8];
+        switch (get(fp, 1))
+        {
+            case PAGE_FILLED:
+                memset(p, get(fp, 1), 0x100);
+                break;
+
+            case PAGE_RAW:
+                if (fread(p, 1, 0x100, fp) != 0x100)
+                    fatal("snapshot is truncated");
+                break;
+
+            default:
+                fatal("snapshot '%s' is corrupt", filename);
+        }
+    }
+
+    files_load(fp);
+    fclose(fp);
+
+    /* The program is already loaded, so the next warm boot ends it. */
+
+    ctx->terminated = true;
+}
+
+/* Called before the guest reads from the console. */
+
+void snapshot_before_input(void)
+{
+    if (snapshot_on_input)
+    {
+        snapshot_save(snapshot_on_input);
+        snapshot_on_input = NULL;
+    }
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "globals.h"
+
+/* Machine-readable statistics, written as JSON when the emulator exits:
+ * instructions executed and the emulated speed, a histogram of opcodes,
+ * BDOS and BIOS calls with the host time spent handling them, bytes moved
+ * per drive, and the deepest the guest stack got. Counting opcodes needs
+ * lib6502's counting interpreter, which is a little slower than the normal
+ * one, so the speed is only comparable between runs which both use this. */
+
+static const char* stats_filename;
+
+static void write_string(FILE* fp, const char* s)
+{
+    fputc('"', fp);
+    for (; *s; s++)
+    {
+        uint8_t c = *s;
+        if ((c == '"') || (c == '\\'))
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void write_calls(FILE* fp,
+    const char* key,
+    const uint64_t* calls,
+    const uint64_t* ns,
+    const uint64_t* syscalls,
+    bool bdos)
+{
+    fprintf(fp, "  \"%s\": [", key);
+    bool first = true;
+    for (int i = 0; i < 256; i++)
+    {
+        if (!calls[i])
+            continue;
+
+        char name[32];
+        if (bdos)
+            bdos_call_name(name, sizeof(name), i);
+        else if (ctx->disks && disk_bios_name(i))
+            snprintf(name, sizeof(name), "%s", disk_bios_name(i));
+        else
+            snprintf(name, sizeof(name), "BIOS_%d", i);
+
+        fprintf(fp,
+            "%s\n    {\"call\": %d, \"name\": \"%s\", \"calls\": %llu, "
+            "\"seconds\": %.9f",
+            first ? "" : ",",
+            i,
+            name,
+            (unsigned long long)calls[i],
+            ns[i] / 1e9);
+        if (syscalls)
+            fprintf(fp,
+                ", \"syscalls\": %llu",
+                (unsigned long long)syscalls[i]);
+        fprintf(fp, "}");
+        first = false;
+    }
+    fprintf(fp, "%s],\n", first ? "" : "\n  ");
+}
+
+static void write_stats(void)
+{
+    if (!ctx)
+        return;
+
+    FILE* fp = fopen(stats_filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "cannot write statistics to '%s'\n", stats_filename);
+        return;
+    }
+
+    uint64_t elapsed = now_ns() - ctx->start_ns;
+    uint64_t busy = (elapsed > ctx->idle_ns) ? (elapsed - ctx->idle_ns) : 1;
+
+    fprintf(fp, "{\n  \"program\": ");
+    if (ctx->user_command_line && ctx->user_command_line[0])
+        write_string(fp, ctx->user_command_line[0]);
+    else
+        fprintf(fp, "null");
+    fprintf(fp, ",\n");
+    fprintf(fp,
+        "  \"instructions\": %llu,\n",
+        (unsigned long long)ctx->instructions);
+    fprintf(fp, "  \"cycles\": %llu,\n", (unsigned long long)ctx->cpu->cycles);
+    fprintf(fp, "  \"host_seconds\": %.9f,\n", elapsed / 1e9);
+    fprintf(fp, "  \"idle_seconds\": %.9f,\n", ctx->idle_ns / 1e9);
+    fprintf(fp, "  \"mips\": %.3f,\n", ctx->instructions * 1e3 / busy);
+    fprintf(fp,
+        "  \"peak_stack_depth\": %d,\n",
+        0xff - ctx->cpu->lowestStack);
+    fprintf(fp, "  \"syscalls\": %llu,\n", (unsigned long long)ctx->syscalls);
+
+    fprintf(fp, "  \"opcodes\": {");
+    bool first = true;
+    for (int i = 0; i < 256; i++)
+    {
+        if (!ctx->opcode_counts[i])
+            continue;
+        fprintf(fp,
+            "%s\n    \"%02x\": %llu",
+            first ? "" : ",",
+            i,
+            (unsigned long long)ctx->opcode_counts[i]);
+        first = false;
+    }
+    fprintf(fp, "%s},\n", first ? "" : "\n  ");
+
+    write_calls(
+        fp, "bdos", ctx->bdos_calls, ctx->bdos_ns, ctx->bdos_syscalls, true);
+    write_calls(fp, "bios", ctx->bios_calls, ctx->bios_ns, NULL, false);
+
+    fprintf(fp, "  \"drives\": [");
+    first = true;
+    for (int i = 0; i < 16; i++)
+    {
+        if (!ctx->drive_bytes_read[i] && !ctx->drive_bytes_written[i])
+            continue;
+        fprintf(fp,
+            "%s\n    {\"drive\": \"%c\", \"bytes_read\": %llu, "
+            "\"bytes_written\": %llu}",
+            first ? "" : ",",
+            'A' + i,
+            (unsigned long long)ctx->drive_bytes_read[i],
+            (unsigned long long)ctx->drive_bytes_written[i]);
+        first = false;
+    }
+    fprintf(fp, "%s]\n}\n", first ? "" : "\n  ");
+
+    fclose(fp);
+}
+
+void stats_init(const char* filename)
+{
+    stats_filename = filename;
+    ctx->cpu->opcodeCounts = ctx->opcode_counts;
+    ctx->cpu->lowestStack = 0xff;
+    atexit(write_stats);
+}
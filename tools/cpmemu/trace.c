@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "globals.h"
+#include "trace.h"
+
+/* Binary instruction tracing into a memory-mapped ring buffer. As the file is
+ * shared with the kernel, the trace survives the emulator crashing. */
+
+#define DEFAULT_RECORDS (1024 * 1024)
+
+bool binary_tracing = false;
+static struct trace_header* header;
+static struct trace_record* records;
+
+/* Takes FILE or FILE,RECORDS. */
+
+void trace_init(const char* spec)
+{
+    char* filename = strdup(spec);
+    uint64_t capacity = DEFAULT_RECORDS;
+    char* comma = strrchr(filename, ',');
+    if (comma)
+    {
+        *comma = '\0';
+        capacity = strtoull(comma + 1, NULL, 0);
+        if (!capacity)
+            fatal("trace buffer must hold at least one record");
+    }
+
+    size_t size =
+        sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        fatal("cannot open trace file '%s': %s", filename, strerror(errno));
+    if (ftruncate(fd, size) == -1)
+        fatal("cannot size trace file '%s': %s", filename, strerror(errno));
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        fatal("cannot map trace file '%s': %s", filename, strerror(errno));
+    close(fd);
+
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(struct trace_record);
+    header->capacity = capacity;
+    header->count = 0;
+    records = (struct trace_record*)(header + 1);
+
+    binary_tracing = true;
+    free(filename);
+}
+
+/* Called before every instruction executed while tracing. */
+
+void trace_instruction(void)
+{
+    M6502_Registers* r = ctx->cpu->registers;
+    struct trace_record* t = &records[header->count % header->capacity];
+
+    t->pc = r->pc;
+    t->bytes[0] = ctx->ram[r->pc];
+    t->bytes[1] = ctx->ram[(uint16_t)(r->pc + 1)];
+    t->bytes[2] = ctx->ram[(uint16_t)(r->pc + 2)];
+    t->a = r->a;
+    t->x = r->x;
+    t->y = r->y;
+    t->p = r->p;
+    t->s = r->s;
+
+    int ea = M6502_effectiveAddress(ctx->cpu, r->pc);
+    t->ea = ea;
+    t->flags = (ea == -1) ? 0 : TRACE_EA;
+
+    header->count++;
+}
@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Binary trace file written by cpmemu -T. The header is followed by a ring
+ * buffer of `capacity` records; record n (counting from zero since the start
+ * of the run) lives in slot n % capacity, and `count` records have been
+ * written in total. All fields are host-endian. */
+
+#define TRACE_MAGIC "CPMTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_EA 0x01 /* ea is valid */
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+struct trace_record
+{
+    uint16_t pc;
+    uint16_t ea; /* effective address of the memory access */
+    uint8_t bytes[3]; /* instruction bytes */
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t s;
+    uint8_t flags;
+    uint8_t padding[3];
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "third_party/lib6502/lib6502.h"
+#include "trace.h"
+
+/* Decodes a binary trace written by cpmemu -T. */
+
+static uint64_t last = 0;
+static int pc_lo = 0;
+static int pc_hi = 0xffff;
+static int ea_filter = -1;
+
+static void syntax(void)
+{
+    printf("tracedump [<flags>] tracefile:\n");
+    printf("  -h             this help\n");
+    printf("  -l NUM         only show the last NUM records\n");
+    printf("  -r LO-HI       only show instructions with PC in LO..HI\n");
+    printf("  -a ADDR        only show instructions which access ADDR\n");
+    exit(1);
+}
+
+static void fatal(const char* message, const char* arg)
+{
+    fprintf(stderr, "fatal: %s%s\n", message, arg);
+    exit(1);
+}
+
+static void show(M6502* mpu, uint64_t n, const struct trace_record* t)
+{
+    M6502_Registers* r = mpu->registers;
+    r->a = t->a;
+    r->x = t->x;
+    r->y = t->y;
+    r->p = t->p;
+    r->s = t->s;
+    r->pc = t->pc;
+    memcpy(&mpu->memory[t->pc], t->bytes, sizeof(t->bytes));
+
+    char buffer[64];
+    M6502_dump(mpu, buffer);
+    printf("%10llu %s\n", (unsigned long long)n, buffer);
+
+    int bytes = M6502_disassemble(mpu, t->pc, buffer);
+    printf("           %04x : ", t->pc);
+    for (int i = 0; i < 3; i++)
+    {
+        if (i < bytes)
+            printf("%02x ", t->bytes[i]);
+        else
+            printf("   ");
+    }
+    printf(": %-16s", buffer);
+    if (t->flags & TRACE_EA)
+        printf(" [%04x]", t->ea);
+    putchar('\n');
+}
+
+int main(int argc, char* const* argv)
+{
+    for (;;)
+    {
+        switch (getopt(argc, argv, "hl:r:a:"))
+        {
+            case -1:
+                goto end_of_flags;
+
+            case 'l':
+                last = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'r':
+            {
+                char* dash;
+                pc_lo = strtoul(optarg, &dash, 16);
+                if (*dash != '-')
+                    syntax();
+                pc_hi = strtoul(dash + 1, NULL, 16);
+                break;
+            }
+
+            case 'a':
+                ea_filter = strtoul(optarg, NULL, 16);
+                break;
+
+            default:
+                syntax();
+        }
+    }
+end_of_flags:
+    if (optind != (argc - 1))
+        syntax();
+
+    const char* filename = argv[optind];
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        fatal("cannot open trace file ", filename);
+
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < sizeof(struct trace_header))
+        fatal("truncated trace file ", filename);
+
+    const struct trace_header* header =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        fatal("cannot map trace file ", filename);
+    close(fd);
+
+    if ((memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != TRACE_VERSION) ||
+        (header->record_size != sizeof(struct trace_record)) ||
+        (st.st_size < sizeof(struct trace_header) +
+                          header->capacity * sizeof(struct trace_record)))
+        fatal("not a valid trace file: ", filename);
+
+    const struct trace_record* records =
+        (const struct trace_record*)(header + 1);
+    uint64_t end = header->count;
+    uint64_t start = (end > header->capacity) ? (end - header->capacity) : 0;
+    if (last && ((end - start) > last))
+        start = end - last;
+
+    M6502* mpu = M6502_new(NULL, NULL, NULL);
+    for (uint64_t n = start; n < end; n++)
+    {
+        const struct trace_record* t = &records[n % header->capacity];
+        if ((t->pc < pc_lo) || (t->pc > pc_hi))
+            continue;
+        if ((ea_filter != -1) &&
+            (!(t->flags & TRACE_EA) || (t->ea != ea_filter)))
+            continue;
+
+        show(mpu, n, t);
+    }
+
+    M6502_delete(mpu);
+    return 0;
+}
@@ -0,0 +1,143 @@
+/* Measures what watchpoints cost the batched interpreter. A small loop which
+ * stores to every byte of a page is run with 0..16 write callbacks installed
+ * on that page, using the same scheme as cpmemu's watchpoints, and then once
+ * more with no callbacks and the block cache on. Finally a CRC-16 of that
+ * page, as more typical code, is timed with and without the block cache. */
+
+#define _POSIX_C_SOURCE 199309
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "third_party/lib6502/lib6502.h"
+
+#define CODE_ADDRESS 0x1000
+#define DATA_ADDRESS 0x2000
+#define INSTRUCTIONS 50000000UL
+
+static uint8_t ram[0x10000];
+static uint16_t watched[16];
+static int numwatched;
+static unsigned long hits;
+
+static int watch_cb(M6502* mpu, uint16_t address, uint8_t data)
+{
+    ram[address] = data;
+    for (int i = 0; i < numwatched; i++)
+    {
+        if (watched[i] == address)
+            hits++;
+    }
+    return data;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const uint8_t fill[] = {
+    0xa2, 0x00,                                   /* LDX #0 */
+    0x9d, DATA_ADDRESS & 0xff, DATA_ADDRESS >> 8, /* STA DATA,X */
+    0xe8,                                         /* INX */
+    0xd0, 0xfa,                                   /* BNE -6 */
+    0x4c, CODE_ADDRESS & 0xff, CODE_ADDRESS >> 8, /* JMP CODE */
+};
+
+/* CRC-16/XMODEM, a bit at a time, with the data pointer at $10 and the CRC
+ * at $12. */
+
+static const uint8_t crc[] = {
+    0xa9, DATA_ADDRESS & 0xff, /* 1000 LDA #<DATA */
+    0x85, 0x10,                /* 1002 STA $10 */
+    0xa9, DATA_ADDRESS >> 8,   /* 1004 LDA #>DATA */
+    0x85, 0x11,                /* 1006 STA $11 */
+    0xa0, 0x00,                /* 1008 LDY #0 */
+    0xb1, 0x10,                /* 100a LDA ($10),Y */
+    0x45, 0x13,                /* 100c EOR $13 */
+    0x85, 0x13,                /* 100e STA $13 */
+    0xa2, 0x08,                /* 1010 LDX #8 */
+    0x06, 0x12,                /* 1012 ASL $12 */
+    0x26, 0x13,                /* 1014 ROL $13 */
+    0x90, 0x0c,                /* 1016 BCC $1024 */
+    0xa5, 0x13,                /* 1018 LDA $13 */
+    0x49, 0x10,                /* 101a EOR #$10 */
+    0x85, 0x13,                /* 101c STA $13 */
+    0xa5, 0x12,                /* 101e LDA $12 */
+    0x49, 0x21,                /* 1020 EOR #$21 */
+    0x85, 0x12,                /* 1022 STA $12 */
+    0xca,                      /* 1024 DEX */
+    0xd0, 0xeb,                /* 1025 BNE $1012 */
+    0xc8,                      /* 1027 INY */
+    0xd0, 0xe0,                /* 1028 BNE $100a */
+    0x4c, CODE_ADDRESS & 0xff, CODE_ADDRESS >> 8, /* 102a JMP CODE */
+};
+
+static double run(M6502* cpu, const uint8_t* code, size_t length)
+{
+    memcpy(&ram[CODE_ADDRESS], code, length);
+    cpu->registers->pc = CODE_ADDRESS;
+
+    double start = now();
+    unsigned long budget = INSTRUCTIONS;
+    while (budget)
+        M6502_runUntil(cpu, NULL, &budget);
+    return now() - start;
+}
+
+int main(int argc, const char* argv[])
+{
+    M6502* cpu = M6502_new(NULL, ram, NULL);
+
+    printf("watchpoints  Minsn/s  slowdown  hits\n");
+    double baseline = 0;
+    for (numwatched = 0; numwatched <= 16;
+         numwatched = numwatched ? numwatched * 2 : 1)
+    {
+        for (int i = 0; i < 0x100; i++)
+            M6502_setCallback(cpu, write, DATA_ADDRESS + i, NULL);
+        for (int i = 0; i < numwatched; i++)
+        {
+            watched[i] = DATA_ADDRESS + i * (0x100 / 16);
+            M6502_setCallback(cpu, write, watched[i], watch_cb);
+        }
+
+        hits = 0;
+        double elapsed = run(cpu, fill, sizeof(fill));
+        if (!numwatched)
+            baseline = elapsed;
+        printf("%11d  %7.1f  %7.2fx  %lu\n",
+            numwatched,
+            INSTRUCTIONS / elapsed / 1e6,
+            elapsed / baseline,
+            hits);
+    }
+
+    for (int i = 0; i < 0x100; i++)
+        M6502_setCallback(cpu, write, DATA_ADDRESS + i, NULL);
+    M6502_setBlockCache(cpu, 1);
+    double elapsed = run(cpu, fill, sizeof(fill));
+    printf("block cache  %7.1f  %7.2fx\n",
+        INSTRUCTIONS / elapsed / 1e6,
+        elapsed / baseline);
+
+    srand(1);
+    for (int i = 0; i < 0x100; i++)
+        ram[DATA_ADDRESS + i] = rand();
+    M6502_setBlockCache(cpu, 0);
+    baseline = run(cpu, crc, sizeof(crc));
+    M6502_setBlockCache(cpu, 1);
+    elapsed = run(cpu, crc, sizeof(crc));
+    printf("\ncrc16        Minsn/s  speedup\n");
+    printf("interpreter  %7.1f\n", INSTRUCTIONS / baseline / 1e6);
+    printf("block cache  %7.1f  %7.2fx\n",
+        INSTRUCTIONS / elapsed / 1e6,
+        baseline / elapsed);
+
+    M6502_delete(cpu);
+    return 0;
+}
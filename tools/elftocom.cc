@@ -0,0 +1,400 @@
+/* Creates a relocatable CP/M-65 .com file from a single ELF executable linked
+ * with --emit-relocs. Rather than diffing several images linked at different
+ * addresses, as multilink does, the fixups are read straight out of the ELF's
+ * relocation sections.
+ *
+ * The program must be linked with its zero page variables based at 0 and its
+ * code at the start of a page, and must begin with the usual .com header (see
+ * doc/NOTES.md). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <fmt/format.h>
+#include <gelf.h>
+
+#ifndef EM_MOS
+#define EM_MOS 6502
+#endif
+
+/* The subset of llvm-mos's relocation types we understand. */
+
+#define R_MOS_NONE 0
+#define R_MOS_IMM8 1
+#define R_MOS_ADDR8 2
+#define R_MOS_ADDR16 3
+#define R_MOS_ADDR16_LO 4
+#define R_MOS_ADDR16_HI 5
+#define R_MOS_PCREL_8 6
+#define R_MOS_PCREL_16 12
+#define R_MOS_FK_DATA_4 13
+#define R_MOS_FK_DATA_8 14
+#define R_MOS_IMAG8 16
+
+#define COMHDR_ZP_RELV2 0x80 /* zero page usage flag for version 2 data */
+
+static std::string inputfilename;
+static std::string outputfilename;
+static bool verbose = false;
+static bool relocationsV2 = false;
+
+template <typename... T>
+void error(fmt::format_string<T...> fmt, T&&... args)
+{
+    fmt::print(stderr, "elftocom: ");
+    fmt::print(stderr, fmt, std::forward<T>(args)...);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void syntaxError()
+{
+    fmt::print(stderr,
+        "Usage: elftocom [-2] [-v] -r <elf> -w <com>\n"
+        "  -2    write version 2 relocations\n"
+        "  -v    list the fixups\n");
+    exit(1);
+}
+
+static void parseArgs(int argc, char* argv[])
+{
+    for (;;)
+    {
+        switch (getopt(argc, argv, "r:w:2v"))
+        {
+            case -1:
+                if (inputfilename.empty() || outputfilename.empty())
+                    syntaxError();
+                return;
+
+            case 'r':
+                inputfilename = optarg;
+                break;
+
+            case 'w':
+                outputfilename = optarg;
+                break;
+
+            case '2':
+                relocationsV2 = true;
+                break;
+
+            case 'v':
+                verbose = true;
+                break;
+
+            default:
+                syntaxError();
+        }
+    }
+}
+
+static void ppread(int fd, uint8_t* buffer, size_t count, off_t offset)
+{
+    while (count)
+    {
+        ssize_t i = pread(fd, buffer, count, offset);
+        if (i == -1)
+            error("cannot read {}: {}", inputfilename, strerror(errno));
+        if (i == 0)
+            error("{} is truncated", inputfilename);
+
+        buffer += i;
+        offset += i;
+        count -= i;
+    }
+}
+
+static std::vector<uint8_t> toBytestream(const std::set<uint16_t>& fixups)
+{
+    std::vector<uint8_t> bytes;
+    uint16_t pos = 0;
+
+    for (uint16_t fixup : fixups)
+    {
+        uint16_t delta = fixup - pos;
+        while (delta >= 0xe)
+        {
+            bytes.push_back(0xe);
+            delta -= 0xe;
+        }
+        bytes.push_back(delta);
+
+        pos = fixup;
+    }
+    bytes.push_back(0xf);
+
+    std::vector<uint8_t> results;
+    for (int i = 0; i < bytes.size(); i += 2)
+    {
+        uint8_t left = bytes[i];
+        uint8_t right = ((i + 1) < bytes.size()) ? bytes[i + 1] : 0x00;
+        results.push_back((left << 4) | right);
+    }
+    return results;
+}
+
+static std::vector<uint8_t> toBytestreamV2(const std::set<uint16_t>& fixups)
+{
+    std::vector<uint8_t> results;
+    unsigned page = 0;
+
+    auto i = fixups.begin();
+    while (i != fixups.end())
+    {
+        unsigned groupPage = *i >> 8;
+        unsigned count = 0;
+        auto j = i;
+        while ((j != fixups.end()) && ((*j >> 8) == groupPage) &&
+               (count < 0xff))
+        {
+            j++;
+            count++;
+        }
+
+        if ((groupPage - page) >= 0xff)
+            error("image too big for version 2 relocations");
+        results.push_back(groupPage - page);
+        results.push_back(count);
+        for (; i != j; i++)
+            results.push_back(*i & 0xff);
+
+        page = groupPage;
+    }
+    results.push_back(0xff);
+    return results;
+}
+
+int main(int argc, char* argv[])
+{
+    parseArgs(argc, argv);
+
+    elf_version(EV_CURRENT);
+    int fd = open(inputfilename.c_str(), O_RDONLY);
+    if (fd == -1)
+        error("cannot open {}: {}", inputfilename, strerror(errno));
+    Elf* e = elf_begin(fd, ELF_C_READ, nullptr);
+    GElf_Ehdr ehdr;
+    if (!e || !gelf_getehdr(e, &ehdr))
+        error("{} is not an ELF file: {}", inputfilename, elf_errmsg(-1));
+    if (ehdr.e_machine != EM_MOS)
+        error("{} is not a 6502 program", inputfilename);
+    if (ehdr.e_type != ET_EXEC)
+        error("{} is not a linked executable", inputfilename);
+
+    /* Assemble the image from the loadable segments. The zero page variables
+     * are never initialised, so won't have any file contents. */
+
+    size_t phdrs;
+    elf_getphdrnum(e, &phdrs);
+    unsigned base = 0x10000;
+    unsigned end = 0;
+    for (int i = 0; i < phdrs; i++)
+    {
+        GElf_Phdr phdr = {};
+        gelf_getphdr(e, i, &phdr);
+        if ((phdr.p_type != PT_LOAD) || !phdr.p_filesz)
+            continue;
+
+        base = std::min<unsigned>(base, phdr.p_vaddr);
+        end = std::max<unsigned>(end, phdr.p_vaddr + phdr.p_filesz);
+    }
+    if (end <= base)
+        error("{} has nothing to load", inputfilename);
+    if ((base & 0xff) || (base < 0x100) || (end > 0x10000))
+        error("{} must be linked at the start of a page above zero page, not "
+              "{:04x}",
+            inputfilename,
+            base);
+
+    std::vector<uint8_t> image(end - base);
+    for (int i = 0; i < phdrs; i++)
+    {
+        GElf_Phdr phdr = {};
+        gelf_getphdr(e, i, &phdr);
+        if ((phdr.p_type != PT_LOAD) || !phdr.p_filesz)
+            continue;
+
+        ppread(fd,
+            &image[phdr.p_vaddr - base],
+            phdr.p_filesz,
+            phdr.p_offset);
+    }
+
+    /* The relocation data goes where the header says the BSS starts. */
+
+    if (image.size() < 8)
+        error("{} is too small to have a header", inputfilename);
+    unsigned relOffset = (image[2] | (image[3] << 8)) - base;
+    if (relOffset > (0x10000 - base))
+        error("{} has a relocation offset outside the program", inputfilename);
+    if (relOffset < image.size())
+        error("{} has data at {:04x}, past its relocation offset of {:04x}",
+            inputfilename,
+            image.size() + base,
+            relOffset + base);
+    image.resize(relOffset);
+
+    /* Collect the fixups from the relocation sections which apply to
+     * loaded code and data. */
+
+    std::set<uint16_t> zpFixups;
+    std::set<uint16_t> memFixups;
+
+    /* The relocation offset at address 2 always needs relocating. */
+
+    memFixups.insert(3);
+
+    Elf_Scn* scn = nullptr;
+    while ((scn = elf_nextscn(e, scn)))
+    {
+        GElf_Shdr shdr;
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_type == SHT_REL)
+            error("{} uses REL relocations, not RELA", inputfilename);
+        if (shdr.sh_type != SHT_RELA)
+            continue;
+
+        GElf_Shdr targetShdr;
+        gelf_getshdr(elf_getscn(e, shdr.sh_info), &targetShdr);
+        if (!(targetShdr.sh_flags & SHF_ALLOC))
+            continue;
+
+        Elf_Data* relas = elf_getdata(scn, nullptr);
+        Elf_Data* syms = elf_getdata(elf_getscn(e, shdr.sh_link), nullptr);
+        size_t count = shdr.sh_size / shdr.sh_entsize;
+        for (int i = 0; i < count; i++)
+        {
+            GElf_Rela rela;
+            GElf_Sym sym;
+            gelf_getrela(relas, i, &rela);
+            gelf_getsym(syms, GELF_R_SYM(rela.r_info), &sym);
+
+            /* Absolute symbols, such as BIOS entrypoints, stay where they
+             * are; undefined ones are weak, and resolve to zero. */
+
+            if ((sym.st_shndx == SHN_ABS) || (sym.st_shndx == SHN_UNDEF))
+                continue;
+
+            unsigned type = GELF_R_TYPE(rela.r_info);
+            unsigned value = (sym.st_value + rela.r_addend) & 0xffff;
+            unsigned address = rela.r_offset - base;
+            bool zp = value < 0x100;
+            if (!zp && (value < base))
+                error("relocation at {:04x} refers to {:04x}, which is "
+                      "neither in zero page nor the program",
+                    rela.r_offset,
+                    value);
+
+            auto check = [&](unsigned offset, uint8_t expected)
+            {
+                if ((address + offset) >= image.size())
+                    error("relocation at {:04x} is outside the loaded image",
+                        rela.r_offset);
+                if (image[address + offset] != expected)
+                    error("relocation at {:04x} has not been applied",
+                        rela.r_offset);
+            };
+
+            switch (type)
+            {
+                case R_MOS_NONE:
+                case R_MOS_PCREL_8:
+                case R_MOS_PCREL_16:
+                case R_MOS_FK_DATA_4:
+                case R_MOS_FK_DATA_8:
+                    break;
+
+                case R_MOS_IMM8:
+                case R_MOS_ADDR8:
+                case R_MOS_IMAG8:
+                case R_MOS_ADDR16_LO:
+                    check(0, value);
+                    if (zp)
+                        zpFixups.insert(address);
+                    break;
+
+                case R_MOS_ADDR16:
+                    check(0, value);
+                    check(1, value >> 8);
+                    if (zp)
+                        zpFixups.insert(address);
+                    else
+                        memFixups.insert(address + 1);
+                    break;
+
+                case R_MOS_ADDR16_HI:
+                    check(0, value >> 8);
+                    if (!zp)
+                        memFixups.insert(address);
+                    break;
+
+                default:
+                    error("relocation at {:04x} has unsupported type {}",
+                        rela.r_offset,
+                        type);
+            }
+        }
+    }
+
+    for (uint16_t address : zpFixups)
+    {
+        if (memFixups.count(address))
+            error("{:04x} is relocated as both a zero page and a memory "
+                  "address",
+                address + base);
+    }
+
+    /* The code body is the image linked at page zero. */
+
+    for (uint16_t address : memFixups)
+        image[address] -= base >> 8;
+
+    if (relocationsV2)
+    {
+        if (image[0] & COMHDR_ZP_RELV2)
+            error("{} uses too much zero page for version 2 relocations",
+                inputfilename);
+        image[0] |= COMHDR_ZP_RELV2;
+    }
+    auto encode = relocationsV2 ? toBytestreamV2 : toBytestream;
+    auto zpBytes = encode(zpFixups);
+    auto memBytes = encode(memFixups);
+
+    if (verbose)
+    {
+        for (uint16_t address : zpFixups)
+            fmt::print("zp  {:04x}\n", address);
+        for (uint16_t address : memFixups)
+            fmt::print("mem {:04x}\n", address);
+        fmt::print("{} zp and {} mem fixups; {} bytes of relocations\n",
+            zpFixups.size(),
+            memFixups.size(),
+            zpBytes.size() + memBytes.size());
+    }
+
+    /* Patch the TPA byte to include the relocation data. */
+
+    unsigned reloBytesSize = zpBytes.size() + memBytes.size();
+    image[1] = std::max<uint8_t>(
+        image[1], (relOffset + reloBytesSize + 255) / 256);
+
+    image.insert(image.end(), zpBytes.begin(), zpBytes.end());
+    image.insert(image.end(), memBytes.begin(), memBytes.end());
+
+    std::ofstream ofs(outputfilename, std::ofstream::binary);
+    ofs.write((const char*)image.data(), image.size());
+    if (!ofs.flush())
+        error("cannot write {}", outputfilename);
+
+    elf_end(e);
+    close(fd);
+    return 0;
+}
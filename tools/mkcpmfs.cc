@@ -0,0 +1,510 @@
+/* Builds a CP/M 2.2 filesystem image in one go, doing the job of mkfs.cpm,
+ * cpmcp and cpmchattr without spawning a process per file. The geometry comes
+ * from an entry in a cpmtools diskdefs file. The image is either formatted
+ * afresh, optionally with a boot image at the start of the boot tracks, or
+ * is a copy of a template image which already contains a filesystem; files
+ * are then added and the result written once.
+ *
+ * Each file is given as <user>:<name>[@<attributes>]=<filename>, either on
+ * the command line or one per line in a manifest. The attributes are those of
+ * cpmchattr: r (read only), s (system), a (archived), and 1 to 4 (the F1' to
+ * F4' user attributes). */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fmt/format.h>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#define ENTRY_SIZE 32
+#define RECORD_SIZE 128
+#define EXTENT_RECORDS 128 /* in a logical extent */
+#define DELETED 0xe5
+
+/* Fresh images start at least this big, as mkfs.cpm used to leave them. */
+
+#define MINIMUM_IMAGE_SIZE 100000
+
+struct DiskDef
+{
+    unsigned seclen = 0;
+    unsigned tracks = 0;
+    unsigned sectrk = 0;
+    unsigned blocksize = 0;
+    unsigned maxdir = 0;
+    unsigned boottrk = 0;
+};
+
+struct Item
+{
+    unsigned user;
+    uint8_t name[11];
+    std::string attributes;
+    std::string filename;
+};
+
+static std::string diskdefsfilename = "diskdefs";
+static std::string format;
+static std::string outputfilename;
+static std::string templatefilename;
+static std::string bootimagefilename;
+static long imageSize = -1;
+static std::vector<Item> items;
+static bool verbose = false;
+
+template <typename... T>
+void error(fmt::format_string<T...> fmt, T&&... args)
+{
+    fmt::print(stderr, "mkcpmfs: ");
+    fmt::print(stderr, fmt, std::forward<T>(args)...);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static std::vector<uint8_t> readFile(const std::string& filename)
+{
+    std::ifstream is(filename, std::ifstream::binary);
+    if (!is)
+        error("cannot open {}", filename);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(is), {});
+}
+
+static std::string cpmName(const Item& item)
+{
+    std::string s = fmt::format("{}:", item.user);
+    for (int i = 0; i < 11; i++)
+    {
+        if ((i == 8) && (item.name[i] != ' '))
+            s += '.';
+        if (item.name[i] != ' ')
+            s += item.name[i];
+    }
+    return s;
+}
+
+/* Parses <user>:<name>[@<attributes>]=<filename>; the user defaults to 0. */
+
+static Item parseItem(const std::string& spec)
+{
+    Item item = {};
+    size_t equals = spec.find('=');
+    if (equals == std::string::npos)
+        error("'{}' should be <user>:<name>[@<attributes>]=<filename>", spec);
+    item.filename = spec.substr(equals + 1);
+    std::string name = spec.substr(0, equals);
+
+    size_t at = name.find('@');
+    if (at != std::string::npos)
+    {
+        item.attributes = name.substr(at + 1);
+        name = name.substr(0, at);
+        for (char c : item.attributes)
+            if (!strchr("rsa1234", c))
+                error("'{}' has an unknown attribute '{}'", spec, c);
+    }
+
+    size_t colon = name.find(':');
+    if (colon != std::string::npos)
+    {
+        char* end;
+        item.user = strtoul(name.c_str(), &end, 10);
+        if ((end != &name[colon]) || (colon == 0) || (item.user > 15))
+            error("'{}' has a bad user number", spec);
+        name = name.substr(colon + 1);
+    }
+
+    size_t dot = name.find('.');
+    std::string base = name.substr(0, dot);
+    std::string ext =
+        (dot == std::string::npos) ? std::string() : name.substr(dot + 1);
+    if (base.empty() || (base.size() > 8) || (ext.size() > 3))
+        error("'{}' is not a valid CP/M filename", spec);
+
+    memset(item.name, ' ', sizeof(item.name));
+    auto copy = [&](const std::string& s, uint8_t* p)
+    {
+        for (char c : s)
+        {
+            if ((c <= ' ') || (c >= 0x7f) || strchr("<>.,;:=?*[]", c))
+                error("'{}' is not a valid CP/M filename", spec);
+            *p++ = toupper(c);
+        }
+    };
+    copy(base, &item.name[0]);
+    copy(ext, &item.name[8]);
+    return item;
+}
+
+static void readManifest(const std::string& filename)
+{
+    std::ifstream is(filename);
+    if (!is)
+        error("cannot open {}", filename);
+
+    std::string line;
+    while (std::getline(is, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::stringstream ss(line);
+        std::string spec;
+        if (ss >> spec)
+            items.push_back(parseItem(spec));
+    }
+}
+
+/* Reads the named entry from a cpmtools diskdefs file. Only the linear CP/M
+ * 2.2 formats the build uses are supported. */
+
+static DiskDef readDiskDef()
+{
+    std::ifstream is(diskdefsfilename);
+    if (!is)
+        error("cannot open {}", diskdefsfilename);
+
+    DiskDef dd;
+    bool found = false;
+    bool inside = false;
+    int lineno = 0;
+    std::string line;
+    while (std::getline(is, line))
+    {
+        lineno++;
+        std::stringstream ss(line.substr(0, line.find('#')));
+        std::string key, value;
+        if (!(ss >> key))
+            continue;
+        ss >> value;
+
+        if (!inside)
+        {
+            if ((key == "diskdef") && (value == format))
+                inside = found = true;
+            else if (key == "diskdef")
+                inside = true;
+            continue;
+        }
+
+        if (key == "end")
+        {
+            inside = false;
+            if (found)
+                break;
+            continue;
+        }
+        if (!found)
+            continue;
+
+        char* end;
+        unsigned n = strtoul(value.c_str(), &end, 0);
+        bool numeric = !value.empty() && !*end;
+        if (key == "os")
+        {
+            if (value != "2.2")
+                error("{}:{}: only CP/M 2.2 filesystems are supported",
+                    diskdefsfilename,
+                    lineno);
+        }
+        else if (((key == "skew") || (key == "offset")) && numeric && !n)
+            ;
+        else if (!numeric)
+            error("{}:{}: '{}' is not supported", diskdefsfilename, lineno, key);
+        else if (key == "seclen")
+            dd.seclen = n;
+        else if (key == "tracks")
+            dd.tracks = n;
+        else if (key == "sectrk")
+            dd.sectrk = n;
+        else if (key == "blocksize")
+            dd.blocksize = n;
+        else if (key == "maxdir")
+            dd.maxdir = n;
+        else if (key == "boottrk")
+            dd.boottrk = n;
+        else
+            error("{}:{}: '{}' is not supported", diskdefsfilename, lineno, key);
+    }
+
+    if (!found)
+        error("format {} is not in {}", format, diskdefsfilename);
+    if (!dd.seclen || !dd.tracks || !dd.sectrk || !dd.maxdir ||
+        (dd.blocksize < 1024) || (dd.blocksize > 16384) ||
+        (dd.blocksize & (dd.blocksize - 1)) || (dd.boottrk >= dd.tracks))
+        error("format {} has a bad geometry", format);
+
+    /* Disks of more than 256 blocks have 16-bit block pointers, and eight of
+     * those can't fill an extent of 1024-byte blocks. */
+
+    unsigned blocks =
+        ((dd.tracks - dd.boottrk) * dd.sectrk * dd.seclen) / dd.blocksize;
+    if ((blocks > 256) && (dd.blocksize == 1024))
+        error("format {} has more than 256 blocks of 1024 bytes", format);
+    return dd;
+}
+
+static void syntaxError()
+{
+    fmt::print(stderr,
+        "Usage: mkcpmfs [-v] [-d <diskdefs>] -f <format> -o <image>\n"
+        "           [-t <template> | -b <bootimage>] [-s <size>]\n"
+        "           [-m <manifest>] [<user>:<name>[@<attributes>]=<file>...]\n"
+        "  -d    diskdefs file (default: diskdefs)\n"
+        "  -f    diskdefs format to use\n"
+        "  -t    add files to a copy of this image, rather than formatting\n"
+        "  -b    put this at the start of the boot tracks\n"
+        "  -s    truncate or extend the image to this size\n"
+        "  -m    add each file listed in the manifest\n");
+    exit(1);
+}
+
+static void parseArguments(int argc, char* const* argv)
+{
+    for (;;)
+    {
+        switch (getopt(argc, argv, "vd:f:o:t:b:s:m:"))
+        {
+            case -1:
+                for (int i = optind; i < argc; i++)
+                    items.push_back(parseItem(argv[i]));
+                if (format.empty() || outputfilename.empty())
+                    syntaxError();
+                if (!templatefilename.empty() && !bootimagefilename.empty())
+                    syntaxError();
+                return;
+
+            case 'v':
+                verbose = true;
+                break;
+
+            case 'd':
+                diskdefsfilename = optarg;
+                break;
+
+            case 'f':
+                format = optarg;
+                break;
+
+            case 'o':
+                outputfilename = optarg;
+                break;
+
+            case 't':
+                templatefilename = optarg;
+                break;
+
+            case 'b':
+                bootimagefilename = optarg;
+                break;
+
+            case 's':
+                imageSize = strtol(optarg, nullptr, 0);
+                break;
+
+            case 'm':
+                readManifest(optarg);
+                break;
+
+            default:
+                syntaxError();
+        }
+    }
+}
+
+int main(int argc, char* const* argv)
+{
+    parseArguments(argc, argv);
+    DiskDef dd = readDiskDef();
+
+    unsigned bootSize = dd.boottrk * dd.sectrk * dd.seclen;
+    unsigned blocks =
+        ((dd.tracks - dd.boottrk) * dd.sectrk * dd.seclen) / dd.blocksize;
+    bool bigDisk = blocks > 256;
+    unsigned pointers = bigDisk ? 8 : 16;
+    unsigned extentMask = (dd.blocksize * pointers) / 16384 - 1;
+    unsigned entryRecords = EXTENT_RECORDS * (extentMask + 1);
+    unsigned dirBlocks = (dd.maxdir * ENTRY_SIZE + dd.blocksize - 1) /
+                         dd.blocksize;
+    if (dirBlocks >= blocks)
+        error("format {} has no room for any files", format);
+
+    std::vector<uint8_t> image;
+    auto at = [&](unsigned offset) -> uint8_t*
+    {
+        if (image.size() < offset + 1)
+            image.resize(offset + 1, DELETED);
+        return &image[offset];
+    };
+    auto entry = [&](unsigned i)
+    {
+        at(bootSize + (i + 1) * ENTRY_SIZE - 1);
+        return &image[bootSize + i * ENTRY_SIZE];
+    };
+
+    if (!templatefilename.empty())
+        image = readFile(templatefilename);
+    else
+    {
+        /* Format: the boot image, with the rest of the boot tracks and the
+         * directory erased. */
+
+        image.assign(std::max<unsigned>(MINIMUM_IMAGE_SIZE,
+                         bootSize + dirBlocks * dd.blocksize),
+            DELETED);
+        if (!bootimagefilename.empty())
+        {
+            auto boot = readFile(bootimagefilename);
+            if (boot.size() > bootSize)
+                error("{} is {} bytes, but the boot tracks only hold {}",
+                    bootimagefilename,
+                    boot.size(),
+                    bootSize);
+            std::copy(boot.begin(), boot.end(), image.begin());
+        }
+    }
+
+    /* Find the blocks and names already in use. */
+
+    std::vector<bool> used(blocks);
+    std::fill(used.begin(), used.begin() + dirBlocks, true);
+    std::set<std::string> names;
+    for (unsigned i = 0; i < dd.maxdir; i++)
+    {
+        uint8_t* de = entry(i);
+        if (de[0] > 15)
+            continue;
+
+        std::string name(1, de[0]);
+        for (int j = 1; j < 12; j++)
+            name += de[j] & 0x7f;
+        names.insert(name);
+
+        for (unsigned j = 0; j < pointers; j++)
+        {
+            unsigned block =
+                bigDisk ? (de[16 + j * 2] | (de[17 + j * 2] << 8)) : de[16 + j];
+            if (block >= blocks)
+                error("directory entry {} refers to block {}, past the end of "
+                      "the disk",
+                    i,
+                    block);
+            if (block)
+                used[block] = true;
+        }
+    }
+
+    /* Add the files. */
+
+    unsigned nextBlock = 0;
+    unsigned nextEntry = 0;
+    for (const auto& item : items)
+    {
+        std::string name(1, item.user);
+        name.append((const char*)item.name, 11);
+        if (!names.insert(name).second)
+            error("{} is on the disk twice", cpmName(item));
+
+        auto data = readFile(item.filename);
+        unsigned records = (data.size() + RECORD_SIZE - 1) / RECORD_SIZE;
+        data.resize(records * RECORD_SIZE, 0x1a);
+
+        unsigned blockRecords = dd.blocksize / RECORD_SIZE;
+        std::vector<unsigned> fileBlocks;
+        for (unsigned r = 0; r < records; r += blockRecords)
+        {
+            while ((nextBlock < blocks) && used[nextBlock])
+                nextBlock++;
+            if (nextBlock == blocks)
+                error("disk full writing {}", item.filename);
+            used[nextBlock] = true;
+            fileBlocks.push_back(nextBlock);
+
+            unsigned offset = bootSize + nextBlock * dd.blocksize;
+            unsigned len = std::min(blockRecords, records - r) * RECORD_SIZE;
+            at(offset + len - 1);
+            std::copy(&data[r * RECORD_SIZE],
+                &data[r * RECORD_SIZE] + len,
+                &image[offset]);
+        }
+
+        /* Write the directory entries; an empty file still gets one. */
+
+        unsigned entries = std::max<unsigned>(
+            1, (fileBlocks.size() + pointers - 1) / pointers);
+        for (unsigned e = 0; e < entries; e++)
+        {
+            while ((nextEntry < dd.maxdir) && (*entry(nextEntry) != DELETED))
+                nextEntry++;
+            if (nextEntry == dd.maxdir)
+                error("directory full writing {}", item.filename);
+            uint8_t* de = entry(nextEntry);
+            memset(de, 0, ENTRY_SIZE);
+
+            de[0] = item.user;
+            memcpy(&de[1], item.name, 11);
+            for (char c : item.attributes)
+            {
+                switch (c)
+                {
+                    case 'r':
+                        de[9] |= 0x80;
+                        break;
+                    case 's':
+                        de[10] |= 0x80;
+                        break;
+                    case 'a':
+                        de[11] |= 0x80;
+                        break;
+                    default:
+                        de[c - '0'] |= 0x80;
+                        break;
+                }
+            }
+
+            /* EX and S2 hold the number of the last logical extent in this
+             * entry, and RC the number of records in it. */
+
+            unsigned n = std::min(entryRecords, records - e * entryRecords);
+            unsigned extent = e * (extentMask + 1);
+            if (n)
+                extent += (n - 1) / EXTENT_RECORDS;
+            de[12] = extent & 0x1f;
+            de[14] = extent >> 5;
+            de[15] = n ? (n - (((n - 1) / EXTENT_RECORDS) * EXTENT_RECORDS))
+                       : 0;
+
+            for (unsigned j = 0; j < pointers; j++)
+            {
+                unsigned b = e * pointers + j;
+                if (b >= fileBlocks.size())
+                    break;
+                if (bigDisk)
+                {
+                    de[16 + j * 2] = fileBlocks[b];
+                    de[17 + j * 2] = fileBlocks[b] >> 8;
+                }
+                else
+                    de[16 + j] = fileBlocks[b];
+            }
+        }
+
+        if (verbose)
+            fmt::print("{}: {} records, blocks {}-{}\n",
+                cpmName(item),
+                records,
+                fileBlocks.empty() ? 0 : fileBlocks.front(),
+                fileBlocks.empty() ? 0 : fileBlocks.back());
+    }
+
+    if (imageSize != -1)
+        image.resize(imageSize, 0);
+
+    std::ofstream os(outputfilename, std::ofstream::binary);
+    os.write((const char*)image.data(), image.size());
+    if (!os.flush())
+        error("cannot write {}", outputfilename);
+    return 0;
+}
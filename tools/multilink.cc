@@ -6,18 +6,37 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fmt/format.h>
 #include <filesystem>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <string.h>
 
-static std::string outfilename;
-static std::string corefilename;
-static std::string zpfilename;
-static std::string memfilename;
+/* Set in the zero page usage byte of programs with version 2 relocations. */
+#define COMHDR_ZP_RELV2 0x80
+
+struct Job
+{
+    std::string corefilename;
+    std::string zpfilename;
+    std::string memfilename;
+    std::string outfilename;
+};
+
+static Job job;
+static std::string batchfilename;
+static unsigned threads = 0;
 static bool verbose = false;
+static bool relocationsV2 = false;
+static bool verify = false;
+
+#define VERIFY_PLACEMENTS 16
 
 template <typename... T>
 void error(fmt::format_string<T...> fmt, T&&... args)
@@ -27,29 +46,50 @@ void error(fmt::format_string<T...> fmt, T&&... args)
     exit(1);
 }
 
-std::pair<std::vector<uint16_t>, uint8_t> compare(
-    const std::string& f1, const std::string& f2)
+static std::vector<uint8_t> readFile(const std::string& filename)
 {
-    if (std::filesystem::file_size(f1) != std::filesystem::file_size(f2))
+    std::ifstream is(filename, std::ifstream::binary);
+    if (!is)
+        error("cannot open {}", filename);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(is), {});
+}
+
+/* Returns the offsets at which two images differ, and the largest differing
+ * byte of the first. Identical stretches are skipped a word at a time. */
+
+std::pair<std::vector<uint16_t>, uint8_t> compare(const std::vector<uint8_t>& d1,
+    const std::string& f1,
+    const std::vector<uint8_t>& d2,
+    const std::string& f2)
+{
+    if (d1.size() != d2.size())
         error("files {} and {} are not the same size!", f1, f2);
 
     std::vector<uint16_t> results;
-    std::ifstream s1(f1);
-    std::ifstream s2(f2);
-
-    unsigned pos = 0;
     uint8_t max = 0;
-    while (!s1.eof())
+    size_t size = d1.size();
+    size_t pos = 0;
+    while (pos < size)
     {
-        uint8_t b1 = s1.get();
-        uint8_t b2 = s2.get();
+        while ((pos + 8) <= size)
+        {
+            uint64_t w1, w2;
+            memcpy(&w1, &d1[pos], 8);
+            memcpy(&w2, &d2[pos], 8);
+            if (w1 != w2)
+                break;
+            pos += 8;
+        }
 
-        if (b1 != b2)
+        size_t end = std::min(pos + 8, size);
+        for (; pos < end; pos++)
         {
-            results.push_back(pos);
-            max = std::max(max, b1);
+            if (d1[pos] != d2[pos])
+            {
+                results.push_back(pos);
+                max = std::max(max, d1[pos]);
+            }
         }
-        pos++;
     }
 
     return std::make_pair(results, max);
@@ -84,6 +124,36 @@ std::vector<uint8_t> toBytestream(const std::vector<uint16_t>& differences)
     return results;
 }
 
+/* Version 2 relocations group the fixups by page: each group is the number of
+ * pages to advance, the number of fixups, and their offsets in the page. */
+
+std::vector<uint8_t> toBytestreamV2(const std::vector<uint16_t>& differences)
+{
+    std::vector<uint8_t> results;
+    unsigned page = 0;
+
+    auto i = differences.begin();
+    while (i != differences.end())
+    {
+        unsigned groupPage = *i >> 8;
+        auto j = i;
+        while ((j != differences.end()) && ((*j >> 8) == groupPage) &&
+               ((j - i) < 0xff))
+            j++;
+
+        if ((groupPage - page) >= 0xff)
+            error("image too big for version 2 relocations");
+        results.push_back(groupPage - page);
+        results.push_back(j - i);
+        for (; i != j; i++)
+            results.push_back(*i & 0xff);
+
+        page = groupPage;
+    }
+    results.push_back(0xff);
+    return results;
+}
+
 void emitw(std::ostream& s, uint16_t w)
 {
     s.put(w & 0xff);
@@ -104,109 +174,378 @@ unsigned roundup(unsigned value)
 static void syntaxError()
 {
     fmt::print(stderr,
-        "Usage: multilink -o <outfile> <corefile> <zpfile> <memfile>\n");
+        "Usage: multilink [-2] [--verify] -o <outfile> <corefile> <zpfile> "
+        "<memfile>\n"
+        "       multilink [-2] [--verify] [-j <threads>] -b <manifest>\n"
+        "  -2        write version 2 relocations\n"
+        "  -b        link each 'core zp mem out' line of the manifest\n"
+        "  -j        number of links to run at once (default: one per CPU)\n"
+        "  --verify  relocate the output to various places, check it against\n"
+        "            the inputs, and report relocation statistics\n");
     exit(1);
 }
 
 static void parseArguments(int argc, char* const* argv)
 {
+    enum
+    {
+        OPT_VERIFY = 256
+    };
+    static const struct option longOptions[] = {
+        {"verify", no_argument, nullptr, OPT_VERIFY},
+        {}
+    };
+
     for (;;)
     {
-        switch (getopt(argc, argv, "vo:"))
+        switch (getopt_long(argc, argv, "vo:2b:j:", longOptions, nullptr))
         {
             case -1:
-                if (!argv[optind + 0] || !argv[optind + 1] || !argv[optind + 2])
+                if (!batchfilename.empty())
+                {
+                    if (argv[optind])
+                        syntaxError();
+                    return;
+                }
+                if (!argv[optind + 0] || !argv[optind + 1] ||
+                    !argv[optind + 2] || job.outfilename.empty())
                     syntaxError();
 
-                corefilename = argv[optind + 0];
-                zpfilename = argv[optind + 1];
-                memfilename = argv[optind + 2];
+                job.corefilename = argv[optind + 0];
+                job.zpfilename = argv[optind + 1];
+                job.memfilename = argv[optind + 2];
                 return;
 
             case 'o':
-                outfilename = optarg;
+                job.outfilename = optarg;
+                break;
+
+            case 'b':
+                batchfilename = optarg;
+                break;
+
+            case 'j':
+                threads = atoi(optarg);
                 break;
 
             case 'v':
                 verbose = true;
                 break;
 
+            case OPT_VERIFY:
+                verify = true;
+                break;
+
+            case '2':
+                relocationsV2 = true;
+                break;
+
             default:
                 syntaxError();
         }
     }
 }
 
-int main(int argc, char* const* argv)
+/* Applies the relocation data of a linked image the way src/lib/relocate.S
+ * does, relocating it to run at the given page with the given zero page base.
+ * Returns an estimate of the 6502 cycles the relocator would take, counted
+ * from its instructions. */
+
+static uint64_t relocate(std::vector<uint8_t>& image, uint8_t page, uint8_t zp)
 {
-    parseArguments(argc, argv);
+    auto byte = [&](unsigned i)
+    {
+        if (i >= image.size())
+            error("relocation data runs off the end of the image");
+        return image[i];
+    };
+    auto fixup = [&](unsigned address, uint8_t addend)
+    {
+        if (address >= image.size())
+            error("relocation at {:04x} is outside the image", address);
+        image[address] += addend;
+    };
+
+    unsigned table = image[2] | (image[3] << 8);
+    uint64_t cycles = 56; /* finding the table */
+    if (image[0] & COMHDR_ZP_RELV2)
+    {
+        unsigned i = table;
+        image[0] &= ~COMHDR_ZP_RELV2;
+        cycles += 49;
+        for (uint8_t addend : {zp, page})
+        {
+            unsigned pageAddress = 0;
+            cycles += 11 + 26; /* setup and terminator */
+            for (;;)
+            {
+                uint8_t skip = byte(i++);
+                if (skip == 0xff)
+                    break;
+                pageAddress += skip << 8;
+
+                uint8_t count = byte(i++);
+                if (!count)
+                    error("empty group in version 2 relocation data");
+                cycles += 80 + (count * 26) - 1;
+                if ((pageAddress >> 8) == (table >> 8))
+                    cycles += 13 + (count * 16); /* checking the offsets */
+                if (((i & 0xff) + count) > 0x100)
+                    cycles += 0x100 - (i & 0xff) + 1; /* lda abs,x crossings */
+                while (count--)
+                {
+                    unsigned address = pageAddress + byte(i++);
+                    if (address >= table)
+                        error("relocation at {:04x} is past the image",
+                            address);
+                    fixup(address, addend);
+                }
+            }
+        }
+    }
+    else
+    {
+        unsigned i = table;
+        cycles += 15;
+        for (uint8_t addend : {zp, page})
+        {
+            unsigned address = 0;
+            cycles += 2;
+            auto nibble = [&](uint8_t n)
+            {
+                if (n == 0xf)
+                {
+                    cycles += 7;
+                    return false;
+                }
+                cycles += 6 + ((n == 0xe) ? 29 : 43);
+                if (((address & 0xff) + n) > 0xff)
+                    cycles += 4; /* carry into ptr+1 */
+                address += n;
+                if (n != 0xe)
+                    fixup(address, addend);
+                return true;
+            };
+
+            for (;;)
+            {
+                cycles += 29;
+                if ((i & 0xff) == 0xff)
+                    cycles += 5; /* carry into reloptr$+1 */
+                uint8_t b = byte(i++);
+                if (!nibble(b >> 4))
+                    break;
+                cycles += 8;
+                if (!nibble(b & 0x0f))
+                    break;
+                cycles += 3;
+            }
+        }
+    }
+    return cycles;
+}
 
-    if (verbose)
+/* Relocates the linked image to a range of places and checks each result
+ * against one extrapolated from the three input images: these were linked
+ * with zero page at 0 and 1 and the TPA at pages 2 and 3. Then prints some
+ * statistics. */
+
+static void verifyImage(const Job& job,
+    const std::vector<uint8_t>& image,
+    size_t codeSize,
+    const std::vector<uint8_t>& core,
+    const std::vector<uint8_t>& zp,
+    const std::vector<uint8_t>& mem,
+    unsigned zpFixups,
+    unsigned memFixups)
+{
+    std::mt19937 random(codeSize);
+    uint64_t cycles = 0;
+    for (int i = 0; i < VERIFY_PLACEMENTS; i++)
     {
-        fmt::print("core file: {}\n", corefilename);
-        fmt::print("zp file:   {}\n", zpfilename);
-        fmt::print("mem file:  {}\n", memfilename);
+        /* Always try the edges of the address spaces. */
+
+        uint8_t pageBase = (i == 0) ? 2 : (i == 1) ? 0xff : random();
+        uint8_t zpBase = (i == 0) ? 0 : (i == 1) ? 0xff : random();
+
+        std::vector<uint8_t> relocated = image;
+        uint64_t c = relocate(relocated, pageBase, zpBase);
+        if (i == 0)
+            cycles = c;
+
+        for (size_t pos = 0; pos < codeSize; pos++)
+        {
+            /* The TPA usage byte is patched by us. */
+
+            if (pos == 1)
+                continue;
+
+            uint8_t expected = core[pos] + (zp[pos] - core[pos]) * zpBase +
+                               (mem[pos] - core[pos]) * (pageBase - 2);
+            if (relocated[pos] != expected)
+                error(
+                    "{}: relocating to page {:02x} with zero page at {:02x} "
+                    "gives {:02x} at {:04x}, but the inputs suggest {:02x}",
+                    job.outfilename,
+                    pageBase,
+                    zpBase,
+                    relocated[pos],
+                    pos,
+                    expected);
+        }
     }
 
-    auto coreSize = std::filesystem::file_size(corefilename);
+    size_t tableSize = image.size() - codeSize;
+    double kb = codeSize / 1024.0;
+    fmt::print(
+        "{}: {} zp and {} mem fixups in {} bytes ({:.1f} per KB); "
+        "{} table bytes ({:.1f}%); about {} cycles to relocate "
+        "({:.0f} per KB); verified at {} placements\n",
+        job.outfilename,
+        zpFixups,
+        memFixups,
+        codeSize,
+        (zpFixups + memFixups) / kb,
+        tableSize,
+        tableSize * 100.0 / codeSize,
+        cycles,
+        cycles / kb,
+        VERIFY_PLACEMENTS);
+}
+
+static void link(const Job& job)
+{
+    if (verbose)
+    {
+        fmt::print("core file: {}\n", job.corefilename);
+        fmt::print("zp file:   {}\n", job.zpfilename);
+        fmt::print("mem file:  {}\n", job.memfilename);
+    }
 
-    auto [zpDifferences, zpMax] = compare(corefilename, zpfilename);
-    auto zpBytes = toBytestream(zpDifferences);
-    auto [memDifferences, memMax] = compare(corefilename, memfilename);
-    auto memBytes = toBytestream(memDifferences);
+    auto core = readFile(job.corefilename);
+    auto zp = readFile(job.zpfilename);
+    auto mem = readFile(job.memfilename);
+    auto [zpDifferences, zpMax] =
+        compare(core, job.corefilename, zp, job.zpfilename);
+    auto [memDifferences, memMax] =
+        compare(core, job.corefilename, mem, job.memfilename);
+    auto encode = relocationsV2 ? toBytestreamV2 : toBytestream;
+    auto zpBytes = encode(zpDifferences);
+    auto memBytes = encode(memDifferences);
 
     unsigned reloBytesSize = zpBytes.size() + 1 + memBytes.size();
 
-    std::fstream outs(outfilename,
-        std::fstream::in | std::fstream::out | std::fstream::trunc |
-            std::fstream::binary);
     if (verbose)
         fmt::print("{} code bytes, {} zprelo bytes, {} memrelo bytes\n",
-            coreSize,
+            core.size(),
             zpBytes.size(),
             memBytes.size());
+    if (core.size() < 4)
+        error("{} is too short", job.corefilename);
+
+    /* The code body is the core image linked at page zero. */
+
+    std::vector<uint8_t> image = core;
+    for (uint16_t pos : memDifferences)
+        image[pos] -= 2;
 
-    /* Write the actual code body. */
+    /* Version 2 relocations are flagged in the zero page usage byte. */
 
+    if (relocationsV2)
     {
-        auto memi = memDifferences.begin();
-        std::ifstream is(corefilename);
-        unsigned pos = 0;
-        for (;;)
-        {
-            int b = is.get();
-            if (b == -1)
-                break;
-            if (pos == *memi)
-            {
-                b -= 2;
-                memi++;
-            }
-            outs.put(b);
-            pos++;
-        }
+        if (image[0] & COMHDR_ZP_RELV2)
+            error("{} uses too much zero page for version 2 relocations",
+                job.corefilename);
+        image[0] |= COMHDR_ZP_RELV2;
     }
 
     /* Patch the TPA byte to include the relocation data. */
 
+    uint16_t relOffset = image[2] | (image[3] << 8);
+    image[1] = std::max<uint8_t>(
+        image[1], (relOffset + reloBytesSize + 255) / 256);
+
+    /* Append the relocation bytes and write the lot. */
+
+    image.insert(image.end(), zpBytes.begin(), zpBytes.end());
+    image.insert(image.end(), memBytes.begin(), memBytes.end());
+
+    std::ofstream outs(job.outfilename, std::ofstream::binary);
+    outs.write((const char*)image.data(), image.size());
+    if (!outs.flush())
+        error("cannot write {}", job.outfilename);
+
+    if (verify)
+        verifyImage(job,
+            image,
+            core.size(),
+            core,
+            zp,
+            mem,
+            zpDifferences.size(),
+            memDifferences.size());
+}
+
+static std::vector<Job> readManifest(const std::string& filename)
+{
+    std::ifstream is(filename);
+    if (!is)
+        error("cannot open {}", filename);
+
+    std::vector<Job> jobs;
+    std::string line;
+    int lineno = 0;
+    while (std::getline(is, line))
     {
-        outs.seekg(1);
-        uint16_t tpaRequired = outs.get();
-        uint16_t relOffset = outs.get();
-        relOffset |= outs.get() << 8;
-        tpaRequired = std::max<uint8_t>(
-            tpaRequired, (relOffset + reloBytesSize + 255) / 256);
-        outs.seekp(1);
-        outs.put(tpaRequired);
-        outs.seekp(0, std::fstream::end);
+        lineno++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        Job job;
+        if (!(words >> job.corefilename))
+            continue;
+        if (!(words >> job.zpfilename >> job.memfilename >> job.outfilename))
+            error("{}:{}: expected core, zp, mem and output files",
+                filename,
+                lineno);
+        jobs.push_back(job);
     }
+    return jobs;
+}
+
+int main(int argc, char* const* argv)
+{
+    parseArguments(argc, argv);
 
-    /* Write the relocation bytes. */
+    if (batchfilename.empty())
+    {
+        link(job);
+        return 0;
+    }
+
+    /* Batch mode: each thread takes the next unclaimed job. Any failure
+     * exits the whole process. */
 
-    for (uint8_t b : zpBytes)
-        outs.put(b);
-    for (uint8_t b : memBytes)
-        outs.put(b);
+    auto jobs = readManifest(batchfilename);
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, jobs.size());
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(
+            [&]
+            {
+                for (;;)
+                {
+                    size_t j = next++;
+                    if (j >= jobs.size())
+                        return;
+                    link(jobs[j]);
+                }
+            });
+    for (auto& t : workers)
+        t.join();
 
     return 0;
 }
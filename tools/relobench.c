@@ -0,0 +1,298 @@
+/* Measures how many cycles the BIOS relocator (src/lib/relocate.S, wrapped
+ * by tests/relobench.S) takes to relocate programs, with their relocations in
+ * both the version 1 and version 2 formats (see doc/NOTES.md). Each program's
+ * own relocation table is decoded and encoded again in each format, both
+ * images are relocated under lib6502, and the results are checked against
+ * each other and against the relocations themselves.
+ *
+ * Usage: relobench <relocator.bin> <program.com>... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "third_party/lib6502/lib6502.h"
+
+#define RELOCATOR_ADDRESS 0x0200
+#define EXIT_ADDRESS 0xff00
+#define IMAGE_PAGE 0x10
+#define ZP_BASE 0x20
+#define COMHDR_ZP_RELV2 0x80 /* zero page usage flag for version 2 data */
+
+struct relocations
+{
+    uint16_t addresses[0x10000];
+    int count;
+};
+
+static uint8_t ram[0x10000];
+static M6502_TrapTable traps;
+static uint8_t relocator[0x1000];
+static size_t relocator_size;
+
+static void fatal(const char* s, ...)
+{
+    va_list ap;
+    va_start(ap, s);
+    fprintf(stderr, "relobench: ");
+    vfprintf(stderr, s, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static size_t read_file(const char* filename, uint8_t* buffer, size_t size)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        fatal("cannot open '%s': %s", filename, strerror(errno));
+    size_t len = fread(buffer, 1, size, fp);
+    if (!feof(fp))
+        fatal("'%s' is too big", filename);
+    fclose(fp);
+    return len;
+}
+
+/* Decoders; each returns the offset of the byte after the table. */
+
+static size_t decode_v1(
+    const uint8_t* table, size_t len, size_t i, struct relocations* r)
+{
+    uint16_t address = 0;
+    r->count = 0;
+    for (;;)
+    {
+        if (i == len)
+            fatal("truncated relocation table");
+        uint8_t b = table[i++];
+        for (int shift = 4; shift >= 0; shift -= 4)
+        {
+            uint8_t n = (b >> shift) & 0xf;
+            if (n == 0xf)
+                return i;
+            address += n;
+            if (n != 0xe)
+                r->addresses[r->count++] = address;
+        }
+    }
+}
+
+static size_t decode_v2(
+    const uint8_t* table, size_t len, size_t i, struct relocations* r)
+{
+    uint16_t page = 0;
+    r->count = 0;
+    for (;;)
+    {
+        if (i == len)
+            fatal("truncated relocation table");
+        uint8_t skip = table[i++];
+        if (skip == 0xff)
+            return i;
+        page += skip << 8;
+
+        uint8_t count = (i < len) ? table[i++] : 0;
+        if ((i + count) > len)
+            fatal("truncated relocation table");
+        while (count--)
+            r->addresses[r->count++] = page | table[i++];
+    }
+}
+
+/* Encoders; each returns the number of bytes written. */
+
+static size_t encode_v1(const struct relocations* r, uint8_t* out)
+{
+    size_t len = 0;
+    int nibbles = 0;
+    uint16_t pos = 0;
+
+#define NIBBLE(n)                                   \
+    do                                              \
+    {                                               \
+        if (nibbles++ & 1)                          \
+            out[len - 1] |= (n);                    \
+        else                                        \
+            out[len++] = (n) << 4;                  \
+    } while (0)
+
+    for (int i = 0; i < r->count; i++)
+    {
+        uint16_t delta = r->addresses[i] - pos;
+        while (delta >= 0xe)
+        {
+            NIBBLE(0xe);
+            delta -= 0xe;
+        }
+        NIBBLE(delta);
+        pos = r->addresses[i];
+    }
+    NIBBLE(0xf);
+#undef NIBBLE
+
+    return len;
+}
+
+static size_t encode_v2(const struct relocations* r, uint8_t* out)
+{
+    size_t len = 0;
+    unsigned page = 0;
+    int i = 0;
+    while (i < r->count)
+    {
+        unsigned group_page = r->addresses[i] >> 8;
+        int j = i;
+        while ((j < r->count) && ((r->addresses[j] >> 8) == group_page) &&
+               ((j - i) < 0xff))
+            j++;
+
+        out[len++] = group_page - page;
+        out[len++] = j - i;
+        for (; i < j; i++)
+            out[len++] = r->addresses[i];
+        page = group_page;
+    }
+    out[len++] = 0xff;
+    return len;
+}
+
+/* Runs the relocator over an image, returning the cycles it took. */
+
+static uint64_t relocate(
+    M6502* cpu, const uint8_t* image, size_t len, uint8_t* result)
+{
+    memset(ram, 0, sizeof(ram));
+    memcpy(&ram[RELOCATOR_ADDRESS], relocator, relocator_size);
+    memcpy(&ram[IMAGE_PAGE << 8], image, len);
+
+    /* Call it as a subroutine which returns to the trap. */
+
+    ram[0x1ff] = (EXIT_ADDRESS - 1) >> 8;
+    ram[0x1fe] = (EXIT_ADDRESS - 1) & 0xff;
+    cpu->registers->s = 0xfd;
+    cpu->registers->a = IMAGE_PAGE;
+    cpu->registers->x = ZP_BASE;
+    cpu->registers->y = 0;
+    cpu->registers->p = 0x20;
+    cpu->registers->pc = RELOCATOR_ADDRESS;
+    cpu->cycles = 0;
+
+    unsigned long budget = 100000000;
+    if (M6502_runUntil(cpu, traps, &budget) != M6502_Trapped)
+        fatal("the relocator didn't return");
+
+    memcpy(result, &ram[IMAGE_PAGE << 8], len);
+    return cpu->cycles;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 3)
+        fatal("usage: relobench <relocator.bin> <program.com>...");
+
+    relocator_size = read_file(argv[1], relocator, sizeof(relocator));
+    traps[EXIT_ADDRESS] = 1;
+    M6502* cpu = M6502_new(NULL, ram, NULL);
+
+    static uint8_t file[0x10000];
+    static uint8_t images[2][0x10000];
+    static uint8_t results[2][0x10000];
+    static uint8_t expected[0x10000];
+    static struct relocations zp, mem;
+    uint64_t totals[2] = {};
+    size_t total_sizes[2] = {};
+
+    printf("%-16s %7s %8s %8s %10s %10s %7s\n",
+        "program",
+        "fixups",
+        "v1 bytes",
+        "v2 bytes",
+        "v1 cycles",
+        "v2 cycles",
+        "speedup");
+    for (int arg = 2; arg < argc; arg++)
+    {
+        const char* filename = argv[arg];
+        size_t len = read_file(filename, file, sizeof(file));
+        if (len < 8)
+            fatal("'%s' is too short", filename);
+        size_t code = file[2] | (file[3] << 8);
+        if (code >= len)
+            fatal("'%s' has no relocation table", filename);
+        if ((len + (IMAGE_PAGE << 8)) > EXIT_ADDRESS)
+            fatal("'%s' is too big", filename);
+
+        size_t i = code;
+        if (file[0] & COMHDR_ZP_RELV2)
+            decode_v2(file, len, decode_v2(file, len, i, &zp), &mem);
+        else
+            decode_v1(file, len, decode_v1(file, len, i, &zp), &mem);
+
+        /* What the relocator should produce. */
+
+        memcpy(expected, file, code);
+        expected[0] &= ~COMHDR_ZP_RELV2;
+        for (int j = 0; j < zp.count; j++)
+            expected[zp.addresses[j]] += ZP_BASE;
+        for (int j = 0; j < mem.count; j++)
+            expected[mem.addresses[j]] += IMAGE_PAGE;
+
+        size_t sizes[2];
+        for (int v = 0; v < 2; v++)
+        {
+            uint8_t* p = images[v];
+            memcpy(p, file, code);
+            p[0] = expected[0] | (v ? COMHDR_ZP_RELV2 : 0);
+            p += code;
+            if (v)
+            {
+                p += encode_v2(&zp, p);
+                p += encode_v2(&mem, p);
+            }
+            else
+            {
+                p += encode_v1(&zp, p);
+                p += encode_v1(&mem, p);
+            }
+            sizes[v] = (p - images[v]) - code;
+        }
+
+        uint64_t cycles[2];
+        for (int v = 0; v < 2; v++)
+        {
+            cycles[v] =
+                relocate(cpu, images[v], code + sizes[v], results[v]);
+            if (memcmp(results[v], expected, code) != 0)
+                fatal("'%s' relocated wrongly with version %d relocations",
+                    filename,
+                    v + 1);
+            totals[v] += cycles[v];
+            total_sizes[v] += sizes[v];
+        }
+
+        const char* name = strrchr(filename, '/');
+        printf("%-16s %7d %8zu %8zu %10llu %10llu %6.2fx\n",
+            name ? (name + 1) : filename,
+            zp.count + mem.count,
+            sizes[0],
+            sizes[1],
+            (unsigned long long)cycles[0],
+            (unsigned long long)cycles[1],
+            (double)cycles[0] / cycles[1]);
+    }
+
+    printf("%-16s %7s %8zu %8zu %10llu %10llu %6.2fx\n",
+        "total",
+        "",
+        total_sizes[0],
+        total_sizes[1],
+        (unsigned long long)totals[0],
+        (unsigned long long)totals[1],
+        (double)totals[0] / totals[1]);
+
+    M6502_delete(cpu);
+    return 0;
+}